@@ -0,0 +1,519 @@
+#!/usr/bin/env python3
+#
+# paps-bench.py - layout and rendering throughput of paps
+#
+# Generates a fixed corpus and runs paps on it for each output format,
+# reporting lines/s, pages/s, peak RSS and the time spent in layout and in
+# drawing, as reported by paps --stats. The corpus is generated from a fixed seed, so results can be
+# compared across commits on the same machine.
+#
+# With --baseline, the throughput of each case and of each stage is checked
+# against the results of an earlier --json run, and the script fails if any
+# fell by more than --max-regression percent. With --reference, the output
+# of paps is compared with that of another paps, such as one built from an
+# earlier commit or with meson -Dsimd=false, and the script fails if any
+# differ: the PostScript of each case, whether rendering the invalid text of
+# the edge cases fails in both, and the layout reports of --format=null where
+# both have it. The cases with NUL characters must also come out the same
+# with --stream and --max-memory as without, and the lines of the ASCII
+# cases with punctuation must be broken by --fast-ascii as by pango. Options that only make paps faster are left out for a
+# reference that lacks them, so that paps from before they were added can
+# be the reference.
+#
+# This program is free software; you can redistribute it and/or
+# modify it under the terms of the GNU Library General Public
+# License as published by the Free Software Foundation; either
+# version 2 of the License, or (at your option) any later version.
+
+import argparse
+import hashlib
+import json
+import os
+import random
+import re
+import statistics
+import subprocess
+import sys
+import tempfile
+import time
+
+SEED = 20050101
+
+WORDS = ('error warning info debug connection request response timeout '
+         'server client cache worker queue socket retry failed accepted '
+         'closed opened user session token upload download').split()
+
+CJK = ''.join(chr(c) for c in range(0x4e00, 0x4e00 + 800)) \
+    + ''.join(chr(c) for c in range(0x3041, 0x3097))
+ARABIC = ['مرحبا', 'كتاب',
+          'العالم', 'سلام',
+          'مدينة', 'بيت']
+HEBREW = ['שלום', 'עולם',
+          'ספר', 'בית',
+          'עיר', 'מים']
+
+
+def gen_ascii_log(rng, lines):
+    out = []
+    for i in range(lines):
+        words = ' '.join(rng.choice(WORDS) for _ in range(rng.randint(3, 18)))
+        out.append('2024-01-%02d %02d:%02d:%02d.%03d [%5d] %s\n'
+                   % (1 + i % 28, i % 24, i % 60, (i * 7) % 60, i % 1000,
+                      rng.randint(1, 99999), words))
+        if i % 500 == 499:
+            out.append('\f')
+    return ''.join(out)
+
+
+def gen_cjk(rng, lines):
+    return ''.join(''.join(rng.choice(CJK) for _ in range(rng.randint(20, 300)))
+                   + '\n' for _ in range(lines))
+
+
+def gen_rtl(rng, lines):
+    out = []
+    for _ in range(lines):
+        words = ARABIC if rng.random() < 0.5 else HEBREW
+        out.append(' '.join(rng.choice(words)
+                            for _ in range(rng.randint(4, 30))) + '\n')
+    return ''.join(out)
+
+
+def gen_markup(rng, lines):
+    tags = [('<b>', '</b>'), ('<i>', '</i>'), ('<tt>', '</tt>'),
+            ('<span foreground="red">', '</span>'),
+            ('<span size="large">', '</span>'), ('<u>', '</u>')]
+    out = []
+    for _ in range(lines):
+        parts = []
+        for _ in range(rng.randint(3, 15)):
+            word = rng.choice(WORDS)
+            if rng.random() < 0.4:
+                start, end = rng.choice(tags)
+                word = start + word + end
+            parts.append(word)
+        out.append(' '.join(parts) + ' &amp; &lt;more&gt;\n')
+    return ''.join(out)
+
+
+def gen_edge_bytes(rng, lines):
+    """Mixed line ends, form feeds, tabs, very long lines, invalid bytes and
+    truncated sequences, as raw bytes in surrogateescape. A NUL would end
+    the text for paps, so there is none."""
+    out = []
+    for _ in range(lines):
+        kind = rng.random()
+        if kind < 0.01:
+            line = ''.join(rng.choice(CJK) for _ in range(rng.randint(2000, 20000)))
+        elif kind < 0.15:
+            line = ''.join(rng.choice(WORDS) + rng.choice(' \t')
+                           for _ in range(rng.randint(1, 20)))
+        elif kind < 0.25:
+            # A byte that never starts a sequence, or the head of one
+            line = rng.choice(WORDS) + rng.choice(['\udcff', '\udc80', '\udce4\udcb8',
+                                                   '\udcf0\udc9f']) + rng.choice(WORDS)
+        else:
+            line = ' '.join(rng.choice(CJK + ''.join(WORDS))
+                            for _ in range(rng.randint(1, 60)))
+        out.append(line + rng.choice(['\n', '\n', '\r\n', '\r', '\f', '\n\f']))
+    return ''.join(out)
+
+
+def gen_nul_lines(rng, lines):
+    """Lines with a NUL character, which ends the line, some of them followed
+    by enough text for the line to go on in the next chunk of --stream and
+    --max-memory."""
+    out = []
+    for _ in range(lines):
+        line = ' '.join(rng.choice(WORDS) for _ in range(rng.randint(1, 12)))
+        kind = rng.random()
+        if kind < 0.01:
+            line += '\0' + 'x' * rng.randint(70000, 200000)
+        elif kind < 0.2:
+            pos = rng.randint(0, len(line))
+            line = line[:pos] + '\0' + line[pos:]
+        out.append(line + '\n')
+    return ''.join(out)
+
+
+def gen_ascii_punct(rng, lines):
+    """ASCII with the punctuation where the line breaks of UAX #14 differ
+    from breaking after spaces and hyphens."""
+    pieces = ['1-foo', 'a/b', 'x)-(y', '(see', 'this)', '[tag]', '{x}', 'e.g.',
+              'x--y', 'a-', '-b', 'foo,bar', 'http://example.com/a-b/c?d=e',
+              '10%', '$5', 'a+b', 'x=y;', '"quoted"', "'q'", 'a|b', 'key:value']
+    return ''.join(' '.join(rng.choice(pieces + WORDS)
+                            for _ in range(rng.randint(5, 60))) + '\n'
+                   for _ in range(lines))
+
+
+def gen_long_lines(rng, lines):
+    return ''.join(''.join(rng.choice('abcdefghijklmnopqrstuvwxyz0123456789')
+                           for _ in range(rng.randint(100, 2000))) + '\n'
+                   for _ in range(lines))
+
+
+# name, generator, number of lines at scale 1, paps options
+CASES = [
+    ('ascii-log', gen_ascii_log, 100000, []),
+    ('ascii-log-fast', gen_ascii_log, 100000, ['--fast-ascii']),
+    ('cjk-wide', gen_cjk, 10000, []),
+    ('rtl', gen_rtl, 20000, ['--rtl']),
+    ('markup', gen_markup, 20000, ['--markup']),
+    ('cpi-clip', gen_long_lines, 20000, ['--cpi=12']),
+    ('columns-landscape', gen_ascii_log, 50000, ['--landscape', '--columns=3']),
+]
+
+# Not benchmarked, as rendering fails on their invalid bytes. With
+# --reference, both paps must fail on them, and lay them out alike with
+# --format=null.
+EDGE_CASES = [
+    ('edge-bytes', gen_edge_bytes, 20000, []),
+    ('edge-bytes-cpi', gen_edge_bytes, 20000, ['--cpi=12']),
+    ('edge-bytes-stream', gen_edge_bytes, 20000, ['--stream']),
+]
+
+# Not benchmarked. With --reference, paps must render them the same way in
+# each of the modes reading the input in chunks.
+MODE_CASES = [
+    ('nul-lines', gen_nul_lines, 20000, []),
+]
+MODE_OPTIONS = [['--stream'], ['--max-memory=1']]
+
+# Not benchmarked. With --reference, --fast-ascii must break their lines
+# where pango does, as compared by the layout reports of --format=null.
+FAST_ASCII_CASES = [
+    ('ascii-punct', gen_ascii_punct, 5000, []),
+    ('ascii-punct-word-char', gen_ascii_punct, 5000, ['--wrap=word-char']),
+    ('ascii-punct-columns', gen_ascii_punct, 5000, ['--landscape', '--columns=3']),
+]
+
+STAGES = ['read', 'iconv', 'split_paragraphs', 'split_lines', 'output']
+
+FORMATS = ['ps', 'pdf', 'svg']
+
+
+def corpus_file(corpus, name, generator, lines, scale):
+    """Write the input of a case unless it exists already."""
+    path = os.path.join(corpus, '%s-x%g.txt' % (name, scale))
+    if not os.path.exists(path):
+        rng = random.Random('%d-%s' % (SEED, name))
+        text = generator(rng, max(1, int(lines * scale)))
+        tmp = path + '.tmp'
+        with open(tmp, 'w', encoding='utf-8', errors='surrogateescape') as f:
+            f.write(text)
+        os.rename(tmp, path)
+    return path
+
+
+def run(cmd, env):
+    """Run paps with --stats, returning wall time in seconds, peak RSS in KiB
+    and the statistics printed by paps."""
+    with open(os.devnull, 'wb') as devnull, tempfile.TemporaryFile() as err:
+        start = time.perf_counter()
+        proc = subprocess.Popen(cmd + ['--stats'], stdout=devnull, stderr=err,
+                                env=env)
+        _, status, rusage = os.wait4(proc.pid, 0)
+        elapsed = time.perf_counter() - start
+        proc.returncode = os.WEXITSTATUS(status) if os.WIFEXITED(status) else -1
+        err.seek(0)
+        stderr = err.read().decode(errors='replace')
+    if proc.returncode != 0:
+        raise RuntimeError('%s exited with status %d'
+                           % (' '.join(cmd), proc.returncode))
+    stats = {}
+    for line in stderr.splitlines():
+        key, sep, value = line.partition('=')
+        if sep and key.startswith('stats.'):
+            stats[key[len('stats.'):]] = float(value)
+    return elapsed, rusage.ru_maxrss, stats
+
+
+# Stages of paps --stats making up the layout, the rest is drawing
+LAYOUT_STAGES = ['read', 'split_paragraphs', 'split_lines']
+
+
+def bench_case(args, env, name, path, options, num_lines):
+    results = []
+
+    for fmt in args.formats:
+        times = []
+        layout_times = []
+        draw_times = []
+        cpu_times = []
+        stage_times = {s: [] for s in STAGES}
+        peak_rss = 0
+        pages = 0
+        for _ in range(args.runs):
+            elapsed, rss, stats = run([args.paps, '--format=' + fmt] + options + [path], env)
+            times.append(elapsed)
+            layout_times.append(sum(stats.get(s + '.wall_seconds', 0.0)
+                                    for s in LAYOUT_STAGES))
+            draw_times.append(stats.get('output.wall_seconds', 0.0))
+            cpu_times.append(stats.get('total.cpu_seconds', 0.0))
+            for s in STAGES:
+                stage_times[s].append(stats.get(s + '.wall_seconds', 0.0))
+            peak_rss = max(peak_rss, rss)
+            pages = int(stats.get('pages', 0))
+        total = statistics.median(times)
+        num_bytes = os.path.getsize(path)
+        stages = {}
+        for s in STAGES:
+            seconds = statistics.median(stage_times[s])
+            stages[s] = {'seconds': seconds,
+                         'bytes_per_second': num_bytes / seconds if seconds > 0 else 0.0}
+        results.append({
+            'case': name,
+            'format': fmt,
+            'lines': num_lines,
+            'bytes': num_bytes,
+            'pages': pages,
+            'seconds': total,
+            'min_seconds': min(times),
+            'stdev_seconds': statistics.stdev(times) if len(times) > 1 else 0.0,
+            'layout_seconds': statistics.median(layout_times),
+            'draw_seconds': statistics.median(draw_times),
+            'cpu_seconds': statistics.median(cpu_times),
+            'lines_per_second': num_lines / total if total > 0 else 0.0,
+            'pages_per_second': pages / total if total > 0 else 0.0,
+            'peak_rss_kib': peak_rss,
+            'stages': stages,
+        })
+    return results
+
+
+# Stages taking less than this are too noisy to compare
+MIN_STAGE_SECONDS = 0.05
+
+
+def check_regressions(results, baseline_file, max_regression):
+    """Return a line for each throughput that fell by more than
+    max_regression percent since the baseline run."""
+    with open(baseline_file) as f:
+        baseline = {(r['case'], r['format']): r for r in json.load(f)['results']}
+    limit = 1.0 - max_regression / 100.0
+    failures = []
+    for r in results:
+        base = baseline.get((r['case'], r['format']))
+        if base is None:
+            continue
+        checks = [('lines/s', base['lines_per_second'], r['lines_per_second'])]
+        for s, stage in base.get('stages', {}).items():
+            if stage['seconds'] >= MIN_STAGE_SECONDS and s in r['stages']:
+                checks.append((s + ' bytes/s', stage['bytes_per_second'],
+                               r['stages'][s]['bytes_per_second']))
+        for name, before, now in checks:
+            if before > 0 and now < before * limit:
+                failures.append('%s %s: %s %.0f -> %.0f (%+.1f%%)'
+                                % (r['case'], r['format'], name, before, now,
+                                   100.0 * (now - before) / before))
+    return failures
+
+
+# Options that only change how fast paps is, not its output
+SPEED_OPTIONS = ['--fast-ascii', '--jobs', '--stream']
+
+# Lines of the PostScript that differ from one run to the next
+VOLATILE_PREFIXES = (b'%%CreationDate:',)
+
+
+def paps_features(paps, env):
+    """The long options of paps, from its --help-all, and whether it has
+    --format=null."""
+    proc = subprocess.run([paps, '--help-all'], stdout=subprocess.PIPE,
+                          stderr=subprocess.DEVNULL, env=env)
+    text = proc.stdout.decode(errors='replace')
+    options = set(re.findall(r'(--[a-z][a-z-]*)', text))
+    has_null = any('--format' in line and 'null' in line
+                   for line in text.splitlines())
+    return options, has_null
+
+
+def reference_options(options, features):
+    """The options for the reference, without the speed options it lacks,
+    or None if it lacks any other."""
+    kept = []
+    for option in options:
+        name = option.split('=')[0]
+        if name in features:
+            kept.append(option)
+        elif name not in SPEED_OPTIONS:
+            return None
+    return kept
+
+
+def render_digest(paps, path, options, env):
+    """Whether paps rendered the input to PostScript, and a digest of the
+    output without its volatile lines, or of the error if it failed."""
+    with tempfile.TemporaryFile() as out:
+        proc = subprocess.run([paps, '--format=ps'] + options + [path],
+                              stdout=out, stderr=subprocess.PIPE, env=env)
+        if proc.returncode != 0:
+            return False, proc.stderr.decode(errors='replace').strip()
+        out.seek(0)
+        digest = hashlib.sha256()
+        for line in out:
+            if not line.startswith(VOLATILE_PREFIXES):
+                digest.update(line)
+    return True, digest.hexdigest()
+
+
+def layout_report(paps, path, options, env):
+    """The --format=null report of paps for the input."""
+    proc = subprocess.run([paps, '--format=null'] + options + [path],
+                          stdout=subprocess.PIPE, stderr=subprocess.PIPE, env=env)
+    if proc.returncode != 0:
+        raise RuntimeError('%s exited with status %d: %s'
+                           % (paps, proc.returncode, proc.stderr.decode(errors='replace')))
+    return json.loads(proc.stdout)
+
+
+def check_modes(args, env, cases):
+    """Return a line for each case that paps renders differently when it
+    reads the input in chunks."""
+    failures = []
+    for name, path, options in cases:
+        whole = render_digest(args.paps, path, options, env)
+        for mode in MODE_OPTIONS:
+            if render_digest(args.paps, path, options + mode, env) != whole:
+                failures.append('%s %s: rendered differently than without %s'
+                                % (name, ' '.join(options + mode), ' '.join(mode)))
+    return failures
+
+
+def check_fast_ascii(args, env, cases):
+    """Return a line for each case whose lines --fast-ascii breaks
+    elsewhere than pango."""
+    failures = []
+    for name, path, options in cases:
+        pango = layout_report(args.paps, path, options, env)
+        fast = layout_report(args.paps, path, options + ['--fast-ascii'], env)
+        if fast != pango:
+            keys = sorted(k for k in set(fast) | set(pango) if fast.get(k) != pango.get(k))
+            failures.append('%s %s: %s differ with --fast-ascii'
+                            % (name, ' '.join(options), ', '.join(keys)))
+    return failures
+
+
+def check_reference(args, env, cases, edge_cases):
+    """Return a line for each case rendered or laid out differently by the
+    reference, and print the cases it can not be compared on."""
+    failures = []
+    ours_features, ours_null = paps_features(args.paps, env)
+    theirs_features, theirs_null = paps_features(args.reference, env)
+    for name, path, options, must_fail in cases + edge_cases:
+        for extra in ([], ['--fast-ascii'], ['--jobs=4']):
+            ours_options = options + extra
+            theirs_options = reference_options(ours_options, theirs_features)
+            label = '%s %s' % (name, ' '.join(ours_options))
+            if theirs_options is None or \
+                    reference_options(ours_options, ours_features) != ours_options:
+                print('SKIP %s: not an option of both' % label)
+                continue
+            ours_ok, ours = render_digest(args.paps, path, ours_options, env)
+            theirs_ok, theirs = render_digest(args.reference, path, theirs_options, env)
+            if ours_ok != theirs_ok:
+                failures.append('%s: %s, the reference %s'
+                                % (label, 'rendered' if ours_ok else 'failed: ' + ours,
+                                   'rendered' if theirs_ok else 'failed: ' + theirs))
+            elif ours_ok and ours != theirs:
+                failures.append('%s: the PostScript differs from the reference' % label)
+            elif must_fail and ours_ok:
+                failures.append('%s: rendered the invalid text' % label)
+            if must_fail and not ours_ok and not ours:
+                failures.append('%s: failed without an error' % label)
+
+            if ours_null and theirs_null:
+                ours = layout_report(args.paps, path, ours_options, env)
+                theirs = layout_report(args.reference, path, theirs_options, env)
+                if ours != theirs:
+                    keys = sorted(k for k in set(ours) | set(theirs)
+                                  if ours.get(k) != theirs.get(k))
+                    failures.append('%s: %s differ from the reference'
+                                    % (label, ', '.join(keys)))
+    return failures
+
+
+def main():
+    parser = argparse.ArgumentParser(description='Benchmark paps throughput.')
+    parser.add_argument('--paps', default='paps', help='paps executable')
+    parser.add_argument('--corpus', default='paps-bench-corpus',
+                        help='directory for the generated input files')
+    parser.add_argument('--runs', type=int, default=5,
+                        help='runs per measurement, the median is reported')
+    parser.add_argument('--scale', type=float, default=1.0,
+                        help='factor for the size of the inputs')
+    parser.add_argument('--formats', default=','.join(FORMATS),
+                        help='comma separated output formats')
+    parser.add_argument('--cases', default=None,
+                        help='comma separated cases, default all of: '
+                        + ', '.join(c[0] for c in CASES))
+    parser.add_argument('--json', default=None,
+                        help='also write the results to this file')
+    parser.add_argument('--baseline', default=None,
+                        help='results of an earlier --json run to check against')
+    parser.add_argument('--max-regression', type=float, default=10.0,
+                        help='percent by which a throughput may fall below '
+                        'the baseline')
+    parser.add_argument('--reference', default=None,
+                        help='paps executable whose output must be the same')
+    args = parser.parse_args()
+    args.formats = [f for f in args.formats.split(',') if f]
+    wanted = args.cases.split(',') if args.cases else None
+
+    os.makedirs(args.corpus, exist_ok=True)
+    env = dict(os.environ, LC_ALL='C.UTF-8')
+
+    print('%-18s %-4s %9s %7s %11s %9s %8s %8s %10s'
+          % ('case', 'fmt', 'lines/s', 'pages/s', 'seconds', 'layout', 'draw',
+             '+-', 'peak RSS'))
+    results = []
+    laid_out = []
+    for name, generator, lines, options in CASES:
+        if wanted and name not in wanted:
+            continue
+        path = corpus_file(args.corpus, name, generator, lines, args.scale)
+        laid_out.append((name, path, options, False))
+        with open(path, encoding='utf-8') as f:
+            num_lines = sum(1 for _ in f)
+        for r in bench_case(args, env, name, path, options, num_lines):
+            results.append(r)
+            print('%-18s %-4s %9.0f %7.1f %11.3f %9.3f %8.3f %8.3f %7d KiB'
+                  % (r['case'], r['format'], r['lines_per_second'],
+                     r['pages_per_second'], r['seconds'], r['layout_seconds'],
+                     r['draw_seconds'], r['stdev_seconds'], r['peak_rss_kib']))
+            sys.stdout.flush()
+
+    if args.json:
+        with open(args.json, 'w') as f:
+            json.dump({'runs': args.runs, 'scale': args.scale,
+                       'results': results}, f, indent=2)
+
+    failures = []
+    if args.baseline:
+        failures += check_regressions(results, args.baseline, args.max_regression)
+    if args.reference:
+        edge = []
+        for name, generator, lines, options in EDGE_CASES:
+            if not wanted or name in wanted:
+                edge.append((name, corpus_file(args.corpus, name, generator,
+                                               lines, args.scale), options, True))
+        failures += check_reference(args, env, laid_out, edge)
+        failures += check_modes(args, env,
+                                [(name, corpus_file(args.corpus, name, generator,
+                                                    lines, args.scale), options)
+                                 for name, generator, lines, options in MODE_CASES
+                                 if not wanted or name in wanted])
+        failures += check_fast_ascii(args, env,
+                                     [(name, corpus_file(args.corpus, name, generator,
+                                                         lines, args.scale), options)
+                                      for name, generator, lines, options in FAST_ASCII_CASES
+                                      if not wanted or name in wanted])
+    for failure in failures:
+        print('FAIL ' + failure)
+    if failures:
+        sys.exit(1)
+
+
+if __name__ == '__main__':
+    main()
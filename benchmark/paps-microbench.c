@@ -0,0 +1,289 @@
+/* Pango
+ * paps-microbench.c: Throughput of each stage of paps on its own.
+ *
+ * Copyright (C) 2002, 2005 Dov Grobgeld <dov.grobgeld@gmail.com>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ *
+ */
+
+#include <locale.h>
+#include <stdio.h>
+#include <string.h>
+#include <config.h>
+#include "paps.h"
+#include "paps-text.h"
+#include "text-bytewise.h"
+
+/* The scanning of the text is timed with the SSE2 or NEON paths and with
+ * the bytewise ones, and the layout and the drawing through libpaps,
+ * which prints the time of the stages inside paps with --stats.
+ */
+
+static double seconds_per_case = 0.5;
+
+static const char *const words[] = {
+  "error", "warning", "info", "debug", "connection", "request", "timeout",
+  "server", "client", "cache", "worker", "queue", "socket", "retry",
+};
+
+/* Generated from a fixed seed, as in paps-bench.py */
+static GString *
+gen_text (const char *kind,
+          gsize       size)
+{
+  GRand *rand = g_rand_new_with_seed (20050101);
+  GString *text = g_string_sized_new (size + 1024);
+
+  while (text->len < size)
+    {
+      int i, n = g_rand_int_range (rand, 3, 18);
+
+      for (i = 0; i < n; i++)
+        {
+          if (strcmp (kind, "cjk") == 0)
+            g_string_append_unichar (text, g_rand_int_range (rand, 0x4e00, 0x4e00 + 800));
+          else if (strcmp (kind, "mixed") == 0 && g_rand_int_range (rand, 0, 4) == 0)
+            g_string_append (text, g_rand_boolean (rand) ? "caf\xc3\xa9" : "\xe4\xb8\xad\xe6\x96\x87");
+          else
+            g_string_append (text, words[g_rand_int_range (rand, 0, G_N_ELEMENTS (words))]);
+          g_string_append_c (text, ' ');
+        }
+      g_string_append (text, strcmp (kind, "mixed") == 0 && g_rand_int_range (rand, 0, 3) == 0 ? "\r\n" : "\n");
+    }
+
+  g_rand_free (rand);
+
+  return text;
+}
+
+typedef struct {
+  gsize     (*ascii_prefix_length)  (const char *, gsize);
+  gboolean  (*utf8_validate)        (const char *, gsize, const char **);
+  const char *(*find_paragraph_break) (const char *, const char *);
+  gsize     (*cpi_clip_length)      (const char *, gsize, gsize, gboolean *);
+} text_funcs_t;
+
+static const text_funcs_t simd_funcs = {
+  ascii_prefix_length, utf8_validate, find_paragraph_break, cpi_clip_length
+};
+static const text_funcs_t bytewise_funcs = {
+  bytewise_ascii_prefix_length, bytewise_utf8_validate,
+  bytewise_find_paragraph_break, bytewise_cpi_clip_length
+};
+
+/* Each stage goes over the whole text once, as paps does, and returns a
+ * value depending on the result, so that it is not optimized away.
+ */
+static gsize
+stage_ascii_prefix (const text_funcs_t *funcs,
+                    GString            *text)
+{
+  const char *p = text->str, *end = text->str + text->len;
+  gsize sum = 0;
+
+  while (p < end)
+    {
+      gsize n = funcs->ascii_prefix_length (p, end - p);
+
+      sum += n;
+      p = p + n < end ? g_utf8_next_char (p + n) : end;
+    }
+
+  return sum;
+}
+
+static gsize
+stage_validate (const text_funcs_t *funcs,
+                GString            *text)
+{
+  const char *valid_end;
+
+  return funcs->utf8_validate (text->str, text->len, &valid_end) + (valid_end - text->str);
+}
+
+static gsize
+stage_paragraphs (const text_funcs_t *funcs,
+                  GString            *text)
+{
+  const char *p = text->str, *end = text->str + text->len;
+  gsize num_paragraphs = 0;
+
+  for (; p < end; p++, num_paragraphs++)
+    if ((p = funcs->find_paragraph_break (p, end)) == end)
+      break;
+
+  return num_paragraphs;
+}
+
+static gsize
+stage_cpi_clip (const text_funcs_t *funcs,
+                GString            *text)
+{
+  const char *p = text->str, *end = text->str + text->len;
+  gsize sum = 0;
+
+  while (p < end)
+    {
+      const char *brk = funcs->find_paragraph_break (p, end);
+      gboolean clipped;
+
+      sum += funcs->cpi_clip_length (p, brk - p, 40, &clipped) + clipped;
+      p = brk + 1;
+    }
+
+  return sum;
+}
+
+static const struct {
+  const char *name;
+  gsize     (*run) (const text_funcs_t *funcs, GString *text);
+} text_stages[] = {
+  { "ascii_prefix_length", stage_ascii_prefix },
+  { "utf8_validate", stage_validate },
+  { "find_paragraph_break", stage_paragraphs },
+  { "cpi_clip_length", stage_cpi_clip },
+};
+
+/* Bytes per second of the best of the runs done in seconds_per_case, at
+ * least one.
+ */
+static double
+time_text_stage (int                 stage,
+                 const text_funcs_t *funcs,
+                 GString            *text,
+                 gsize              *result)
+{
+  gint64 start = g_get_monotonic_time (), best = G_MAXINT64, now = start;
+
+  do
+    {
+      gint64 before = now;
+
+      *result = text_stages[stage].run (funcs, text);
+      now = g_get_monotonic_time ();
+      best = MIN (best, MAX (now - before, 1));
+    }
+  while (now - start < seconds_per_case * G_USEC_PER_SEC);
+
+  return (double)text->len * G_USEC_PER_SEC / best;
+}
+
+static gboolean
+discard_output (gpointer      closure,
+                const guchar *data,
+                gsize         length)
+{
+  return TRUE;
+}
+
+/* Render the text once with the options, for the --stats of paps, and
+ * return the time it took in seconds.
+ */
+static double
+time_render (const char *name,
+             const char *format,
+             GString    *text)
+{
+  char *args[] = { "paps", (char *)format, "--stats", NULL }, **argv = args;
+  int argc = 3;
+  GError *error = NULL;
+  paps_t *paps;
+  gint64 start;
+
+  if ((paps = paps_new (&argc, &argv, &error)) == NULL)
+    g_error ("%s", error->message);
+
+  g_printerr ("# %s %s\n", name, format);
+  start = g_get_monotonic_time ();
+  if (!paps_render (paps, text->str, text->len, name, discard_output, NULL, &error))
+    g_error ("%s: %s", name, error->message);
+  start = g_get_monotonic_time () - start;
+  paps_free (paps);
+
+  return (double)start / G_USEC_PER_SEC;
+}
+
+int
+main (int    argc,
+      char **argv)
+{
+  static const char *const kinds[] = { "ascii", "cjk", "mixed" };
+  gboolean no_render = FALSE;
+  double seconds = seconds_per_case;
+  gsize size = 8 << 20;
+  GOptionEntry entries[] = {
+    { "seconds", 0, 0, G_OPTION_ARG_DOUBLE, &seconds,
+      "Time each scanning stage for this long, the best run is reported. (Default: 0.5)", "SECONDS" },
+    { "no-render", 0, 0, G_OPTION_ARG_NONE, &no_render,
+      "Only time the scanning of the text.", NULL },
+    { NULL }
+  };
+  GOptionContext *ctxt = g_option_context_new ("- throughput of each stage of paps");
+  GError *error = NULL;
+  gsize k;
+
+  setlocale (LC_ALL, "");
+
+  g_option_context_add_main_entries (ctxt, entries, NULL);
+  if (!g_option_context_parse (ctxt, &argc, &argv, &error))
+    {
+      g_printerr ("%s: %s\n", argv[0], error->message);
+      return 1;
+    }
+  g_option_context_free (ctxt);
+  seconds_per_case = seconds;
+
+  printf ("%-6s %-21s %12s %12s %7s\n", "text", "stage", "SIMD MB/s", "bytewise", "ratio");
+  for (k = 0; k < G_N_ELEMENTS (kinds); k++)
+    {
+      GString *text = gen_text (kinds[k], size);
+      gsize s;
+
+      for (s = 0; s < G_N_ELEMENTS (text_stages); s++)
+        {
+          gsize simd_result, bytewise_result;
+          double simd = time_text_stage (s, &simd_funcs, text, &simd_result);
+          double bytewise = time_text_stage (s, &bytewise_funcs, text, &bytewise_result);
+
+          if (simd_result != bytewise_result)
+            g_error ("%s %s: the SIMD and bytewise results differ", kinds[k], text_stages[s].name);
+          printf ("%-6s %-21s %12.1f %12.1f %7.2f\n", kinds[k], text_stages[s].name,
+                  simd / 1e6, bytewise / 1e6, simd / bytewise);
+          fflush (stdout);
+        }
+      g_string_free (text, TRUE);
+    }
+
+  /* The layout alone, and with the drawing, from paps_render() */
+  if (!no_render)
+    {
+      printf ("\n%-6s %-21s %12s\n", "text", "stage", "MB/s");
+      for (k = 0; k < G_N_ELEMENTS (kinds); k++)
+        {
+          GString *text = gen_text (kinds[k], size / 8);
+          double layout = time_render (kinds[k], "--format=null", text);
+          double render = time_render (kinds[k], "--format=ps", text);
+
+          printf ("%-6s %-21s %12.1f\n", kinds[k], "layout", text->len / layout / 1e6);
+          printf ("%-6s %-21s %12.1f\n", kinds[k], "draw", text->len / MAX (render - layout, 1e-6) / 1e6);
+          fflush (stdout);
+          g_string_free (text, TRUE);
+        }
+    }
+
+  return 0;
+}
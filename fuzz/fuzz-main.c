@@ -0,0 +1,74 @@
+/* Pango
+ * fuzz-main.c: Running a fuzz target of paps on files, without libFuzzer.
+ *
+ * Copyright (C) 2002, 2005 Dov Grobgeld <dov.grobgeld@gmail.com>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ *
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <config.h>
+#include "fuzz.h"
+
+/* Each file given is passed to the target once, or the standard input if
+ * there are none, as for replaying the crashes found by a fuzzer built
+ * with another compiler.
+ */
+int
+main (int    argc,
+      char **argv)
+{
+  int i;
+
+  LLVMFuzzerInitialize (&argc, &argv);
+
+  if (argc < 2)
+    {
+      GString *input = g_string_new (NULL);
+      char buf[65536];
+      size_t n;
+
+      while ((n = fread (buf, 1, sizeof buf, stdin)) > 0)
+        g_string_append_len (input, buf, n);
+      LLVMFuzzerTestOneInput ((const guint8 *)input->str, input->len);
+      g_string_free (input, TRUE);
+    }
+
+  for (i = 1; i < argc; i++)
+    {
+      GError *error = NULL;
+      gchar *contents;
+      guint8 *data;
+      gsize length;
+
+      if (!g_file_get_contents (argv[i], &contents, &length, &error))
+        {
+          g_printerr ("%s: %s\n", argv[0], error->message);
+          g_error_free (error);
+          return 1;
+        }
+      /* An exact copy, for the sanitizers to catch reading past its end */
+      data = g_malloc (MAX (length, 1));
+      memcpy (data, contents, length);
+      LLVMFuzzerTestOneInput (data, length);
+      g_free (data);
+      g_free (contents);
+    }
+
+  return 0;
+}
@@ -0,0 +1,98 @@
+/* Pango
+ * fuzz-render.c: Fuzzing the input reader and the layout of paps.
+ *
+ * Copyright (C) 2002, 2005 Dov Grobgeld <dov.grobgeld@gmail.com>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ *
+ */
+
+#include <locale.h>
+#include <config.h>
+#include "paps.h"
+#include "fuzz.h"
+
+/* The options of the contexts, the first byte of the input chooses one and
+ * the rest is the text. They read the text in the chunks of the stream and
+ * of --max-memory, through iconv, and split it in --cpi columns, with the
+ * layout of --format=null but for one, which draws the pages.
+ */
+static const char *const options[][4] = {
+  { "--format=null" },
+  { "--format=null", "--fast-ascii" },
+  { "--format=null", "--cpi=12", "--fast-ascii" },
+  { "--format=null", "--stream" },
+  { "--format=null", "--max-memory=1" },
+  { "--format=null", "--encoding=ISO-8859-1" },
+  { "--format=null", "--encoding=SHIFT_JIS" },
+  { "--format=null", "--wrap=char", "--columns=2" },
+  { "--format=null", "--jobs=2" },
+  { "--format=ps", "--header" },
+};
+
+static paps_t *contexts[G_N_ELEMENTS (options)];
+
+static gboolean
+discard_output (gpointer      closure,
+                const guchar *data,
+                gsize         length)
+{
+  return TRUE;
+}
+
+int
+LLVMFuzzerInitialize (int    *argc,
+                      char ***argv)
+{
+  gsize i;
+
+  setlocale (LC_ALL, "");
+
+  for (i = 0; i < G_N_ELEMENTS (options); i++)
+    {
+      char *args[G_N_ELEMENTS (options[0]) + 2] = { "paps" }, **argv_i = args;
+      int argc_i = 1;
+      GError *error = NULL;
+      gsize j;
+
+      for (j = 0; j < G_N_ELEMENTS (options[i]) && options[i][j]; j++)
+        args[argc_i++] = (char *)options[i][j];
+      contexts[i] = paps_new (&argc_i, &argv_i, &error);
+      if (contexts[i] == NULL)
+        g_error ("%s: %s", options[i][0], error->message);
+    }
+
+  return 0;
+}
+
+/* Invalid text is expected to fail, anything else must not crash, leak or
+ * hang.
+ */
+int
+LLVMFuzzerTestOneInput (const guint8 *data,
+                        size_t        size)
+{
+  GError *error = NULL;
+
+  if (size == 0)
+    return 0;
+
+  if (!paps_render (contexts[data[0] % G_N_ELEMENTS (contexts)], (const gchar *)data + 1,
+                    size - 1, "fuzz", discard_output, NULL, &error))
+    g_error_free (error);
+
+  return 0;
+}
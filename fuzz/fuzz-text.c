@@ -0,0 +1,136 @@
+/* Pango
+ * fuzz-text.c: Fuzzing the scanning of paps-text.c against its bytewise paths.
+ *
+ * Copyright (C) 2002, 2005 Dov Grobgeld <dov.grobgeld@gmail.com>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ *
+ */
+
+#include <locale.h>
+#include <stdlib.h>
+#include <string.h>
+#include <config.h>
+#include "paps-text.h"
+#include "text-bytewise.h"
+#include "fuzz.h"
+
+/* Aborts, which the fuzzer reports with the input */
+#define CHECK(cond)                                                     \
+  G_STMT_START {                                                        \
+    if (!(cond))                                                        \
+      {                                                                 \
+        g_printerr ("%s: check failed: %s (%" G_GSIZE_FORMAT " bytes)\n", \
+                    G_STRLOC, #cond, length);                           \
+        abort ();                                                       \
+      }                                                                 \
+  } G_STMT_END
+
+static gboolean
+is_paragraph_break (char c)
+{
+  return c == '\n' || c == '\r' || c == '\f' || c == '\0';
+}
+
+/* The break found from p, checked to be the first one */
+static const char *
+check_paragraph_break (const char *p,
+                       const char *end,
+                       gsize       length)
+{
+  const char *brk = find_paragraph_break (p, end), *q;
+
+  CHECK (brk == bytewise_find_paragraph_break (p, end));
+  CHECK (brk >= p && brk <= end);
+  CHECK (brk == end || is_paragraph_break (*brk));
+  for (q = p; q < brk; q++)
+    CHECK (!is_paragraph_break (*q));
+
+  return brk;
+}
+
+int
+LLVMFuzzerInitialize (int    *argc,
+                      char ***argv)
+{
+  /* For the wcwidth() of cpi_clip_length() */
+  if (setlocale (LC_ALL, "C.UTF-8") == NULL)
+    setlocale (LC_ALL, "en_US.UTF-8");
+
+  return 0;
+}
+
+int
+LLVMFuzzerTestOneInput (const guint8 *data,
+                        size_t        size)
+{
+  const char *text = (const char *)data, *end = text + size;
+  const char *valid_end = NULL, *bytewise_valid_end = NULL, *p, *brk;
+  gsize length = size, n, i;
+  gboolean valid;
+
+  n = ascii_prefix_length (text, length);
+  CHECK (n == bytewise_ascii_prefix_length (text, length));
+  for (i = 0; i < n; i++)
+    CHECK ((guchar)text[i] < 0x80);
+  CHECK (n == length || (guchar)text[n] >= 0x80);
+
+  valid = utf8_validate (text, length, &valid_end);
+  CHECK (valid == bytewise_utf8_validate (text, length, &bytewise_valid_end));
+  CHECK (valid_end == bytewise_valid_end);
+  CHECK (valid_end >= text && valid_end <= end);
+  CHECK (!valid || valid_end == end);
+  CHECK (utf8_validate (text, length, NULL) == valid);
+
+  /* Apart from the NUL characters, which paps takes as paragraph breaks,
+   * the text is valid just as for glib.
+   */
+  if (memchr (text, '\0', length) == NULL)
+    {
+      const char *glib_end;
+
+      CHECK (g_utf8_validate (text, length, &glib_end) == valid);
+      CHECK (glib_end == valid_end);
+    }
+
+  /* From each of the first 16 bytes, so that the SIMD paths see the text
+   * at every alignment, and then from each paragraph as paps scans it.
+   */
+  for (p = text; p <= end && p - text < 16; p++)
+    check_paragraph_break (p, end, length);
+  for (p = text; p < end; p = brk + 1)
+    if ((brk = check_paragraph_break (p, end, length)) == end)
+      break;
+
+  CHECK (is_7bit_text (text, length) == bytewise_is_7bit_text (text, length));
+
+  /* paps clips only validated text, the columns come from the first byte */
+  if (valid && length > 0)
+    {
+      gsize columns = (guchar)text[0] % 200, clip;
+      gboolean clipped, bytewise_clipped;
+
+      clip = cpi_clip_length (text, length, columns, &clipped);
+      CHECK (clip == bytewise_cpi_clip_length (text, length, columns, &bytewise_clipped));
+      CHECK (clipped == bytewise_clipped);
+      CHECK (clip > 0 && clip <= length);
+      CHECK (clipped || clip == length);
+      CHECK (utf8_validate (text, clip, NULL));
+      CHECK (clip == length || (guchar)text[clip] < 0x80 || (guchar)text[clip] >= 0xc0);
+    }
+
+  return 0;
+}
@@ -0,0 +1,38 @@
+/* Pango
+ * fuzz.h: The entry points of the fuzz targets of paps.
+ *
+ * Copyright (C) 2002, 2005 Dov Grobgeld <dov.grobgeld@gmail.com>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ *
+ */
+
+#ifndef FUZZ_H
+#define FUZZ_H
+
+#include <stddef.h>
+#include <glib.h>
+
+/* As called by libFuzzer, or by fuzz-main.c and text-equivalence.c when
+ * built without it. A failed check aborts.
+ */
+
+int           LLVMFuzzerInitialize   (int           *argc,
+                                      char        ***argv);
+int           LLVMFuzzerTestOneInput (const guint8  *data,
+                                      size_t         size);
+
+#endif /* FUZZ_H */
@@ -0,0 +1,32 @@
+/* Pango
+ * text-bytewise.c: The bytewise scanning of paps-text.c, under names of its own.
+ *
+ * Copyright (C) 2002, 2005 Dov Grobgeld <dov.grobgeld@gmail.com>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ *
+ */
+
+/* The paps-text.h declarations are renamed along with the definitions */
+#define PAPS_NO_SIMD 1
+#define is_utf8_encoding      bytewise_is_utf8_encoding
+#define ascii_prefix_length   bytewise_ascii_prefix_length
+#define utf8_validate         bytewise_utf8_validate
+#define find_paragraph_break  bytewise_find_paragraph_break
+#define is_7bit_text          bytewise_is_7bit_text
+#define cpi_clip_length       bytewise_cpi_clip_length
+
+#include "paps-text.c"
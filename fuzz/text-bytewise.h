@@ -0,0 +1,46 @@
+/* Pango
+ * text-bytewise.h: The bytewise scanning of paps-text.c, under names of its own.
+ *
+ * Copyright (C) 2002, 2005 Dov Grobgeld <dov.grobgeld@gmail.com>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ *
+ */
+
+#ifndef TEXT_BYTEWISE_H
+#define TEXT_BYTEWISE_H
+
+#include <glib.h>
+
+/* paps-text.c built with PAPS_NO_SIMD, see text-bytewise.c, for checking
+ * the SSE2 and NEON paths against it in the same program.
+ */
+
+gsize         bytewise_ascii_prefix_length  (const char   *text,
+                                             gsize         length);
+gboolean      bytewise_utf8_validate        (const char   *text,
+                                             gsize         length,
+                                             const char  **valid_end);
+const char   *bytewise_find_paragraph_break (const char   *text,
+                                             const char   *end);
+gboolean      bytewise_is_7bit_text         (const char   *text,
+                                             gsize         length);
+gsize         bytewise_cpi_clip_length      (const char   *text,
+                                             gsize         length,
+                                             gsize         columns,
+                                             gboolean     *clipped);
+
+#endif /* TEXT_BYTEWISE_H */
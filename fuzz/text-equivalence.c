@@ -0,0 +1,120 @@
+/* Pango
+ * text-equivalence.c: Checking the SIMD scanning of paps against the bytewise one.
+ *
+ * Copyright (C) 2002, 2005 Dov Grobgeld <dov.grobgeld@gmail.com>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ *
+ */
+
+#include <string.h>
+#include <config.h>
+#include "fuzz.h"
+
+/* Bytes that the scanning treats apart: ASCII, paragraph breaks, the
+ * escapes of is_7bit_text(), the heads and tails of UTF-8 sequences of
+ * each length, an overlong head and bytes that never occur in UTF-8.
+ */
+static const guchar alphabet[] = {
+  'a', ' ', '\t', '\n', '\r', '\f', '\0', 0x1b, 0x0e, 0x7f,
+  0x80, 0xbf, 0xc0, 0xc3, 0xa9, 0xe4, 0xb8, 0xad, 0xed, 0xa0,
+  0xf0, 0x9f, 0x98, 0x80, 0xf4, 0x90, 0xfe, 0xff,
+};
+
+/* Well formed characters, so that random text is also valid at times */
+static const char *const characters[] = {
+  "a", "\n", "\r\n", "\f", "\t", "\xc3\xa9", "\xe4\xb8\xad", "\xef\xbc\xa1",
+  "\xd7\xa9", "\xd9\x85", "\xf0\x9f\x98\x80", "\xcc\x81",
+};
+
+/* Pass the text at the end of a buffer of its own, for the sanitizers,
+ * and at each offset from the start of an aligned one, for the SIMD loads.
+ */
+static void
+check (const guchar *text,
+       gsize         length)
+{
+  guchar *copy = g_malloc (MAX (length, 1));
+  guchar *aligned = g_malloc (length + 32);
+  int offset;
+
+  memcpy (copy, text, length);
+  LLVMFuzzerTestOneInput (copy, length);
+  for (offset = 1; offset < 16; offset++)
+    {
+      memcpy (aligned + offset, text, length);
+      LLVMFuzzerTestOneInput (aligned + offset, length);
+    }
+
+  g_free (aligned);
+  g_free (copy);
+}
+
+int
+main (int    argc,
+      char **argv)
+{
+  GRand *rand = g_rand_new_with_seed (20050101);
+  guchar text[160];
+  gsize length, i;
+  int round;
+
+  LLVMFuzzerInitialize (&argc, &argv);
+
+  /* Each byte of the alphabet at each position of plain ASCII text, on
+   * either side of the 16 byte blocks.
+   */
+  for (length = 0; length <= 48; length++)
+    for (i = 0; i < length; i++)
+      {
+        gsize c;
+
+        for (c = 0; c < G_N_ELEMENTS (alphabet); c++)
+          {
+            memset (text, 'a', length);
+            text[i] = alphabet[c];
+            check (text, length);
+          }
+      }
+
+  /* Random bytes of the alphabet, and random characters */
+  for (round = 0; round < 20000; round++)
+    {
+      length = g_rand_int_range (rand, 0, sizeof text);
+      if (round % 2)
+        for (i = 0; i < length; i++)
+          text[i] = alphabet[g_rand_int_range (rand, 0, G_N_ELEMENTS (alphabet))];
+      else
+        {
+          gsize target = length, n;
+
+          for (length = 0; ; length += n)
+            {
+              const char *c = characters[g_rand_int_range (rand, 0, G_N_ELEMENTS (characters))];
+
+              n = strlen (c);
+              if (length + n > target)
+                break;
+              memcpy (text + length, c, n);
+            }
+        }
+      check (text, length);
+    }
+
+  g_rand_free (rand);
+
+  return 0;
+}
@@ -0,0 +1,218 @@
+/* Pango
+ * paps-text.c: Scanning and measuring the UTF-8 text of paps.
+ *
+ * Copyright (C) 2002, 2005 Dov Grobgeld <dov.grobgeld@gmail.com>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ *
+ */
+
+#define _XOPEN_SOURCE /* for wcwidth */
+#include <wchar.h>
+#include <string.h>
+#include <config.h>
+#include "paps-text.h"
+
+#if defined(__SSE2__) && !defined(PAPS_NO_SIMD)
+#include <emmintrin.h>
+#elif defined(__ARM_NEON) && defined(__aarch64__) && !defined(PAPS_NO_SIMD)
+#include <arm_neon.h>
+#endif
+
+int wcwidth(wchar_t c);
+
+gboolean
+is_utf8_encoding (const gchar *encoding)
+{
+  return g_ascii_strcasecmp (encoding, "UTF-8") == 0
+    || g_ascii_strcasecmp (encoding, "UTF8") == 0;
+}
+
+/* Number of bytes below 0x80 at the start of the text, checked 16 at a
+ * time with SSE2 or NEON.
+ */
+gsize
+ascii_prefix_length (const char *text,
+                     gsize       length)
+{
+  const char *p = text, *end = text + length;
+
+#if defined(__SSE2__) && !defined(PAPS_NO_SIMD)
+  for (; end - p >= 16; p += 16)
+    {
+      int mask = _mm_movemask_epi8 (_mm_loadu_si128 ((const __m128i *)p));
+
+      if (mask)
+        return p - text + g_bit_nth_lsf (mask, -1);
+    }
+#elif defined(__ARM_NEON) && defined(__aarch64__) && !defined(PAPS_NO_SIMD)
+  for (; end - p >= 16; p += 16)
+    if (vmaxvq_u8 (vld1q_u8 ((const uint8_t *)p)) >= 0x80)
+      break;
+#endif
+
+  while (p < end && (unsigned char)*p < 0x80)
+    p++;
+
+  return p - text;
+}
+
+/* Like g_utf8_validate(), except that NUL characters are valid. Runs of
+ * ASCII are skipped with ascii_prefix_length(), only the other characters
+ * are decoded one at a time. valid_end may be NULL.
+ */
+gboolean
+utf8_validate (const char  *text,
+               gsize        length,
+               const char **valid_end)
+{
+  const char *p = text, *end = text + length;
+
+  while ((p += ascii_prefix_length (p, end - p)) < end)
+    {
+      gunichar wc = g_utf8_get_char_validated (p, end - p);
+
+      if (wc == (gunichar)-1 || wc == (gunichar)-2)
+        {
+          if (valid_end)
+            *valid_end = p;
+          return FALSE;
+        }
+      p = g_utf8_next_char (p);
+    }
+
+  if (valid_end)
+    *valid_end = end;
+  return TRUE;
+}
+
+/* Return the first newline, carriage return, form feed or NUL of the
+ * text, or end if there is none. These are ASCII characters, which never
+ * occur inside the sequence of another character in UTF-8, so the text is
+ * scanned bytewise, 16 bytes at a time with SSE2 or NEON.
+ */
+const char *
+find_paragraph_break (const char *text,
+                      const char *end)
+{
+  const char *p = text;
+
+#if defined(__SSE2__) && !defined(PAPS_NO_SIMD)
+  const __m128i nl = _mm_set1_epi8 ('\n'), cr = _mm_set1_epi8 ('\r');
+  const __m128i ff = _mm_set1_epi8 ('\f'), nul = _mm_setzero_si128 ();
+
+  for (; end - p >= 16; p += 16)
+    {
+      __m128i v = _mm_loadu_si128 ((const __m128i *)p);
+      int mask = _mm_movemask_epi8 (_mm_or_si128 (_mm_or_si128 (_mm_cmpeq_epi8 (v, nl),
+                                                                _mm_cmpeq_epi8 (v, cr)),
+                                                  _mm_or_si128 (_mm_cmpeq_epi8 (v, ff),
+                                                                _mm_cmpeq_epi8 (v, nul))));
+
+      if (mask)
+        return p + g_bit_nth_lsf (mask, -1);
+    }
+#elif defined(__ARM_NEON) && defined(__aarch64__) && !defined(PAPS_NO_SIMD)
+  for (; end - p >= 16; p += 16)
+    {
+      uint8x16_t v = vld1q_u8 ((const uint8_t *)p);
+      uint8x16_t m = vorrq_u8 (vorrq_u8 (vceqq_u8 (v, vdupq_n_u8 ('\n')),
+                                         vceqq_u8 (v, vdupq_n_u8 ('\r'))),
+                               vorrq_u8 (vceqq_u8 (v, vdupq_n_u8 ('\f')),
+                                         vceqq_u8 (v, vdupq_n_u8 (0))));
+
+      /* The break is found bytewise below */
+      if (vmaxvq_u8 (m))
+        break;
+    }
+#endif
+
+  for (; p < end; p++)
+    if (*p == '\n' || *p == '\r' || *p == '\f' || *p == '\0')
+      break;
+
+  return p;
+}
+
+/* Whether the text has no bytes above 0x7f, and none of the escape, shift
+ * out and shift in characters, which switch stateful encodings such as
+ * ISO-2022-JP away from ASCII.
+ */
+gboolean
+is_7bit_text (const char *text,
+              gsize       length)
+{
+  gsize i;
+
+  for (i = 0; i < length; i++)
+    {
+      unsigned char c = text[i];
+
+      if (c >= 0x80 || c == 0x1b || c == 0x0e || c == 0x0f)
+        return FALSE;
+    }
+
+  return TRUE;
+}
+
+/* Length in bytes of the head of the text that fits into the columns, by
+ * the wcwidth() of its characters, walking the UTF-8 text in place. Like
+ * the line before it, a paragraph is only clipped if it has more characters
+ * than columns; if not, the whole length is returned. At least one
+ * character is kept, so that the text after the head always moves on.
+ */
+gsize
+cpi_clip_length (const char *text,
+                 gsize       length,
+                 gsize       columns,
+                 gboolean   *clipped)
+{
+  const char *p = text, *end = text + length, *cut = NULL;
+  gsize num_chars = 0, width = 0;
+
+  while (p < end && (cut == NULL || num_chars <= columns))
+    {
+      const char *start = p;
+      guchar c = *p;
+      int w;
+
+      /* Printable ASCII is one column wide, control characters none */
+      if (c < 0x80)
+        {
+          w = (c >= 0x20 && c < 0x7f) ? 1 : 0;
+          p++;
+        }
+      else
+        {
+          w = wcwidth (g_utf8_get_char (p));
+          p = g_utf8_next_char (p);
+        }
+
+      if (w > 0)
+        width += w;
+      if (cut == NULL && width > columns)
+        cut = start;
+      num_chars++;
+    }
+
+  *clipped = num_chars > columns;
+  if (!*clipped || cut == NULL)
+    return length;
+  if (cut == text)
+    cut = g_utf8_next_char (text);
+
+  return cut - text;
+}
@@ -0,0 +1,49 @@
+/* Pango
+ * paps-text.h: Scanning and measuring the UTF-8 text of paps.
+ *
+ * Copyright (C) 2002, 2005 Dov Grobgeld <dov.grobgeld@gmail.com>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ *
+ */
+
+#ifndef PAPS_TEXT_H
+#define PAPS_TEXT_H
+
+#include <glib.h>
+
+/* These only depend on glib, so that they can be exercised on their own.
+ * The SSE2 and NEON paths are left out when built with -DPAPS_NO_SIMD, as
+ * with meson -Dsimd=false or configure --disable-simd, for comparing them
+ * with the bytewise ones.
+ */
+
+gboolean      is_utf8_encoding      (const gchar  *encoding);
+gsize         ascii_prefix_length   (const char   *text,
+                                     gsize         length);
+gboolean      utf8_validate         (const char   *text,
+                                     gsize         length,
+                                     const char  **valid_end);
+const char   *find_paragraph_break  (const char   *text,
+                                     const char   *end);
+gboolean      is_7bit_text          (const char   *text,
+                                     gsize         length);
+gsize         cpi_clip_length       (const char   *text,
+                                     gsize         length,
+                                     gsize         columns,
+                                     gboolean     *clipped);
+
+#endif /* PAPS_TEXT_H */
@@ -28,6 +28,10 @@
 #include <cairo/cairo-pdf.h>
 #include <cairo/cairo-svg.h>
 #include <errno.h>
+#include <signal.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <unistd.h>
 #include <langinfo.h>
 #include <stdlib.h>
 #include <stdio.h>
@@ -36,10 +40,8 @@
 #include <locale.h>
 #include <libgen.h>
 #include <config.h>
-
-#define _XOPEN_SOURCE /* for wcwidth */
-#include <wchar.h>
-int wcwidth(wchar_t c);
+#include "paps-text.h"
+#include "paps.h"
 
 #if ENABLE_NLS
 #include <libintl.h>
@@ -57,11 +59,20 @@ int wcwidth(wchar_t c);
 #endif
 
 #define BUFSIZE 1024
+#define READ_BLOCK_SIZE (1024*1024)
+#define STREAM_CHUNK_SIZE (64 * 1024)  /* Input read per step with --stream */
+#define ARENA_BLOCK_SIZE (64 * 1024)
+#define FOLLOW_INTERVAL (200 * 1000)   /* Microseconds between checks for new input with --follow */
+#define REPORT_MAX_INVALID_BYTES 1000  /* Offsets of invalid bytes listed by --format=null */
+#define LAYOUT_MEMORY_FACTOR 64        /* Rough bytes of layout state per byte of input */
+#define LAYOUT_FIXED_BYTES 512         /* Rough size of a PangoLayout apart from its lines */
 #define DEFAULT_FONT_FAMILY     "Monospace"
 #define DEFAULT_FONT_SIZE       "12"
 #define HEADER_FONT_FAMILY      "Monospace Bold"
 #define HEADER_FONT_SCALE       "12"
 #define MAKE_FONT_NAME(f,s)     f " " s
+#define ASCII_FIRST             0x20   /* Range of characters drawn by the ASCII engine */
+#define ASCII_LAST              0x7e
 
 /*
  * Cairo sets limit on the comment line for cairo_ps_surface_dsc_comment() to
@@ -85,7 +96,10 @@ typedef enum {
 typedef enum {
     FORMAT_POSTSCRIPT = 0,
     FORMAT_PDF = 1,
-    FORMAT_SVG = 2
+    FORMAT_SVG = 2,
+    FORMAT_PNG = 3,
+    FORMAT_PWG = 4,
+    FORMAT_NULL = 5
 } output_format_t ;
 
 typedef struct  {
@@ -136,16 +150,24 @@ typedef struct {
   gdouble cpi;
 } page_layout_t;
 
+typedef struct _Paragraph Paragraph;
+
+/* Output line, kept in a GArray with the other lines of the text. Only
+ * the logical extents that pagination and drawing need are kept. Nothing
+ * needs the ink extents, so they are never computed.
+ */
 typedef struct {
-  PangoLayoutLine *pango_line;
-  PangoRectangle logical_rect;
-  PangoRectangle ink_rect;
-  int formfeed;
-  gboolean wrapped;   // Whether the paragraph was character wrapped
+  Paragraph *para;              // Owner of pango_line
+  PangoLayoutLine *pango_line;  // NULL for lines drawn by the ASCII engine
+  int offset;                   // Text of ASCII engine lines, in para->text
+  int length;
+  int height;         // Logical height, in pango units
+  int width;          // Logical width, for placing RTL lines
+  guint formfeed : 1;
+  guint wrapped : 1;  // Whether the paragraph was character wrapped
+  guint last_line : 1; // Whether para is released once this line is drawn
 } LineLink;
 
-typedef struct _Paragraph Paragraph;
-
 /* Structure representing a paragraph
  */
 struct _Paragraph {
@@ -155,92 +177,721 @@ struct _Paragraph {
   int formfeed;
   gboolean wrapped; 
   gboolean clipped;   // Whether the line was clipped. Used for CPI.
+  gboolean ascii;     // Laid out by the ASCII engine instead of a layout
+  PangoLayout *layout;
+};
+
+/* Bump allocator for objects that are all released at once, see
+ * arena_alloc() and arena_reset()
+ */
+typedef struct {
+  GSList *blocks;   /* Most recent first, the others are full */
+  gsize used;       /* Bytes used in the most recent block */
+  gsize size;       /* Size of the most recent block */
+  gsize allocated;  /* Size of all the blocks */
+} arena_t;
+
+/* Fixed pitch font data for laying out and drawing printable ASCII text
+ * without pango, see ascii_engine_init().
+ */
+typedef struct {
+  gboolean enabled;
+  PangoFont *font;
+  cairo_scaled_font_t *scaled_font;
+  unsigned long glyphs[ASCII_LAST - ASCII_FIRST + 1];
+  double advance;                /* Glyph advance in points */
+  int pango_advance;             /* Glyph advance in pango units */
+  PangoRectangle logical_rect;   /* Line extents, apart from the width */
+  PangoLanguage *language;       /* Of the context, for the line breaks */
+} ascii_engine_t;
+
+/* The layouts shaped by one thread of shape_paragraphs()
+ */
+typedef struct {
+  PangoContext *pango_context;
+  PangoAttrList *attrs;
+  GPtrArray *layouts;
+} shape_job_t;
+
+/* Entry of the layout cache, which is also its own hash key
+ */
+typedef struct {
+  char *text;
+  int length;
+  int width;
+  PangoWrapMode wrap;
+  double cpi;
   PangoLayout *layout;
+  GList *lru_link;   /* Link in layout_cache_t.lru */
+} cached_layout_t;
+
+/* Layouts of recently shaped paragraphs, for reuse by identical ones
+ */
+typedef struct {
+  int max_size;      /* 0 disables the cache */
+  double cpi;
+  GHashTable *table;
+  GQueue lru;        /* Most recently used first */
+  gulong lookups;
+  gulong hits;
+} layout_cache_t;
+
+/* Paths of the wrap marker at glyph_font_size, see wrap_marker_init()
+ */
+typedef struct {
+  cairo_path_t *curve;  /* Stroked with line_width */
+  cairo_path_t *arrow;  /* Filled */
+  double line_width;
+} wrap_marker_t;
+
+/* Header lines, see page_header_init(). The date and the title are laid
+ * out once per document, only the page number changes from page to page.
+ */
+typedef struct {
+  PangoLayout *date_layout;
+  PangoLayout *title_layout;
+  PangoLayout *pagenum_layout;
+  PangoRectangle date_rect;    /* Logical extents of the date line */
+  PangoRectangle title_rect;   /* Logical extents of the title line */
+  gboolean share_decoration;   /* Whether to draw the rest through decoration */
+  cairo_surface_t *decoration; /* Date, title and separator, recorded once */
+  double decoration_sep_pos;   /* Position of the separator in decoration */
+} page_header_t;
+
+/* Lines that repeat in a PostScript, PDF or SVG document, such as rows of
+ * dashes, are drawn into a recording surface of their own from their
+ * LINE_FORM_MIN_USES'th use on, and painted from it. Cairo keeps a
+ * recording surface painted several times once in the document, as a form
+ * XObject in PDF, a form in PostScript and a <use> of one definition in
+ * SVG. The forms and the column separators of a page are painted after
+ * its text, so that the text of a page is not split into a text object
+ * per line. See draw_line_to_page().
+ */
+#define LINE_FORM_MIN_LENGTH 8
+#define LINE_FORM_MAX_LENGTH 1024
+#define LINE_FORM_MIN_USES 3
+#define LINE_FORMS_MAX 4096
+
+typedef struct {
+  int uses;
+  cairo_surface_t *form;       /* The line drawn at the origin, or NULL */
+} line_form_t;
+
+typedef struct {
+  cairo_surface_t *form;
+  double x_pos, y_pos;
+} form_paint_t;
+
+typedef struct {
+  double x_pos, y_top, y_bot;
+} column_separator_t;
+
+typedef struct {
+  GHashTable *lines;           /* Direction and text -> line_form_t, NULL if not used */
+  GArray *paints;              /* form_paint_t of the current page */
+  GArray *separators;          /* column_separator_t of the current page */
+} page_forms_t;
+
+/* Ring buffer emptied into the output file by a thread of its own, so that
+ * drawing does not wait for slow output, see output_start()
+ */
+typedef struct {
+  int fd;
+  guchar *buffer;
+  gsize size;
+  gsize start;          /* Start of the data not written yet */
+  gsize length;         /* Length of the data not written yet */
+  gboolean done;        /* No more data comes */
+  int error;            /* errno of a failed write, 0 if none */
+  GThread *thread;      /* NULL when writing directly */
+  GMutex mutex;
+  GCond cond;
+} output_writer_t;
+
+/* What --format=null reports about a document, see count_pages()
+ */
+typedef struct {
+  GArray *lines_per_page;       /* int for each page */
+  GArray *invalid_bytes;        /* guint64 offsets in the input, up to REPORT_MAX_INVALID_BYTES */
+  guint64 num_invalid_bytes;    /* Replaced by U+FFFD instead of an error */
+  guint64 num_lines;
+  guint64 wrapped_lines;        /* Lines continued on the next one */
+  guint64 clipped_lines;        /* Paragraphs clipped by --cpi */
+  guint64 overflowing_lines;    /* Lines wider than the column */
+} layout_report_t;
+
+/* Input state kept between reads of consecutive chunks of a file
+ */
+typedef struct {
+  FILE *file;
+  const gchar *encoding;
+  GIConv cvh;
+  gboolean utf8;              /* The input is validated instead of converted */
+  gboolean ascii_compatible;  /* ASCII converts to itself, see is_ascii_compatible() */
+  GMappedFile *mapping; /* The file, if it is read in place, see input_reader_map() */
+  const char *map_pos;  /* Start of the part of the mapping not read yet */
+  const char *map_end;
+  char *block;          /* READ_BLOCK_SIZE bytes read from the file at once */
+  gsize inc_seq_bytes;  /* Incomplete sequence bytes carried to the next read */
+  GString *pending;     /* Text read and converted */
+  gsize pending_pos;    /* Start of the pending text not returned yet */
+  char *chunk;          /* Copy of the end of the mapping, if it lacks a newline */
+  gboolean eof;
+  guint64 bytes_read;   /* Read from the file so far */
+  guint64 block_offset; /* Offset of the block in the input */
+  layout_report_t *report;  /* Where invalid bytes are noted, NULL to fail on them */
+  gsize max_chunk;      /* Longest chunk with --max-memory, 0 for no limit */
+  gboolean in_nul_line; /* Dropping a line after its NUL, see drop_nul_lines() */
+} input_reader_t;
+
+/* Position of the next line on the pages, see paginate_line()
+ */
+typedef struct {
+  int column_idx;
+  int column_y_pos;
+  int page_idx;
+  int title_height;
+  gboolean prev_formfeed;
+} pagination_t;
+
+typedef enum {
+  BREAK_NONE,
+  BREAK_COLUMN,
+  BREAK_PAGE
+} break_type_t;
+
+/* Start of a column in the table computed by paginate_lines()
+ */
+typedef struct {
+  int page_idx;
+  int column_idx;
+  int first_line;   /* Index of the first line of the column */
+  int num_lines;
+} column_break_t;
+
+/* Range of pages selected by --pages, see page_selected()
+ */
+typedef struct {
+  int first;
+  int last;     /* G_MAXINT for a range open at the end */
+} page_range_t;
+
+/* The output surface. When the output file name is a pattern, the pages go
+ * into numbered files of pages_per_file pages each, see
+ * output_doc_start_page().
+ */
+typedef struct {
+  cairo_surface_t *surface;
+  cairo_t *cr;
+  page_layout_t *page_layout;
+  const char *pattern;    /* Output file name with a %d, or NULL for output_fh */
+  int pages_per_file;     /* 0 puts all pages into one file */
+  int file_idx;           /* Number of the current file */
+  int num_pages;          /* Pages started so far */
+} output_doc_t;
+
+/* Pages shared by the threads of output_pages_parallel()
+ */
+typedef struct {
+  paps_t *paps;
+  page_layout_t *page_layout;
+  page_header_t *header;        /* NULL without header */
+  PangoContext *pango_context;
+  int title_height;
+  int num_pages;
+  GArray *column_breaks;        /* From paginate_lines() */
+  guint *page_columns;          /* Index of the first column of each page */
+  int *selected;                /* Indices of the pages to draw, see page_selected() */
+  int num_selected;
+  GArray *lines;                /* All the lines, indexed by the column breaks */
+  GByteArray **rasters;         /* Encoded pages that are not written yet, by selected index */
+  int next_page;                /* Next selected page to record */
+  int replayed;                 /* Number of selected pages written */
+  int window;                   /* Pages that may be encoded ahead of the output */
+  GMutex mutex;
+  GCond cond;
+  GMutex draw_mutex;            /* Held while drawing lines, see record_page() */
+} page_renderer_t;
+
+/* Drawing state kept between batches of lines passed to output_pages_add_lines()
+ */
+typedef struct {
+  output_doc_t *doc;
+  page_layout_t *page_layout;
+  page_header_t *header;  /* NULL without header */
+  gboolean flush_pages;   /* Flush the output after each page */
+  gboolean drawing;       /* The current page is selected by --pages */
+  int num_pages;          /* -1 if unknown */
+  pagination_t pagination;
+} output_state_t;
+
+/* Where a run on a growing file stopped, kept with --checkpoint so that
+ * the next run goes on from there, see follow_document()
+ */
+typedef struct {
+  guint64 inode;        /* Of the input, which is started over if it changes */
+  gint64 offset;        /* Bytes of the input laid out so far */
+  int page_idx;         /* Number of the last page */
+  int column_idx;       /* Column and position reached on it, see pagination_t */
+  int column_y_pos;
+  gboolean prev_formfeed;
+} checkpoint_t;
+
+/* Stages timed by --stats
+ */
+typedef enum {
+  STAGE_READ,              /* Reading the input and converting it to UTF-8 */
+  STAGE_ICONV,             /* The conversion alone, part of STAGE_READ */
+  STAGE_SPLIT_PARAGRAPHS,  /* split_text_into_paragraphs(), including shaping */
+  STAGE_SPLIT_LINES,       /* split_paragraphs_into_lines() */
+  STAGE_OUTPUT,            /* Paginating and drawing the lines */
+  NUM_STAGES
+} stage_t;
+
+/* Start of a timed interval, see stats_start() */
+typedef struct {
+  gint64 wall;
+  clock_t cpu;
+} stats_clock_t;
+
+/* Times and counters printed to stderr by --stats when paps is done
+ */
+typedef struct {
+  gboolean enabled;
+  stats_clock_t start;      /* Start of the whole run */
+  gint64 wall[NUM_STAGES];  /* Microseconds */
+  gint64 cpu[NUM_STAGES];   /* Microseconds of CPU time, of all threads */
+  guint64 bytes_read;
+  guint64 bytes_written;
+  gulong documents;
+  gulong paragraphs;
+  gulong lines;
+  gulong pages;
+} stats_t;
+
+/* Everything rendering depends on apart from the text, set up from the
+ * options by paps_new(). Every stage is passed the context of the
+ * rendering it is part of, so renderings with contexts of their own do
+ * not share any state.
+ */
+struct _paps_t {
+  /* Output */
+  FILE *output_fh;
+  paps_write_func_t output_func;  /* Takes the output instead of output_fh if set */
+  gpointer output_closure;
+  gboolean output_error;          /* output_func failed */
+  output_writer_t output_writer;
+  GError *error;                  /* The first error of the rendering, see paps_set_error() */
+
+  /* Options */
+  paper_type_t paper_type;
+  gboolean output_format_set;
+  output_format_t output_format;
+  PangoGravity gravity;
+  PangoGravityHint gravity_hint;
+  PangoWrapMode opt_wrap;
+  int opt_jobs;                   /* Number of threads shaping paragraphs */
+  int opt_pages_per_file;         /* 0 puts all pages into one file */
+  int opt_dpi;                    /* Resolution of the raster formats */
+  int opt_output_buffer;          /* Size of the output ring buffer in KiB, 0 for none */
+  int opt_max_memory;             /* Bound on the layout state in MiB, 0 for none */
+  gboolean opt_fsync;             /* fsync() the output files before closing them */
+  GArray *opt_page_ranges;        /* page_range_t of --pages, NULL for all pages */
+  gboolean do_count_pages;
+  gboolean do_fatal_warnings;     /* Applied by main() only, the log handling is global */
+
+  /* Layout, set up once for all renderings */
+  page_layout_t page_layout;
+  PangoContext *pango_context;
+  PangoContext **job_contexts;    /* Of the opt_jobs shaping threads, NULL for one */
+  gchar *encoding;
+  gchar *htitle;
+  gboolean do_draw_header;
+  gboolean do_stream;
+  double glyph_font_size;
+  wrap_marker_t wrap_markers[2];  /* Pointing right, and left for RTL */
+  ascii_engine_t ascii_engine;
+  layout_cache_t layout_cache;
+  page_header_t page_header;
+  page_forms_t page_forms;
+  stats_t stats;
+  /* The paragraphs of the text being laid out. There is never more than one
+   * chunk of text in flight, and once all of its lines are drawn or freed,
+   * all of its paragraphs are released with one reset.
+   */
+  arena_t paragraph_arena;
+
+  /* Options for files, refused by paps_render() */
+  gchar *output;
+  gchar *batch_file;
+  gchar *checkpoint_file;
+  gboolean do_follow;
 };
 
 /* Information passed in user data when drawing outlines */
-static GList *split_paragraphs_into_lines  (page_layout_t   *page_layout,
+static GArray *split_paragraphs_into_lines (paps_t          *paps,
+                                            page_layout_t   *page_layout,
                                             GList           *paragraphs);
-static char  *read_file                    (FILE            *file,
-                                            gchar           *encoding);
-static GList *split_text_into_paragraphs   (cairo_t *cr,
+static GQuark line_extents_quark           (void);
+static PangoRectangle *get_line_extents    (paps_t          *paps,
+                                            PangoLayout     *layout);
+static void   split_ascii_paragraph        (paps_t          *paps,
+                                            page_layout_t   *page_layout,
+                                            Paragraph       *para,
+                                            GArray          *lines);
+static void   input_reader_init            (paps_t          *paps,
+                                            input_reader_t  *reader,
+                                            FILE            *file,
+                                            const gchar     *encoding);
+static const char *input_reader_read       (paps_t          *paps,
+                                            input_reader_t  *reader,
+                                            gsize            chunk_size,
+                                            gsize           *length);
+static void   input_reader_close           (input_reader_t  *reader);
+static GList *split_text_into_paragraphs   (paps_t          *paps,
+                                            cairo_t *cr,
+                                            PangoContext    *pango_context,
+                                            page_layout_t   *page_layout,
+                                            int              paint_width,
+                                            const char      *text,
+                                            gsize            length);
+static PangoAttrList *new_paragraph_attrs  (page_layout_t   *page_layout);
+static void   shape_paragraph              (paps_t          *paps,
+                                            Paragraph       *para,
+                                            PangoContext    *pango_context,
+                                            PangoAttrList   *attrs,
+                                            page_layout_t   *page_layout,
+                                            int              paint_width);
+static void   shape_paragraphs             (paps_t          *paps,
+                                            cairo_t         *cr,
                                             PangoContext    *pango_context,
                                             page_layout_t   *page_layout,
                                             int              paint_width,
-                                            const char      *text);
-static int    output_pages                 (cairo_surface_t * surface,
+                                            GList           *paragraphs);
+static PangoContext *clone_pango_context   (PangoContext    *pango_context,
+                                            cairo_surface_t *surface);
+static PangoLayout *layout_cache_lookup    (paps_t          *paps,
+                                            Paragraph       *para,
+                                            int              paint_width);
+static void   layout_cache_insert          (paps_t          *paps,
+                                            Paragraph       *para,
+                                            int              paint_width);
+static void   layout_cache_print_stats     (paps_t *paps);
+static void   stats_start                  (paps_t          *paps,
+                                            stats_clock_t   *timer);
+static void   stats_stop                   (paps_t          *paps,
+                                            stats_clock_t   *timer,
+                                            stage_t          stage);
+static void   stats_print                  (paps_t *paps);
+static void   free_paragraph               (Paragraph       *para);
+static gpointer arena_alloc                (arena_t         *arena,
+                                            gsize            size);
+static void   arena_reset                  (arena_t         *arena);
+static void   free_lines                   (paps_t          *paps,
+                                            GArray          *lines);
+static int    get_cpi_char_width           (PangoContext    *pango_context,
+                                            const PangoFontDescription *font_description);
+static void   font_stamp_add_path          (GChecksum       *checksum,
+                                            const gchar     *path);
+static gchar *font_stamp                   (void);
+static GKeyFile *font_cache_load           (gchar          **cache_file,
+                                            gchar          **stamp);
+static gboolean font_cache_is_current      (GKeyFile        *key_file,
+                                            const gchar     *group,
+                                            const gchar     *stamp);
+static void   font_cache_save              (GKeyFile        *key_file,
+                                            gchar           *cache_file,
+                                            const gchar     *group,
+                                            gchar           *stamp);
+static void   font_cache_free              (GKeyFile        *key_file,
+                                            gchar           *cache_file,
+                                            gchar           *stamp);
+static gboolean font_cache_group_valid     (const gchar     *group);
+static gboolean ascii_engine_load          (paps_t          *paps,
+                                            GKeyFile        *key_file,
+                                            const gchar     *group,
+                                            const gchar     *stamp,
+                                            gboolean        *usable);
+static void   ascii_engine_save            (paps_t          *paps,
+                                            GKeyFile        *key_file,
+                                            const gchar     *group,
+                                            gboolean         usable);
+static gboolean ascii_engine_measure       (paps_t          *paps,
+                                            PangoContext    *pango_context);
+static void   ascii_engine_init            (paps_t          *paps,
+                                            PangoContext    *pango_context,
+                                            page_layout_t   *page_layout);
+static gboolean is_ascii_text              (const char      *text,
+                                            int              length);
+static int    ascii_engine_break_line      (paps_t          *paps,
+                                            const char      *text,
+                                            const PangoLogAttr *log_attrs,
+                                            int              length,
+                                            int              columns);
+static void   ascii_engine_show_line       (paps_t          *paps,
                                             cairo_t         *cr,
-                                            GList           *pango_lines,
+                                            double           x_pos,
+                                            double           y_pos,
+                                            const char      *text,
+                                            int              length);
+static int    output_pages                 (paps_t          *paps,
+                                            output_doc_t    *doc,
+                                            GArray          *lines,
                                             page_layout_t   *page_layout,
                                             gboolean         need_header,
                                             PangoContext    *pango_context);
-static void   eject_column                 (cairo_t         *cr,
+static void   output_pages_start           (paps_t          *paps,
+                                            output_state_t  *state,
+                                            output_doc_t    *doc,
+                                            page_layout_t   *page_layout,
+                                            gboolean         need_header,
+                                            PangoContext    *pango_context,
+                                            int              num_pages,
+                                            int              first_page);
+static void   output_pages_add_lines       (paps_t          *paps,
+                                            output_state_t  *state,
+                                            GArray          *lines);
+static int    output_pages_finish          (paps_t          *paps,
+                                            output_state_t  *state);
+static void   deduce_output_format         (paps_t          *paps,
+                                            const char      *filename);
+static cairo_surface_t *create_surface     (paps_t          *paps,
+                                            page_layout_t   *page_layout);
+static const char *output_pattern          (const char      *filename);
+static void   output_doc_open              (paps_t          *paps,
+                                            output_doc_t    *doc,
+                                            page_layout_t   *page_layout,
+                                            const char      *pattern);
+static void   output_doc_start_page        (paps_t          *paps,
+                                            output_doc_t    *doc);
+static gboolean page_selected              (paps_t          *paps,
+                                            int              page_idx);
+static void   output_doc_close             (paps_t          *paps,
+                                            output_doc_t    *doc);
+static int    render_document              (paps_t          *paps,
+                                            FILE            *file,
+                                            gchar           *encoding,
+                                            PangoContext    *pango_context,
+                                            page_layout_t   *page_layout,
+                                            gboolean         need_header,
+                                            gboolean         do_stream,
+                                            const char      *pattern);
+static int    follow_document              (paps_t          *paps,
+                                            FILE            *file,
+                                            gchar           *encoding,
+                                            PangoContext    *pango_context,
+                                            page_layout_t   *page_layout,
+                                            gboolean         need_header,
+                                            const char      *pattern,
+                                            const char      *checkpoint_file,
+                                            gboolean         do_follow);
+static gboolean run_batch                  (paps_t          *paps,
+                                            const char      *batch_file,
+                                            gchar           *encoding,
+                                            PangoContext    *pango_context,
+                                            page_layout_t   *page_layout,
+                                            const gchar     *htitle,
+                                            gboolean         need_header,
+                                            gboolean         do_stream);
+static int    line_height                  (page_layout_t   *page_layout,
+                                            LineLink        *line_link);
+static void   output_pages_parallel        (paps_t          *paps,
+                                            output_doc_t    *doc,
+                                            GArray          *lines,
+                                            GArray          *column_breaks,
+                                            page_layout_t   *page_layout,
+                                            page_header_t   *header,
+                                            PangoContext    *pango_context,
+                                            int              title_height,
+                                            int              num_pages);
+static void   pagination_init              (pagination_t    *pagination,
+                                            int              title_height);
+static break_type_t paginate_line          (pagination_t    *pagination,
+                                            page_layout_t   *page_layout,
+                                            LineLink        *line_link,
+                                            int             *line_pos);
+static GArray *paginate_lines              (page_layout_t   *page_layout,
+                                            int              title_height,
+                                            GArray          *lines);
+static int    count_pages                  (paps_t          *paps,
+                                            FILE            *file,
+                                            gchar           *encoding,
+                                            PangoContext    *pango_context,
+                                            page_layout_t   *page_layout,
+                                            gboolean         need_header,
+                                            layout_report_t *report,
+                                            gboolean         count_document);
+static void   write_layout_report          (paps_t          *paps,
+                                            layout_report_t *report,
+                                            int              num_pages);
+static int    output_stream                (paps_t          *paps,
+                                            output_doc_t    *doc,
+                                            FILE            *file,
+                                            gchar           *encoding,
+                                            PangoContext    *pango_context,
+                                            page_layout_t   *page_layout,
+                                            gboolean         need_header,
+                                            int              num_pages);
+static void   output_stream_chunks         (paps_t          *paps,
+                                            output_state_t  *state,
+                                            input_reader_t  *reader,
+                                            PangoContext    *pango_context,
+                                            page_layout_t   *page_layout);
+static guint64 lines_memory                (GArray          *lines);
+static gboolean is_regular_file            (FILE            *file);
+static int    output_measured              (paps_t          *paps,
+                                            output_doc_t    *doc,
+                                            FILE            *file,
+                                            gchar           *encoding,
+                                            PangoContext    *pango_context,
+                                            page_layout_t   *page_layout,
+                                            gboolean         need_header);
+static FILE  *spill_to_temporary_file      (paps_t          *paps,
+                                            FILE            *file);
+static int    output_bounded               (paps_t          *paps,
+                                            output_doc_t    *doc,
+                                            FILE            *file,
+                                            gchar           *encoding,
+                                            PangoContext    *pango_context,
+                                            page_layout_t   *page_layout,
+                                            gboolean         need_header);
+static void   eject_column                 (paps_t          *paps,
+                                            cairo_t         *cr,
                                             double          title_height,
                                             page_layout_t   *page_layout,
                                             int              column_idx);
-static void   eject_page                   (cairo_t         *cr);
-static void   start_page                   (cairo_surface_t *surface,
+static void   eject_page                   (paps_t          *paps,
+                                            cairo_t         *cr);
+static void   start_page                   (paps_t          *paps,
+                                            cairo_surface_t *surface,
                                             cairo_t         *cr, 
                                             page_layout_t   *page_layout);
-static void   draw_line_to_page            (cairo_t         *cr,
+static void   page_forms_init              (paps_t          *paps);
+static void   page_forms_free              (paps_t          *paps);
+static void   page_forms_flush             (paps_t          *paps,
+                                            cairo_t         *cr);
+static cairo_surface_t *line_form_get      (paps_t          *paps,
+                                            page_layout_t   *page_layout,
+                                            LineLink        *line_link);
+static void   draw_line_to_page            (paps_t          *paps,
+                                            cairo_t         *cr,
                                             int              column_idx,
                                             int              column_pos,
                                             page_layout_t   *page_layout,
-                                            PangoLayoutLine *line,
+                                            LineLink        *line_link,
                                             gboolean         draw_wrap_character);
+static page_header_t *page_header_init      (paps_t          *paps,
+                                             page_layout_t   *page_layout,
+                                            PangoContext    *ctx);
+static PangoLayout *new_page_number_layout (page_layout_t   *page_layout,
+                                            PangoContext    *ctx);
+static PangoLayout *relayout_header_line   (PangoLayout     *layout,
+                                            PangoContext    *ctx,
+                                            PangoRectangle  *rect);
+static void   page_header_free             (paps_t *paps);
+static int    measure_page_header          (paps_t          *paps,
+                                            page_layout_t   *page_layout,
+                                            PangoContext    *ctx);
 static int    draw_page_header_line_to_page(cairo_t         *cr,
                                             gboolean         is_footer,
                                             page_layout_t   *page_layout,
-                                            PangoContext    *ctx,
+                                            page_header_t   *header,
                                             int              page,
                                             int              num_pages);
+static void   draw_page_header_decoration  (cairo_t         *cr,
+                                            page_layout_t   *page_layout,
+                                            page_header_t   *header,
+                                            double           y_pos,
+                                            double           sep_pos);
 static void   postscript_dsc_comments      (cairo_surface_t *surface,
                                             page_layout_t   *page_layout);
 
-FILE *output_fh;
-static paper_type_t paper_type = PAPER_TYPE_A4;
-static gboolean output_format_set = FALSE;
-static output_format_t output_format = FORMAT_POSTSCRIPT;
-static PangoGravity gravity = PANGO_GRAVITY_AUTO;
-static PangoGravityHint gravity_hint = PANGO_GRAVITY_HINT_NATURAL;
-static PangoWrapMode opt_wrap = PANGO_WRAP_WORD_CHAR;
-static cairo_font_face_t *paps_glyph_face = NULL; /* Special face for paps characters, e.g. newline */
-static double glyph_font_size = -1;
-
-/* Render function for paps glyphs */
-static cairo_status_t
-paps_render_glyph(cairo_scaled_font_t *scaled_font G_GNUC_UNUSED,
-                  unsigned long glyph,
-                  cairo_t *cr,
-                  cairo_text_extents_t *extents)
-{
-  char ch = (unsigned char)glyph;
+static volatile sig_atomic_t follow_stopped = 0;  /* Set by SIGINT or SIGTERM with --follow */
 
-  if (ch == 'R' || ch == 'L')
+/* Trace the wrap marker with its baseline origin at the current origin,
+ * pointing left if rtl: the curve, or with arrow its head.
+ */
+static void
+trace_wrap_marker(cairo_t  *cr,
+                  gboolean  rtl,
+                  gboolean  arrow)
+{
+  // A newline sign that I created with MetaPost
+  cairo_scale(cr,0.005,-0.005); // TBD - figure out the scaling.
+  if (rtl)
+  {
+    cairo_scale(cr,-1,1);
+    // cairo_translate(cr,-120,0);  // Keep glyph protruding to the right.
+  }
+  cairo_translate(cr, 20,-50);
+  if (!arrow)
   {
-    // A newline sign that I created with MetaPost
-    cairo_save(cr);
-    cairo_scale(cr,0.005,-0.005); // TBD - figure out the scaling.
-    if (ch == 'L')
-    {
-      cairo_scale(cr,-1,1);
-      // cairo_translate(cr,-120,0);  // Keep glyph protruding to the right.
-    }
-    cairo_translate(cr, 20,-50);
     cairo_move_to(cr, 0, 175);
     cairo_curve_to(cr, 25.69278, 175, 53.912, 177.59557, 71.25053, 158.75053);
     cairo_curve_to(cr, 103.52599, 123.67075, 64.54437, 77.19373, 34.99985, 34.99985);
-    cairo_set_line_width(cr, 25);
-    cairo_stroke(cr);
-
+  }
+  else
+  {
     cairo_move_to(cr,0,0);
     cairo_line_to(cr,75,0);
     cairo_line_to(cr,0,75);
     cairo_close_path(cr);
-    cairo_fill(cr);
-    cairo_restore(cr);
   }
-  return CAIRO_STATUS_SUCCESS;
+}
+
+/* Build the paths of the wrap markers at glyph_font_size, once the font
+ * size is final. Drawing them with draw_wrap_marker() then only appends
+ * the paths.
+ */
+static void
+wrap_marker_init(paps_t *paps)
+{
+  cairo_surface_t *surface = cairo_recording_surface_create(CAIRO_CONTENT_COLOR_ALPHA, NULL);
+  cairo_t *cr = cairo_create(surface);
+  int i;
+
+  for (i = 0; i < 2; i++)
+    {
+      /* The path is copied in the coordinates of the identity matrix */
+      cairo_save(cr);
+      cairo_scale(cr, paps->glyph_font_size, paps->glyph_font_size);
+      trace_wrap_marker(cr, i == 1, FALSE);
+      cairo_restore(cr);
+      paps->wrap_markers[i].curve = cairo_copy_path(cr);
+      cairo_new_path(cr);
+
+      cairo_save(cr);
+      cairo_scale(cr, paps->glyph_font_size, paps->glyph_font_size);
+      trace_wrap_marker(cr, i == 1, TRUE);
+      cairo_restore(cr);
+      paps->wrap_markers[i].arrow = cairo_copy_path(cr);
+      cairo_new_path(cr);
+
+      paps->wrap_markers[i].line_width = 25 * 0.005 * paps->glyph_font_size;
+    }
+
+  cairo_destroy(cr);
+  cairo_surface_destroy(surface);
+}
+
+static void
+draw_wrap_marker(paps_t   *paps,
+                 cairo_t  *cr,
+                 double    x_pos,
+                 double    y_pos,
+                 gboolean  rtl)
+{
+  wrap_marker_t *marker = &paps->wrap_markers[rtl ? 1 : 0];
+
+  cairo_save(cr);
+  cairo_translate(cr, x_pos, y_pos);
+  cairo_new_path(cr);
+  cairo_append_path(cr, marker->curve);
+  cairo_set_line_width(cr, marker->line_width);
+  cairo_stroke(cr);
+  cairo_append_path(cr, marker->arrow);
+  cairo_fill(cr);
+  cairo_restore(cr);
 }
 
 static gboolean
@@ -248,18 +899,19 @@ _paps_arg_paper_cb(const char *option_name,
                    const char *value,
                    gpointer    data)
 {
+  paps_t *paps = data;
   gboolean retval = TRUE;
   
   if (value && *value)
     {
       if (g_ascii_strcasecmp(value, "legal") == 0)
-        paper_type = PAPER_TYPE_US_LEGAL;
+        paps->paper_type = PAPER_TYPE_US_LEGAL;
       else if (g_ascii_strcasecmp(value, "letter") == 0)
-        paper_type = PAPER_TYPE_US_LETTER;
+        paps->paper_type = PAPER_TYPE_US_LETTER;
       else if (g_ascii_strcasecmp(value, "a4") == 0)
-        paper_type = PAPER_TYPE_A4;
+        paps->paper_type = PAPER_TYPE_A4;
       else if (g_ascii_strcasecmp(value, "a3") == 0)
-        paper_type = PAPER_TYPE_A3;
+        paps->paper_type = PAPER_TYPE_A3;
       else {
         retval = FALSE;
         fprintf(stderr, _("Unknown page size name: %s.\n"), value);
@@ -392,7 +1044,9 @@ parse_wrap (const char *name,
             gpointer    data,
             GError    **error)
 {
-  return (parse_enum (PANGO_TYPE_WRAP_MODE, (int*)(void*)&opt_wrap,
+  paps_t *paps = data;
+
+  return (parse_enum (PANGO_TYPE_WRAP_MODE, (int*)(void*)&paps->opt_wrap,
                       name, arg, data, error));
 }
 
@@ -402,7 +1056,9 @@ parse_gravity_hint (const char *name,
                     gpointer    data,
                     GError    **error)
 {
-  return (parse_enum (PANGO_TYPE_GRAVITY_HINT, (int*)(void*)&gravity_hint,
+  paps_t *paps = data;
+
+  return (parse_enum (PANGO_TYPE_GRAVITY_HINT, (int*)(void*)&paps->gravity_hint,
                       name, arg, data, error));
 }
 
@@ -412,7 +1068,9 @@ parse_gravity (const char *name,
                gpointer    data,
                GError    **error)
 {
-  return (parse_enum (PANGO_TYPE_GRAVITY, (int*)(void*)&gravity,
+  paps_t *paps = data;
+
+  return (parse_enum (PANGO_TYPE_GRAVITY, (int*)(void*)&paps->gravity,
                       name, arg, data, error));
 }
 
@@ -422,18 +1080,25 @@ _paps_arg_format_cb(const char *option_name,
                     const char *value,
                     gpointer    data)
 {
+  paps_t *paps = data;
   gboolean retval = TRUE;
   
   if (value && *value)
     {
-      output_format_set = TRUE;
+      paps->output_format_set = TRUE;
       if (g_ascii_strcasecmp(value, "pdf") == 0)
-        output_format = FORMAT_PDF;
+        paps->output_format = FORMAT_PDF;
       else if (g_ascii_strcasecmp(value, "ps") == 0
                || g_ascii_strcasecmp(value, "postscript") == 0)
-        output_format = FORMAT_POSTSCRIPT;
+        paps->output_format = FORMAT_POSTSCRIPT;
       else if (g_ascii_strcasecmp(value, "svg") == 0)
-        output_format = FORMAT_SVG;
+        paps->output_format = FORMAT_SVG;
+      else if (g_ascii_strcasecmp(value, "png") == 0)
+        paps->output_format = FORMAT_PNG;
+      else if (g_ascii_strcasecmp(value, "pwg") == 0)
+        paps->output_format = FORMAT_PWG;
+      else if (g_ascii_strcasecmp(value, "null") == 0)
+        paps->output_format = FORMAT_NULL;
       else {
         retval = FALSE;
         fprintf(stderr, _("Unknown output format: %s.\n"), value);
@@ -455,7 +1120,7 @@ _paps_arg_lpi_cb(const gchar *option_name,
 {
   gboolean retval = TRUE;
   gchar *p = NULL;
-  page_layout_t *page_layout = (page_layout_t*)data;
+  page_layout_t *page_layout = &((paps_t *)data)->page_layout;
 
   if (value && *value)
     {
@@ -483,7 +1148,7 @@ _paps_arg_cpi_cb(const gchar *option_name,
 {
   gboolean retval = TRUE;
   gchar *p = NULL;
-  page_layout_t *page_layout = (page_layout_t*)data;
+  page_layout_t *page_layout = &((paps_t *)data)->page_layout;
   
   if (value && *value)
     {
@@ -504,6 +1169,52 @@ _paps_arg_cpi_cb(const gchar *option_name,
   return retval;
 }
 
+/* Parse a list of page ranges such as "1,4-7,10-", separated by commas */
+static gboolean
+_paps_arg_pages_cb(const gchar *option_name,
+                   const gchar *value,
+                   gpointer     data)
+{
+  paps_t *paps = data;
+  gchar **ranges, **range;
+  gboolean retval = TRUE;
+
+  if (!value || !*value)
+    {
+      fprintf(stderr, _("You must specify the pages to output.\n"));
+      return FALSE;
+    }
+
+  if (paps->opt_page_ranges == NULL)
+    paps->opt_page_ranges = g_array_new(FALSE, FALSE, sizeof(page_range_t));
+
+  ranges = g_strsplit(value, ",", -1);
+  for (range = ranges; *range && retval; range++)
+    {
+      page_range_t page_range = { 1, G_MAXINT };
+      gchar *p = *range;
+
+      if (g_ascii_isdigit(*p))
+        page_range.first = page_range.last = strtol(p, &p, 10);
+      if (*p == '-')
+        {
+          p++;
+          page_range.last = g_ascii_isdigit(*p) ? strtol(p, &p, 10) : G_MAXINT;
+        }
+
+      if (*p || p == *range || page_range.first < 1 || page_range.last < page_range.first)
+        {
+          fprintf(stderr, _("Invalid page range: %s\n"), *range);
+          retval = FALSE;
+        }
+      else
+        g_array_append_val(paps->opt_page_ranges, page_range);
+    }
+  g_strfreev(ranges);
+
+  return retval;
+}
+
 
 /*
  * Return codeset name of the environment's locale. Use UTF8 by default
@@ -519,102 +1230,348 @@ get_encoding()
   return encoding;
 }
 
-static cairo_status_t paps_cairo_write_func(void *closure G_GNUC_UNUSED,
-                                            const unsigned char *data,
-                                            unsigned int length)
+/* Note the first error of the rendering. The stages go on without
+ * drawing anything more, as the reader stops once it is set, and
+ * render_input() hands it to its caller.
+ */
+static void G_GNUC_PRINTF(4, 5)
+paps_set_error(paps_t      *paps,
+               GQuark       domain,
+               gint         code,
+               const gchar *format,
+               ...)
 {
-  fwrite(data,length,1,output_fh);
-  return CAIRO_STATUS_SUCCESS;
+  va_list args;
+
+  if (paps->error != NULL)
+    return;
+
+  va_start(args, format);
+  paps->error = g_error_new_valist(domain, code, format, args);
+  va_end(args);
 }
 
-int main(int argc, char *argv[])
+static gpointer
+output_writer_thread(gpointer data)
 {
-  gboolean do_landscape = FALSE, do_rtl = FALSE, do_justify = FALSE, do_show_hyphens=FALSE, do_draw_header = FALSE, do_draw_footer=FALSE;
-  gboolean do_stretch_chars = FALSE;
-  gboolean do_use_markup = FALSE;
-  gboolean do_show_wrap = FALSE; /* Whether to show wrap characters */
-  int num_columns = 1;
-  int top_margin = MARGIN_TOP, bottom_margin = MARGIN_BOTTOM,
-      right_margin = MARGIN_RIGHT, left_margin = MARGIN_LEFT;
+  output_writer_t *writer = data;
 
-  gboolean do_fatal_warnings = FALSE;
-  const gchar *font = MAKE_FONT_NAME (DEFAULT_FONT_FAMILY, DEFAULT_FONT_SIZE);
-  gchar *encoding = NULL;
-  gchar *output = NULL;
-  gchar *htitle = NULL;
-  page_layout_t page_layout;
-  GOptionContext *ctxt = g_option_context_new("[text file]");
-  GOptionEntry entries[] = {
-    {"landscape", 0, 0, G_OPTION_ARG_NONE, &do_landscape,
-     N_("Landscape output. (Default: portrait)"), NULL},
-    {"columns", 0, 0, G_OPTION_ARG_INT, &num_columns,
-     N_("Number of columns output. (Default: 1)"), "NUM"},
-    {"font", 0, 0, G_OPTION_ARG_STRING, &font,
-     N_("Set font. (Default: Monospace 12)"), "DESC"},
-    {"output", 'o', 0, G_OPTION_ARG_STRING, &output,
-     N_("Output file. (Default: stdout)"), "DESC"},
-    {"rtl", 0, 0, G_OPTION_ARG_NONE, &do_rtl,
-     N_("Do right-to-left text layout."), NULL},
-    {"justify", 0, 0, G_OPTION_ARG_NONE, &do_justify,
-     N_("Justify the layout."), NULL},
-    {"hyphens", 0, 0, G_OPTION_ARG_NONE, &do_show_hyphens,
-     N_("Show hyphens when wrapping."), NULL},
-    {"wrap", 0, 0, G_OPTION_ARG_CALLBACK, &parse_wrap,
-     N_("Text wrapping mode [word, char, word-char]. (Default: word-char)"), "WRAP"},
-    {"show-wrap", 0, 0, G_OPTION_ARG_NONE, &do_show_wrap,
-     N_("Show characters for wrapping."), NULL},
-    {"paper", 0, 0, G_OPTION_ARG_CALLBACK, _paps_arg_paper_cb,
-     N_("Set paper size [legal, letter, a3, a4]. (Default: a4)"), "PAPER"},
-    {"gravity", 0, 0, G_OPTION_ARG_CALLBACK, &parse_gravity,
-     N_("Base glyph rotation [south, west, north, east, auto]. (Defaut: auto)"), "GRAVITY"},
-    {"gravity-hint", 0, 0, G_OPTION_ARG_CALLBACK, &parse_gravity_hint,
-     N_("Base glyph orientation [natural, strong, line]. (Default: natural)"), "HINT"},
-    {"format", 0, 0, G_OPTION_ARG_CALLBACK, _paps_arg_format_cb,
-     N_("Set output format [pdf, svg, ps]. (Default: ps)"), "FORMAT"},
-    {"bottom-margin", 0, 0, G_OPTION_ARG_INT, &bottom_margin,
-     N_("Set bottom margin in postscript point units (1/72 inch). (Default: 36)"), "NUM"},
-    {"top-margin", 0, 0, G_OPTION_ARG_INT, &top_margin,
-     N_("Set top margin. (Default: 36)"), "NUM"},
-    {"right-margin", 0, 0, G_OPTION_ARG_INT, &right_margin,
-     N_("Set right margin. (Default: 36)"), "NUM"},
-    {"left-margin", 0, 0, G_OPTION_ARG_INT, &left_margin,
-     N_("Set left margin. (Default: 36)"), "NUM"},
-    {"header", 0, 0, G_OPTION_ARG_NONE, &do_draw_header,
-     N_("Draw page header for each page."), NULL},
-    {"footer", 0, 0, G_OPTION_ARG_NONE, &do_draw_footer,
-     "Draw page footer for each page.", NULL},
-    {"title", 0, 0, G_OPTION_ARG_STRING, &htitle,
-     N_("Title string for page header (Default: filename/stdin)."), "TITLE"},
-    {"markup", 0, 0, G_OPTION_ARG_NONE, &do_use_markup,
-     N_("Interpret input text as pango markup."), NULL},
-    {"encoding", 0, 0, G_OPTION_ARG_STRING, &encoding,
-     N_("Assume encoding of input text. (Default: UTF-8)"), "ENCODING"},
-    {"lpi", 0, 0, G_OPTION_ARG_CALLBACK, _paps_arg_lpi_cb,
-     N_("Set the amount of lines per inch."), "REAL"},
-    {"cpi", 0, 0, G_OPTION_ARG_CALLBACK, _paps_arg_cpi_cb,
-     N_("Set the amount of characters per inch."), "REAL"},
-    /*
-     * not fixed for cairo backend: disable
-     *
-    {"stretch-chars", 0, 0, G_OPTION_ARG_NONE, &do_stretch_chars,
-     N_("Stretch characters in y-direction to fill lines."), NULL},
-     */
-    {"g-fatal-warnings", 0, 0, G_OPTION_ARG_NONE, &do_fatal_warnings,
-     N_("Make all glib warnings fatal."), "REAL"},
+  g_mutex_lock(&writer->mutex);
+  while (1)
+    {
+      struct iovec iov[2];
+      int iovcnt = 1;
+      ssize_t written;
+
+      while (writer->length == 0 && !writer->done)
+        g_cond_wait(&writer->cond, &writer->mutex);
+      if (writer->length == 0)
+        break;
+
+      /* The data may wrap around the end of the buffer */
+      iov[0].iov_base = writer->buffer + writer->start;
+      iov[0].iov_len = MIN(writer->length, writer->size - writer->start);
+      if (iov[0].iov_len < writer->length)
+        {
+          iov[1].iov_base = writer->buffer;
+          iov[1].iov_len = writer->length - iov[0].iov_len;
+          iovcnt = 2;
+        }
+
+      /* The data being written is not touched by output_write() */
+      g_mutex_unlock(&writer->mutex);
+      do
+        written = writev(writer->fd, iov, iovcnt);
+      while (written < 0 && errno == EINTR);
+      g_mutex_lock(&writer->mutex);
+
+      if (written < 0)
+        {
+          writer->error = errno;
+          writer->length = 0;
+        }
+      else
+        {
+          writer->start = (writer->start + written) % writer->size;
+          writer->length -= written;
+        }
+      g_cond_broadcast(&writer->cond);
+    }
+  g_mutex_unlock(&writer->mutex);
+
+  return NULL;
+}
+
+/* Make fh the output file. With --output-buffer, the output goes through
+ * a ring buffer written to the file by a thread of its own.
+ */
+static void
+output_start(paps_t *paps, FILE *fh)
+{
+  output_writer_t *writer = &paps->output_writer;
+
+  paps->output_fh = fh;
+  if (paps->opt_output_buffer <= 0)
+    return;
+
+  fflush(fh);
+  writer->fd = fileno(fh);
+  writer->size = (gsize)paps->opt_output_buffer * 1024;
+  writer->buffer = g_malloc(writer->size);
+  writer->start = 0;
+  writer->length = 0;
+  writer->done = FALSE;
+  writer->error = 0;
+  g_mutex_init(&writer->mutex);
+  g_cond_init(&writer->cond);
+  writer->thread = g_thread_new("paps-writer", output_writer_thread, writer);
+}
+
+/* Hand the output to func instead of writing it to a file, see
+ * paps_render()
+ */
+static void
+output_start_func(paps_t           *paps,
+                  paps_write_func_t func,
+                  gpointer          closure)
+{
+  paps->output_fh = NULL;
+  paps->output_func = func;
+  paps->output_closure = closure;
+}
+
+static gboolean
+output_write(paps_t     *paps,
+             const void *data,
+             gsize       length)
+{
+  output_writer_t *writer = &paps->output_writer;
+  gboolean ok;
+
+  paps->stats.bytes_written += length;
+  if (paps->output_func != NULL)
+    {
+      if (!paps->output_error && !paps->output_func(paps->output_closure, data, length))
+        paps->output_error = TRUE;
+      return !paps->output_error;
+    }
+  if (paps->output_fh == NULL)
+    return FALSE;   /* It could not be opened */
+  if (writer->thread == NULL)
+    return fwrite(data, 1, length, paps->output_fh) == length;
+
+  g_mutex_lock(&writer->mutex);
+  while (length > 0 && !writer->error)
+    {
+      gsize end, n;
+
+      while (writer->length == writer->size && !writer->error)
+        g_cond_wait(&writer->cond, &writer->mutex);
+      if (writer->error)
+        break;
+
+      end = (writer->start + writer->length) % writer->size;
+      n = MIN(length, writer->size - writer->length);
+      n = MIN(n, writer->size - end);
+      memcpy(writer->buffer + end, data, n);
+      writer->length += n;
+      data = (const guchar *)data + n;
+      length -= n;
+      g_cond_broadcast(&writer->cond);
+    }
+  ok = !writer->error;
+  g_mutex_unlock(&writer->mutex);
+
+  return ok;
+}
+
+/* Hand the output written so far to the system, e.g. after each page with
+ * --stream. The writer thread does so on its own.
+ */
+static void
+output_flush(paps_t *paps)
+{
+  if (paps->output_func == NULL && paps->output_writer.thread == NULL)
+    fflush(paps->output_fh);
+}
+
+/* Write out all the output, fsync() it with --fsync, and close the output
+ * file unless it is stdout, or stop handing the output to the function of
+ * output_start_func(). Returns FALSE if writing failed.
+ */
+static gboolean
+output_finish(paps_t *paps)
+{
+  output_writer_t *writer = &paps->output_writer;
+  gboolean ok = TRUE;
+
+  if (paps->output_func != NULL)
+    {
+      ok = !paps->output_error;
+      paps->output_func = NULL;
+      paps->output_error = FALSE;
+      return ok;
+    }
+  if (paps->output_fh == NULL)
+    return TRUE;
+
+  if (writer->thread != NULL)
+    {
+      g_mutex_lock(&writer->mutex);
+      writer->done = TRUE;
+      g_cond_broadcast(&writer->cond);
+      g_mutex_unlock(&writer->mutex);
+      g_thread_join(writer->thread);
+      writer->thread = NULL;
+
+      if (writer->error)
+        {
+          errno = writer->error;
+          ok = FALSE;
+        }
+      g_mutex_clear(&writer->mutex);
+      g_cond_clear(&writer->cond);
+      g_free(writer->buffer);
+    }
+
+  if (fflush(paps->output_fh) != 0)
+    ok = FALSE;
+  /* Pipes and sockets can not be synced */
+  if (paps->opt_fsync && fsync(fileno(paps->output_fh)) != 0 && errno != EINVAL && errno != EROFS)
+    ok = FALSE;
+  if (paps->output_fh != stdout && fclose(paps->output_fh) != 0)
+    ok = FALSE;
+  paps->output_fh = NULL;
+
+  return ok;
+}
+
+static cairo_status_t paps_cairo_write_func(void *closure,
+                                            const unsigned char *data,
+                                            unsigned int length)
+{
+  if (!output_write((paps_t *)closure, data, length))
+    return CAIRO_STATUS_WRITE_ERROR;
+  return CAIRO_STATUS_SUCCESS;
+}
+
+/* Set up a context for rendering with the options in argv, as they would
+ * be given on the command line, see paps(1). The options are removed from
+ * argv, leaving the program name and any file names. Returns NULL and sets
+ * error if the options are not valid.
+ */
+paps_t *
+paps_new (int      *argc,
+          char   ***argv,
+          GError  **error)
+{
+  paps_t *paps = g_new0(paps_t, 1);
+  gboolean do_landscape = FALSE, do_rtl = FALSE, do_justify = FALSE, do_show_hyphens=FALSE, do_draw_footer=FALSE;
+  gboolean do_stretch_chars = FALSE;
+  gboolean do_use_markup = FALSE;
+  gboolean do_show_wrap = FALSE; /* Whether to show wrap characters */
+  gboolean do_fast_ascii = FALSE;
+  int num_columns = 1;
+  int top_margin = MARGIN_TOP, bottom_margin = MARGIN_BOTTOM,
+      right_margin = MARGIN_RIGHT, left_margin = MARGIN_LEFT;
+
+  gchar *font = NULL;
+  page_layout_t *page_layout = &paps->page_layout;
+  GOptionContext *ctxt = g_option_context_new("[text file]");
+  GOptionEntry entries[] = {
+    {"landscape", 0, 0, G_OPTION_ARG_NONE, &do_landscape,
+     N_("Landscape output. (Default: portrait)"), NULL},
+    {"columns", 0, 0, G_OPTION_ARG_INT, &num_columns,
+     N_("Number of columns output. (Default: 1)"), "NUM"},
+    {"font", 0, 0, G_OPTION_ARG_STRING, &font,
+     N_("Set font. (Default: Monospace 12)"), "DESC"},
+    {"output", 'o', 0, G_OPTION_ARG_STRING, &paps->output,
+     N_("Output file. (Default: stdout)"), "DESC"},
+    {"rtl", 0, 0, G_OPTION_ARG_NONE, &do_rtl,
+     N_("Do right-to-left text layout."), NULL},
+    {"justify", 0, 0, G_OPTION_ARG_NONE, &do_justify,
+     N_("Justify the layout."), NULL},
+    {"hyphens", 0, 0, G_OPTION_ARG_NONE, &do_show_hyphens,
+     N_("Show hyphens when wrapping."), NULL},
+    {"wrap", 0, 0, G_OPTION_ARG_CALLBACK, &parse_wrap,
+     N_("Text wrapping mode [word, char, word-char]. (Default: word-char)"), "WRAP"},
+    {"show-wrap", 0, 0, G_OPTION_ARG_NONE, &do_show_wrap,
+     N_("Show characters for wrapping."), NULL},
+    {"paper", 0, 0, G_OPTION_ARG_CALLBACK, _paps_arg_paper_cb,
+     N_("Set paper size [legal, letter, a3, a4]. (Default: a4)"), "PAPER"},
+    {"gravity", 0, 0, G_OPTION_ARG_CALLBACK, &parse_gravity,
+     N_("Base glyph rotation [south, west, north, east, auto]. (Defaut: auto)"), "GRAVITY"},
+    {"gravity-hint", 0, 0, G_OPTION_ARG_CALLBACK, &parse_gravity_hint,
+     N_("Base glyph orientation [natural, strong, line]. (Default: natural)"), "HINT"},
+    {"format", 0, 0, G_OPTION_ARG_CALLBACK, _paps_arg_format_cb,
+     N_("Set output format [pdf, svg, ps, png, pwg, null]. (Default: ps)"), "FORMAT"},
+    {"dpi", 0, 0, G_OPTION_ARG_INT, &paps->opt_dpi,
+     N_("Set the resolution of the png and pwg formats. (Default: 300)"), "DPI"},
+    {"bottom-margin", 0, 0, G_OPTION_ARG_INT, &bottom_margin,
+     N_("Set bottom margin in postscript point units (1/72 inch). (Default: 36)"), "NUM"},
+    {"top-margin", 0, 0, G_OPTION_ARG_INT, &top_margin,
+     N_("Set top margin. (Default: 36)"), "NUM"},
+    {"right-margin", 0, 0, G_OPTION_ARG_INT, &right_margin,
+     N_("Set right margin. (Default: 36)"), "NUM"},
+    {"left-margin", 0, 0, G_OPTION_ARG_INT, &left_margin,
+     N_("Set left margin. (Default: 36)"), "NUM"},
+    {"header", 0, 0, G_OPTION_ARG_NONE, &paps->do_draw_header,
+     N_("Draw page header for each page."), NULL},
+    {"footer", 0, 0, G_OPTION_ARG_NONE, &do_draw_footer,
+     "Draw page footer for each page.", NULL},
+    {"title", 0, 0, G_OPTION_ARG_STRING, &paps->htitle,
+     N_("Title string for page header (Default: filename/stdin)."), "TITLE"},
+    {"markup", 0, 0, G_OPTION_ARG_NONE, &do_use_markup,
+     N_("Interpret input text as pango markup."), NULL},
+    {"encoding", 0, 0, G_OPTION_ARG_STRING, &paps->encoding,
+     N_("Assume encoding of input text. (Default: UTF-8)"), "ENCODING"},
+    {"lpi", 0, 0, G_OPTION_ARG_CALLBACK, _paps_arg_lpi_cb,
+     N_("Set the amount of lines per inch."), "REAL"},
+    {"cpi", 0, 0, G_OPTION_ARG_CALLBACK, _paps_arg_cpi_cb,
+     N_("Set the amount of characters per inch."), "REAL"},
+    {"stream", 0, 0, G_OPTION_ARG_NONE, &paps->do_stream,
+     N_("Output pages while the input is still being read."), NULL},
+    {"pages-per-file", 0, 0, G_OPTION_ARG_INT, &paps->opt_pages_per_file,
+     N_("Start a new output file every NUM pages. The output file name must contain a %d for the file number."), "NUM"},
+    {"output-buffer", 0, 0, G_OPTION_ARG_INT, &paps->opt_output_buffer,
+     N_("Write the output from a buffer of KB kilobytes in a separate thread. (Default: 0, direct writes)"), "KB"},
+    {"max-memory", 0, 0, G_OPTION_ARG_INT, &paps->opt_max_memory,
+     N_("Output documents whose layout takes more than MB megabytes one chunk at a time. (Default: 0, no limit)"), "MB"},
+    {"fsync", 0, 0, G_OPTION_ARG_NONE, &paps->opt_fsync,
+     N_("Sync output files to disk before closing them."), NULL},
+    {"batch", 0, 0, G_OPTION_ARG_FILENAME, &paps->batch_file,
+     N_("Render the documents listed in FILE, \"-\" for stdin, as pairs of input and output files."), "FILE"},
+    {"checkpoint", 0, 0, G_OPTION_ARG_FILENAME, &paps->checkpoint_file,
+     N_("Go on from where the run that saved FILE stopped, and save where this run stops, for input that only grows."), "FILE"},
+    {"follow", 0, 0, G_OPTION_ARG_NONE, &paps->do_follow,
+     N_("Keep waiting for more input at the end of the input, outputting pages as they are filled, until interrupted."), NULL},
+    {"count-pages", 0, 0, G_OPTION_ARG_NONE, &paps->do_count_pages,
+     N_("Only print the number of pages the output would have."), NULL},
+    {"fast-ascii", 0, 0, G_OPTION_ARG_NONE, &do_fast_ascii,
+     N_("Lay out lines of plain ASCII text in a fixed pitch font without pango."), NULL},
+    {"layout-cache", 0, 0, G_OPTION_ARG_INT, &paps->layout_cache.max_size,
+     N_("Reuse the layouts of up to NUM distinct recent paragraphs for identical ones. (Default: 0)"), "NUM"},
+    {"pages", 0, 0, G_OPTION_ARG_CALLBACK, _paps_arg_pages_cb,
+     N_("Only output the pages in RANGE, such as 1,4-7,10-. Page numbers and headers are those of the whole document."), "RANGE"},
+    {"jobs", 0, 0, G_OPTION_ARG_INT, &paps->opt_jobs,
+     N_("Number of threads laying out paragraphs and drawing pages, 0 for one per processor. (Default: 1)"), "NUM"},
+    {"stats", 0, 0, G_OPTION_ARG_NONE, &paps->stats.enabled,
+     N_("Print the time taken by each stage and other counters to stderr when done. Also enabled by PAPS_STATS=1."), NULL},
+    /*
+     * not fixed for cairo backend: disable
+     *
+    {"stretch-chars", 0, 0, G_OPTION_ARG_NONE, &do_stretch_chars,
+     N_("Stretch characters in y-direction to fill lines."), NULL},
+     */
+    {"g-fatal-warnings", 0, 0, G_OPTION_ARG_NONE, &paps->do_fatal_warnings,
+     N_("Make all glib warnings fatal."), "REAL"},
 
     {NULL}
 
   };
-  GError *error = NULL;
-  FILE *IN = NULL;
-  GList *paragraphs;
-  GList *pango_lines;
   PangoContext *pango_context;
   PangoFontDescription *font_description;
   PangoDirection pango_dir = PANGO_DIRECTION_LTR;
-  PangoFontMap *fontmap;
-  PangoFontset *fontset;
-  PangoFontMetrics *metrics;
   int gutter_width = 40;
   int total_gutter_width;
   double page_width = paper_sizes[0].width;
@@ -622,31 +1579,24 @@ int main(int argc, char *argv[])
   int do_tumble = -1;   /* -1 means not initialized */
   int do_duplex = -1;
   const gchar *header_font_desc = MAKE_FONT_NAME (HEADER_FONT_FAMILY, HEADER_FONT_SCALE);
-  const gchar *filename_in;
-  gchar *text;
   int header_sep = 20;
-  int max_width = 0, w;
+  int max_width = 0;
   GOptionGroup *options;
-  cairo_t *cr;
-  cairo_surface_t *surface = NULL;
-  double surface_page_width = 0, surface_page_height = 0;
-
-  /* Set locale from environment */
-  (void) setlocale(LC_ALL, "");
 
-  /* Setup i18n */
-  textdomain(GETTEXT_PACKAGE);
-  bindtextdomain(GETTEXT_PACKAGE, DATADIR "/locale");
-  bind_textdomain_codeset (GETTEXT_PACKAGE, "UTF-8");
-
-  /* Setup the paps glyph face */
-  paps_glyph_face = cairo_user_font_face_create();
-  cairo_user_font_face_set_render_glyph_func(paps_glyph_face, paps_render_glyph);
+  paps->paper_type = PAPER_TYPE_A4;
+  paps->output_format = FORMAT_POSTSCRIPT;
+  paps->gravity = PANGO_GRAVITY_AUTO;
+  paps->gravity_hint = PANGO_GRAVITY_HINT_NATURAL;
+  paps->opt_wrap = PANGO_WRAP_WORD_CHAR;
+  paps->opt_jobs = 1;
+  paps->opt_dpi = 300;
+  paps->output_writer.fd = -1;
+  paps->glyph_font_size = -1;
 
   /* Init page_layout_t parameters set by the option parsing */
-  page_layout.cpi = page_layout.lpi = 0;
+  page_layout->cpi = page_layout->lpi = 0;
 
-  options = g_option_group_new("main","","",&page_layout, NULL);
+  options = g_option_group_new("main","","",paps, NULL);
   g_option_group_add_entries(options, entries);
   g_option_group_set_translation_domain(options, GETTEXT_PACKAGE);
   g_option_context_set_main_group(ctxt, options);
@@ -655,106 +1605,46 @@ int main(int argc, char *argv[])
 #endif
   
   /* Parse command line */
-  if (!g_option_context_parse(ctxt, &argc, &argv, &error))
+  if (!g_option_context_parse(ctxt, argc, argv, error))
     {
-      fprintf(stderr, _("Command line error: %s\n"), error->message);
-      exit(1);
+      g_option_context_free(ctxt);
+      g_free(font);
+      paps_free(paps);
+      return NULL;
     }
-  
-  if (do_fatal_warnings)
-    g_log_set_always_fatal(G_LOG_LEVEL_MASK);
+
+  if (g_getenv("PAPS_STATS") && strcmp(g_getenv("PAPS_STATS"), "") != 0
+      && strcmp(g_getenv("PAPS_STATS"), "0") != 0)
+    paps->stats.enabled = TRUE;
+  stats_start(paps, &paps->stats.start);
 
   if (do_rtl)
     pango_dir = PANGO_DIRECTION_RTL;
   
-  if (argc > 1)
-    {
-      filename_in = argv[1];
-      IN = fopen(filename_in, "r");
-      if (!IN)
-        {
-          fprintf(stderr, _("Failed to open %s!\n"), filename_in);
-          exit(1);
-        }
-    }
-  else
-    {
-      filename_in = "stdin";
-      IN = stdin;
-    }
-
-  // For now always write to stdout
-  if (output == NULL)
-    output_fh = stdout;
-  else
-    {
-      output_fh = fopen(output,"wb");
-      if (!output_fh)
-        {
-          fprintf(stderr, _("Failed to open %s for writing!\n"), output);
-          exit(1);
-        }
-    }
-
   /* Page layout */
-  page_width = paper_sizes[(int)paper_type].width;
-  page_height = paper_sizes[(int)paper_type].height;
-
-  /* Deduce output format from file name if not explicitely set */
-  if (!output_format_set && output != NULL)
-    {
-      if (g_str_has_suffix(output, ".svg") || g_str_has_suffix(output, ".SVG"))
-        output_format = FORMAT_SVG;
-      else if (g_str_has_suffix(output, ".pdf") || g_str_has_suffix(output, ".PDF"))
-        output_format = FORMAT_PDF;
-      /* Otherwise keep postscript default */
-    }
-  
-  /* Swap width and height for landscape except for postscript */
-  surface_page_width = page_width;
-  surface_page_height = page_height;
-  if (output_format != FORMAT_POSTSCRIPT && do_landscape)
-    {
-      surface_page_width = page_height;
-      surface_page_height = page_width;
-    }
-        
-  if (output_format == FORMAT_POSTSCRIPT)
-    surface = cairo_ps_surface_create_for_stream(&paps_cairo_write_func,
-                                                 NULL,
-                                                 surface_page_width,
-                                                 surface_page_height);
-  else if (output_format == FORMAT_PDF)
-    surface = cairo_pdf_surface_create_for_stream(&paps_cairo_write_func,
-                                                  NULL,
-                                                  surface_page_width,
-                                                  surface_page_height);
-  else 
-    surface = cairo_svg_surface_create_for_stream(&paps_cairo_write_func,
-                                                  NULL,
-                                                  surface_page_width,
-                                                  surface_page_height);
+  page_width = paper_sizes[(int)paps->paper_type].width;
+  page_height = paper_sizes[(int)paps->paper_type].height;
 
-  cr = cairo_create(surface);
-
-  pango_context = pango_cairo_create_context(cr);
+  /* The context does not depend on the surface, so one serves all documents */
+  pango_context = paps->pango_context = clone_pango_context(NULL, NULL);
   pango_cairo_context_set_resolution(pango_context, 72.0); /* Native postscript resolution */
   
   /* Setup pango */
   pango_context_set_base_dir (pango_context, pango_dir);
   pango_context_set_language (pango_context, pango_language_get_default ());
-  pango_context_set_base_gravity (pango_context, gravity);
-  pango_context_set_gravity_hint (pango_context, gravity_hint);
+  pango_context_set_base_gravity (pango_context, paps->gravity);
+  pango_context_set_gravity_hint (pango_context, paps->gravity_hint);
   
   /* create the font description */
-  font_description = pango_font_description_from_string (font);
+  font_description = pango_font_description_from_string (font ? font : MAKE_FONT_NAME (DEFAULT_FONT_FAMILY, DEFAULT_FONT_SIZE));
+  g_free(font);
   if ((pango_font_description_get_set_fields (font_description) & PANGO_FONT_MASK_FAMILY) == 0)
     pango_font_description_set_family (font_description, DEFAULT_FONT_FAMILY);
   if ((pango_font_description_get_set_fields (font_description) & PANGO_FONT_MASK_SIZE) == 0)
     pango_font_description_set_size (font_description, atoi(DEFAULT_FONT_SIZE) * PANGO_SCALE);
 
   // Keep the font size for the wrap character.
-  glyph_font_size = pango_font_description_get_size(font_description) / PANGO_SCALE;
+  paps->glyph_font_size = pango_font_description_get_size(font_description) / PANGO_SCALE;
   pango_context_set_font_description (pango_context, font_description);
 
   if (num_columns <= 0) {
@@ -762,6 +1652,34 @@ int main(int argc, char *argv[])
     num_columns = 1;
   }
 
+  if (paps->opt_max_memory < 0) {
+    fprintf(stderr, _("%s: Invalid input: --max-memory=%d, using default.\n"), g_get_prgname (), paps->opt_max_memory);
+    paps->opt_max_memory = 0;
+  }
+  if (paps->opt_dpi <= 0) {
+    fprintf(stderr, _("%s: Invalid input: --dpi=%d, using default.\n"), g_get_prgname (), paps->opt_dpi);
+    paps->opt_dpi = 300;
+  }
+  if (paps->opt_pages_per_file < 0) {
+    fprintf(stderr, _("%s: Invalid input: --pages-per-file=%d, using default.\n"), g_get_prgname (), paps->opt_pages_per_file);
+    paps->opt_pages_per_file = 0;
+  }
+  else if (paps->opt_pages_per_file > 0 && !output_pattern(paps->output) && !paps->batch_file) {
+    g_set_error(error, G_OPTION_ERROR, G_OPTION_ERROR_BAD_VALUE,
+                _("--pages-per-file needs an output file name with a %%d for the file number."));
+    g_option_context_free(ctxt);
+    pango_font_description_free(font_description);
+    paps_free(paps);
+    return NULL;
+  }
+
+  if (paps->opt_jobs < 0) {
+    fprintf(stderr, _("%s: Invalid input: --jobs=%d, using default.\n"), g_get_prgname (), paps->opt_jobs);
+    paps->opt_jobs = 1;
+  }
+  else if (paps->opt_jobs == 0)
+    paps->opt_jobs = g_get_num_processors ();
+
   if (num_columns == 1)
     total_gutter_width = 0;
   else
@@ -785,557 +1703,3824 @@ int main(int argc, char *argv[])
         do_duplex = TRUE;
     }
   
-  page_layout.page_width = page_width;
-  page_layout.page_height = page_height;
-  page_layout.num_columns = num_columns;
-  page_layout.left_margin = left_margin;
-  page_layout.right_margin = right_margin;
-  page_layout.gutter_width = gutter_width;
-  page_layout.top_margin = top_margin;
-  page_layout.bottom_margin = bottom_margin;
-  page_layout.header_ypos = page_layout.top_margin;
-  page_layout.header_height = 0;
-  page_layout.footer_height = 0;
-  page_layout.do_show_wrap = do_show_wrap;
-  page_layout.scale_x = 1.0L;
-  page_layout.scale_y = 1.0L;
-  if (do_draw_header)
-      page_layout.header_sep =  0; // header_sep;
+  page_layout->page_width = page_width;
+  page_layout->page_height = page_height;
+  page_layout->num_columns = num_columns;
+  page_layout->left_margin = left_margin;
+  page_layout->right_margin = right_margin;
+  page_layout->gutter_width = gutter_width;
+  page_layout->top_margin = top_margin;
+  page_layout->bottom_margin = bottom_margin;
+  page_layout->header_ypos = page_layout->top_margin;
+  page_layout->header_height = 0;
+  page_layout->footer_height = 0;
+  page_layout->do_show_wrap = do_show_wrap;
+  page_layout->scale_x = 1.0L;
+  page_layout->scale_y = 1.0L;
+  if (paps->do_draw_header)
+      page_layout->header_sep =  0; // header_sep;
   else
-      page_layout.header_sep = 0;
+      page_layout->header_sep = 0;
     
-  page_layout.column_height = (int)page_height
-                            - page_layout.top_margin
-                            - page_layout.header_sep
-                            - page_layout.bottom_margin;
-  page_layout.column_width =  ((int)page_layout.page_width
-                            - page_layout.left_margin - page_layout.right_margin
-                            - total_gutter_width) / page_layout.num_columns;
-  page_layout.do_separation_line = TRUE;
-  page_layout.do_landscape = do_landscape;
-  page_layout.do_justify = do_justify;
-  page_layout.do_show_hyphens = do_show_hyphens;
-  page_layout.do_stretch_chars = do_stretch_chars;
-  page_layout.do_use_markup = do_use_markup;
-  page_layout.do_tumble = do_tumble;
-  page_layout.do_duplex = do_duplex;
-  page_layout.pango_dir = pango_dir;
-  if (htitle)
-     page_layout.title = htitle;
-  else
-     page_layout.title = basename((char *)filename_in);
-  page_layout.header_font_desc = header_font_desc;
+  page_layout->column_height = (int)page_height
+                            - page_layout->top_margin
+                            - page_layout->header_sep
+                            - page_layout->bottom_margin;
+  page_layout->column_width =  ((int)page_layout->page_width
+                            - page_layout->left_margin - page_layout->right_margin
+                            - total_gutter_width) / page_layout->num_columns;
+  page_layout->do_separation_line = TRUE;
+  page_layout->do_landscape = do_landscape;
+  page_layout->do_justify = do_justify;
+  page_layout->do_show_hyphens = do_show_hyphens;
+  page_layout->do_stretch_chars = do_stretch_chars;
+  page_layout->do_use_markup = do_use_markup;
+  page_layout->do_tumble = do_tumble;
+  page_layout->do_duplex = do_duplex;
+  page_layout->pango_dir = pango_dir;
+  page_layout->header_font_desc = header_font_desc;
 
   /* calculate x-coordinate scale */
-  if (page_layout.cpi > 0.0L)
+  if (page_layout->cpi > 0.0L)
     {
       gint font_size;
 
-      fontmap = pango_ft2_font_map_new ();
-      fontset = pango_font_map_load_fontset (fontmap, pango_context, font_description, pango_language_get_default());
-      metrics = pango_fontset_get_metrics (fontset);
-      max_width = pango_font_metrics_get_approximate_char_width (metrics);
-      w = pango_font_metrics_get_approximate_digit_width (metrics);
-      if (w > max_width)
-          max_width = w;
-      page_layout.scale_x = 1 / page_layout.cpi * 72.0 * (gdouble)PANGO_SCALE / (gdouble)max_width;
-      pango_font_metrics_unref (metrics);
-      g_object_unref (G_OBJECT (fontmap));
+      max_width = get_cpi_char_width (pango_context, font_description);
+      page_layout->scale_x = 1 / page_layout->cpi * 72.0 * (gdouble)PANGO_SCALE / (gdouble)max_width;
 
       font_size = pango_font_description_get_size (font_description);
       // update the font size to that width
-      pango_font_description_set_size (font_description, (int)(font_size * page_layout.scale_x));
-      glyph_font_size = font_size * page_layout.scale_x / PANGO_SCALE;
+      pango_font_description_set_size (font_description, (int)(font_size * page_layout->scale_x));
+      paps->glyph_font_size = font_size * page_layout->scale_x / PANGO_SCALE;
       pango_context_set_font_description (pango_context, font_description);
     }
 
-  page_layout.scale_x = page_layout.scale_y = 1.0;
+  page_layout->scale_x = page_layout->scale_y = 1.0;
 
-  if (encoding == NULL)
-    encoding = get_encoding();
+  if (do_show_wrap)
+    wrap_marker_init(paps);
 
-  text = read_file(IN, encoding);
+  if (do_fast_ascii)
+    ascii_engine_init(paps, pango_context, page_layout);
 
-  if (output_format == FORMAT_POSTSCRIPT)
-    postscript_dsc_comments(surface, &page_layout);
+  /* The shaping threads each need a context, with a font map, of their own */
+  if (paps->opt_jobs > 1)
+    {
+      int i;
 
-  paragraphs = split_text_into_paragraphs(cr,
-                                          pango_context,
-                                          &page_layout,
-                                          page_layout.column_width, 
-                                          text);
-  pango_lines = split_paragraphs_into_lines(&page_layout, paragraphs);
+      paps->job_contexts = g_new(PangoContext *, paps->opt_jobs);
+      for (i = 0; i < paps->opt_jobs; i++)
+        paps->job_contexts[i] = clone_pango_context(pango_context, NULL);
+    }
 
-  cairo_scale(cr, page_layout.scale_x, page_layout.scale_y);
+  paps->layout_cache.cpi = page_layout->cpi;
 
-  output_pages(surface, cr, pango_lines, &page_layout, do_draw_header, pango_context);
+  if (paps->encoding == NULL)
+    paps->encoding = g_strdup(get_encoding());
 
-  cairo_destroy (cr);
-  cairo_surface_finish (surface);
-  cairo_surface_destroy(surface);
+  pango_font_description_free(font_description);
   g_option_context_free(ctxt);
 
-  return 0;
+  return paps;
 }
 
-
-/* Read an entire file into a string
+/* Write the document read from file to the output started before, as the
+ * options of paps say: only count its pages or report its layout, follow
+ * it as it grows, or render it, into the files named by pattern if not
+ * NULL. Returns FALSE and sets error if reading the input or writing the
+ * output failed.
  */
-static char *
-read_file (FILE   *file,
-           gchar  *encoding)
+static gboolean
+render_input (paps_t        *paps,
+              FILE          *file,
+              page_layout_t *page_layout,
+              const char    *pattern,
+              GError       **error)
 {
-  GString *inbuf;
-  char *text;
-  char buffer[BUFSIZE];
-  GIConv cvh = NULL;
-  gsize inc_seq_bytes = 0;
+  const char *output_name = "stdout";
 
+  if (paps->do_count_pages)
+    {
+      gchar *count = g_strdup_printf("%d\n", count_pages(paps, file, paps->encoding, paps->pango_context, page_layout, paps->do_draw_header, NULL, TRUE));
 
-  if (encoding != NULL)
+      output_write(paps, count, strlen(count));
+      g_free(count);
+    }
+  else if (paps->output_format == FORMAT_NULL)
     {
-      cvh = g_iconv_open ("UTF-8", encoding);
-      if (cvh == (GIConv)-1)
-        {
-          fprintf(stderr, _("%s: Invalid encoding: %s\n"), g_get_prgname (), encoding);
-          exit(1);
-        }
+      layout_report_t report;
+      int num_pages;
+
+      memset(&report, 0, sizeof(report));
+      report.lines_per_page = g_array_new(FALSE, FALSE, sizeof(int));
+      report.invalid_bytes = g_array_new(FALSE, FALSE, sizeof(guint64));
+      num_pages = count_pages(paps, file, paps->encoding, paps->pango_context, page_layout, paps->do_draw_header, &report, TRUE);
+      write_layout_report(paps, &report, num_pages);
+      g_array_free(report.lines_per_page, TRUE);
+      g_array_free(report.invalid_bytes, TRUE);
     }
-
-  inbuf = g_string_new (NULL);
-  while (1)
+  else
+    {
+      deduce_output_format(paps, paps->output);
+      if (paps->checkpoint_file || paps->do_follow)
+        follow_document(paps, file, paps->encoding, paps->pango_context, page_layout, paps->do_draw_header,
+                        pattern, paps->checkpoint_file, paps->do_follow);
+      else
+        render_document(paps, file, paps->encoding, paps->pango_context, page_layout, paps->do_draw_header,
+                        paps->do_stream, pattern);
+    }
+  page_header_free(paps);
+  page_forms_free(paps);
+
+  if (paps->output != NULL)
+    output_name = paps->output;
+  else if (paps->output_func != NULL)
+    output_name = _("the output");
+  if (!output_finish(paps))
+    paps_set_error(paps, G_FILE_ERROR, G_FILE_ERROR_IO, _("Error writing %s."), output_name);
+  if (paps->error != NULL)
     {
-      char *ib, *ob, obuffer[BUFSIZE * 6], *bp;
-      gsize iblen, ibleft, oblen;
+      g_propagate_error(error, paps->error);
+      paps->error = NULL;
+      return FALSE;
+    }
 
-      bp = fgets (buffer+inc_seq_bytes, BUFSIZE-inc_seq_bytes-1, file);
-      if (inc_seq_bytes)
-        inc_seq_bytes = 0;
+  return TRUE;
+}
 
-      if (ferror (file))
-        {
-          fprintf(stderr, _("%s: Error reading file.\n"), g_get_prgname ());
-          g_string_free (inbuf, TRUE);
-          exit(1);
-        }
-      else if (bp == NULL)
-        break;
+/* Render length bytes of text, or up to a nul if length is negative, as a
+ * document in the output format of the context, passing the output to
+ * write_func as it is produced. The page header shows title, unless the
+ * options have --title. Any number of threads may render at once, each
+ * with a context of its own. Returns FALSE and sets error if the options
+ * are not meant for rendering text in memory, the text is not valid in
+ * the encoding of the options, or write_func failed.
+ */
+gboolean
+paps_render (paps_t             *paps,
+             const gchar        *text,
+             gssize              length,
+             const gchar        *title,
+             paps_write_func_t   write_func,
+             gpointer            closure,
+             GError            **error)
+{
+  page_layout_t page_layout;
+  FILE *file;
 
-      if (cvh != NULL)
-        {
-          ib = buffer;
-          iblen = strlen (ib);
-          ob = bp = obuffer;
-          oblen = BUFSIZE * 6 - 1;
-          if (g_iconv (cvh, &ib, &iblen, &ob, &oblen) == (gsize)-1)
-            {
-              /*
-               * EINVAL - incomplete sequence at the end of the buffer. Move the
-               * incomplete sequence bytes to the beginning of the buffer for
-               * the next round of conversion.
-               */
-              if (errno == EINVAL)
-                {
-                  inc_seq_bytes = iblen;
-                  memmove (buffer, ib, inc_seq_bytes);
-                }
-              else
-                {
-                  fprintf (stderr, _("%1$s: Error while converting input from '%2$s' to UTF-8.\n"),
-                    g_get_prgname(), encoding);
-                  exit(1);
-                }
-             }
-          obuffer[BUFSIZE * 6 - 1 - oblen] = 0;
-        }
-      g_string_append (inbuf, bp);
+  g_return_val_if_fail (paps != NULL, FALSE);
+  g_return_val_if_fail (text != NULL || length == 0, FALSE);
+  g_return_val_if_fail (write_func != NULL, FALSE);
+
+  if (paps->output || paps->batch_file || paps->checkpoint_file || paps->do_follow)
+    {
+      g_set_error (error, G_OPTION_ERROR, G_OPTION_ERROR_FAILED,
+                   _("--output, --batch, --checkpoint and --follow can not be used with paps_render()."));
+      return FALSE;
     }
 
-  fclose (file);
+  if (length < 0)
+    length = strlen (text);
+  /* fmemopen() may refuse an empty buffer */
+  file = length > 0 ? fmemopen ((void *)text, length, "r") : fopen ("/dev/null", "r");
+  if (file == NULL)
+    {
+      int saved_errno = errno;
 
-  /* Add a trailing new line if it is missing */
-  if (inbuf->len && inbuf->str[inbuf->len-1] != '\n')
-    g_string_append(inbuf, "\n");
+      g_set_error (error, G_FILE_ERROR, g_file_error_from_errno (saved_errno),
+                   _("Error reading the text: %s"), g_strerror (saved_errno));
+      return FALSE;
+    }
 
-  text = inbuf->str;
-  g_string_free (inbuf, FALSE);
+  /* The layout of the context is the same for every rendering */
+  page_layout = paps->page_layout;
+  page_layout.title = paps->htitle ? paps->htitle : title ? title : "";
 
-  if (encoding != NULL && cvh != NULL)
-    g_iconv_close(cvh);
+  output_start_func (paps, write_func, closure);
 
-  return text;
+  return render_input (paps, file, &page_layout, NULL, error);
 }
 
-
-/* Take a UTF8 string and break it into paragraphs on \n characters
- */
-static GList *
-split_text_into_paragraphs (cairo_t *cr,
-                            PangoContext *pango_context,
-                            page_layout_t *page_layout,
-                            int paint_width,  /* In pixels */
-                            const char *text)
+/* Print the --stats of the renderings done with the context, and free it */
+void
+paps_free (paps_t *paps)
 {
-  const char *p = text;
-  char *next;
-  gunichar wc;
-  GList *result = NULL;
-  const char *last_para = text;
-  PangoAttrList *attrs = pango_attr_list_new ();
-  pango_attr_list_insert(attrs, pango_attr_insert_hyphens_new(page_layout->do_show_hyphens));
+  int i;
 
-  /* If we are using markup we treat the entire text as a single paragraph.
-   * I tested it and found that this is much slower than the split and
-   * assign method used below. Otherwise we might as well use this single
-   * chunk method always.
-   */
-  if (page_layout->do_use_markup)
+  if (paps == NULL)
+    return;
+
+  /* Unless the options were not valid */
+  if (paps->pango_context)
     {
-      Paragraph *para = g_new (Paragraph, 1);
-      para->wrapped = FALSE; /* No wrapped chars for markups */
-      para->clipped = FALSE;
-      para->text = text;
-      para->length = strlen(text);
-      para->layout = pango_layout_new (pango_context);
-      pango_layout_set_attributes (para->layout, attrs);
-      pango_layout_set_markup (para->layout, para->text, para->length);
-      pango_layout_set_justify (para->layout, page_layout->do_justify);
-      pango_layout_set_alignment (para->layout,
-                                  page_layout->pango_dir == PANGO_DIRECTION_LTR
-                                      ? PANGO_ALIGN_LEFT : PANGO_ALIGN_RIGHT);
-      pango_layout_set_width (para->layout, paint_width * PANGO_SCALE);
-      pango_layout_set_wrap (para->layout, opt_wrap);
+      layout_cache_print_stats (paps);
+      stats_print (paps);
+      g_object_unref (paps->pango_context);
+    }
+  if (paps->job_contexts)
+    {
+      for (i = 0; i < paps->opt_jobs; i++)
+        g_object_unref (paps->job_contexts[i]);
+      g_free (paps->job_contexts);
+    }
 
-      para->height = 0;
-      
-      result = g_list_prepend (result, para);
+  if (paps->layout_cache.table)
+    {
+      g_hash_table_destroy (paps->layout_cache.table);
+      g_queue_clear (&paps->layout_cache.lru);
+    }
+  if (paps->ascii_engine.font)
+    g_object_unref (paps->ascii_engine.font);
+  for (i = 0; i < 2; i++)
+    {
+      if (paps->wrap_markers[i].curve)
+        cairo_path_destroy (paps->wrap_markers[i].curve);
+      if (paps->wrap_markers[i].arrow)
+        cairo_path_destroy (paps->wrap_markers[i].arrow);
+    }
+  g_slist_free_full (paps->paragraph_arena.blocks, g_free);
+  if (paps->opt_page_ranges)
+    g_array_free (paps->opt_page_ranges, TRUE);
+
+  g_free (paps->encoding);
+  g_free (paps->htitle);
+  g_free (paps->output);
+  g_free (paps->batch_file);
+  g_free (paps->checkpoint_file);
+  g_free (paps);
+}
+
+#ifndef PAPS_NO_MAIN
+int main(int argc, char *argv[])
+{
+  GError *error = NULL;
+  FILE *IN = NULL;
+  const gchar *filename_in;
+  int status = 0;
+  paps_t *paps;
+
+  /* Set locale from environment */
+  (void) setlocale(LC_ALL, "");
+
+  /* Setup i18n */
+  textdomain(GETTEXT_PACKAGE);
+  bindtextdomain(GETTEXT_PACKAGE, DATADIR "/locale");
+  bind_textdomain_codeset (GETTEXT_PACKAGE, "UTF-8");
+
+  paps = paps_new(&argc, &argv, &error);
+  if (paps == NULL)
+    {
+      fprintf(stderr, _("Command line error: %s\n"), error->message);
+      exit(1);
+    }
+
+  if (paps->do_fatal_warnings)
+    g_log_set_always_fatal(G_LOG_LEVEL_MASK);
+
+  if (paps->batch_file)
+    {
+      if (paps->do_count_pages)
+        {
+          fprintf(stderr, _("%s: --count-pages can not be used with --batch.\n"), g_get_prgname ());
+          exit(1);
+        }
+      if (paps->checkpoint_file || paps->do_follow)
+        {
+          fprintf(stderr, _("%s: --checkpoint and --follow can not be used with --batch.\n"), g_get_prgname ());
+          exit(1);
+        }
+      if (paps->output_format == FORMAT_NULL)
+        {
+          fprintf(stderr, _("%s: --format=null can not be used with --batch.\n"), g_get_prgname ());
+          exit(1);
+        }
+
+      status = run_batch(paps, paps->batch_file, paps->encoding, paps->pango_context, &paps->page_layout,
+                         paps->htitle, paps->do_draw_header, paps->do_stream) ? 0 : 1;
     }
   else
     {
+      if ((paps->checkpoint_file || paps->do_follow)
+          && (paps->do_count_pages || paps->page_layout.do_use_markup || paps->output_format == FORMAT_NULL))
+        {
+          fprintf(stderr, _("%s: --checkpoint and --follow can not be used with --count-pages, --markup or --format=null.\n"), g_get_prgname ());
+          exit(1);
+        }
 
-      while (p != NULL && *p)
+      if (argc > 1)
         {
-          wc = g_utf8_get_char (p);
-          next = g_utf8_next_char (p);
-          if (wc == (gunichar)-1)
+          filename_in = argv[1];
+          IN = fopen(filename_in, "r");
+          if (!IN)
             {
-              fprintf (stderr, _("%s: Invalid character in input\n"), g_get_prgname ());
-              wc = 0;
+              fprintf(stderr, _("Failed to open %s!\n"), filename_in);
+              exit(1);
             }
-          if (!*p || !wc || wc == '\r' || wc == '\n' || wc == '\f')
+        }
+      else
+        {
+          filename_in = "stdin";
+          IN = stdin;
+        }
+
+      // For now always write to stdout
+      if (paps->output == NULL)
+        output_start(paps, stdout);
+      else if (output_pattern(paps->output) && !paps->do_count_pages && paps->output_format != FORMAT_NULL)
+        paps->output_fh = NULL;   /* Opened for each file */
+      else
+        {
+          FILE *fh = fopen(paps->output,"wb");
+          if (!fh)
             {
-              Paragraph *para = g_new (Paragraph, 1);
-              para->wrapped = FALSE;
-              para->clipped = FALSE;
-              para->text = last_para;
-              para->length = p - last_para;
-              /* handle dos line breaks */
-              if (wc == '\r' && *next == '\n')
-                  next = g_utf8_next_char(next);
-              para->layout = pango_layout_new (pango_context);
+              fprintf(stderr, _("Failed to open %s for writing!\n"), paps->output);
+              exit(1);
+            }
+          output_start(paps, fh);
+        }
 
-              pango_layout_set_attributes (para->layout,attrs);
+      if (paps->htitle)
+         paps->page_layout.title = paps->htitle;
+      else
+         paps->page_layout.title = basename((char *)filename_in);
+
+      if (!render_input(paps, IN, &paps->page_layout, output_pattern(paps->output), &error))
+        {
+          fprintf(stderr, "%s: %s\n", g_get_prgname (), error->message);
+          g_error_free(error);
+          status = 1;
+        }
+    }
 
+  paps_free(paps);
 
-              if (page_layout->cpi > 0.0L)
-                {
-                  /* figuring out the correct width from the pango_font_metrics_get_approximate_width()
-                   * is really hard and pango_layout_set_wrap() doesn't work properly then.
-                   * Those are not reliable to render the characters exactly according to the given CPI.
-                   * So re-calculate the width to wrap up to be comfortable with CPI.
-                   */
-                  wchar_t *wtext = NULL, *wnewtext = NULL;
-                  gchar *newtext = NULL;
-                  gsize len, col, i, wwidth = 0;
-                  PangoRectangle ink_rect, logical_rect;
-
-                  wtext = (wchar_t *)g_utf8_to_ucs4 (para->text, para->length, NULL, NULL, NULL);
-                  if (wtext == NULL)
-                    {
-                      fprintf (stderr, _("%s: Unable to convert UTF-8 to UCS-4.\n"), g_get_prgname ());
-                    fail:
-                      g_free (wtext);
-                      g_free (wnewtext);
-                      g_free (newtext);
-                      exit (1);
-                    }
-                  len = g_utf8_strlen (para->text, para->length);
-                  /* the amount of characters that can be put on the line against CPI */
-                  col = (int)(page_layout->column_width / 72.0 * page_layout->cpi);
-                  if (len > col)
-                    {
-                      /* need to wrap them up */
-                      wnewtext = g_new (wchar_t, wcslen (wtext) + 1);
-                      para->clipped = TRUE;
-                      if (wnewtext == NULL)
-                        {
-                          fprintf (stderr, _("%s: Unable to allocate the memory.\n"), g_get_prgname ());
-                          goto fail;
-                        }
-                      for (i = 0; i < len; i++)
-                        {
-                          gssize w = wcwidth (wtext[i]);
-
-                          if (w >= 0)
-                            wwidth += w;
-                          if (wwidth > col)
-                            break;
-                          wnewtext[i] = wtext[i];
-                        }
-                      wnewtext[i] = 0L;
-
-                      newtext = g_ucs4_to_utf8 ((const gunichar *)wnewtext, i, NULL, NULL, NULL);
-                      if (newtext == NULL)
-                        {
-                          fprintf (stderr, _("%s: Unable to convert UCS-4 to UTF-8.\n"), g_get_prgname ());
-                          goto fail;
-                        }
-                      pango_layout_set_text (para->layout, newtext, -1);
-                      pango_layout_get_extents (para->layout, &ink_rect, &logical_rect);
-                      paint_width = logical_rect.width / PANGO_SCALE;
-                      g_free (wnewtext);
-                      g_free (newtext);
-
-                      para->length = i;
-                      next = g_utf8_offset_to_pointer (para->text, para->length);
-                      wc = g_utf8_get_char (g_utf8_prev_char (next));
-                    }
-                  else
-                    {
-                      pango_layout_set_text (para->layout, para->text, para->length);
-                    }
-
-                  g_free (wtext);
-
-                  pango_layout_set_width (para->layout, -1);
-                }
-              else
-                {
-                  pango_layout_set_text (para->layout, para->text, para->length);
-                  pango_layout_set_width (para->layout, paint_width * PANGO_SCALE);
+  return status;
+}
+#endif /* PAPS_NO_MAIN */
 
-                  pango_layout_set_wrap (para->layout, opt_wrap);
 
-                  if (opt_wrap == PANGO_WRAP_CHAR)
-                      para->wrapped = TRUE;                    
+/* Deduce the output format from the file name if not explicitely set
+ */
+static void
+deduce_output_format (paps_t *paps, const char *filename)
+{
+  if (paps->output_format_set || filename == NULL)
+    return;
 
-                  /* Should we support truncation as well? */
-                }
-                  
-              pango_layout_set_justify (para->layout, page_layout->do_justify);
-              pango_layout_set_alignment (para->layout,
-                                          page_layout->pango_dir == PANGO_DIRECTION_LTR
-                                          ? PANGO_ALIGN_LEFT : PANGO_ALIGN_RIGHT);
-
-              para->height = 0;
-
-              last_para = next;
-            
-              if (wc == '\f')
-                para->formfeed = 1;
-              else
-                para->formfeed = 0;
-
-              result = g_list_prepend (result, para);
-            }
-          if (!wc) /* incomplete character at end */
-            break;
-          p = next;
+  if (g_str_has_suffix(filename, ".svg") || g_str_has_suffix(filename, ".SVG"))
+    paps->output_format = FORMAT_SVG;
+  else if (g_str_has_suffix(filename, ".pdf") || g_str_has_suffix(filename, ".PDF"))
+    paps->output_format = FORMAT_PDF;
+  else if (g_str_has_suffix(filename, ".png") || g_str_has_suffix(filename, ".PNG"))
+    paps->output_format = FORMAT_PNG;
+  else if (g_str_has_suffix(filename, ".pwg") || g_str_has_suffix(filename, ".PWG"))
+    paps->output_format = FORMAT_PWG;
+  else
+    paps->output_format = FORMAT_POSTSCRIPT;
+}
+
+/* Whether the output format is rendered to pixels, see raster_encode_page() */
+static gboolean
+output_is_raster (paps_t *paps)
+{
+  return paps->output_format == FORMAT_PNG || paps->output_format == FORMAT_PWG;
+}
+
+static cairo_status_t
+raster_append_func (void                *closure,
+                    const unsigned char *data,
+                    unsigned int         length)
+{
+  g_byte_array_append ((GByteArray *)closure, data, length);
+  return CAIRO_STATUS_SUCCESS;
+}
+
+static void
+raster_put_uint32 (guint8 *p,
+                   guint32 value)
+{
+  p[0] = value >> 24;
+  p[1] = value >> 16;
+  p[2] = value >> 8;
+  p[3] = value;
+}
+
+/* Append a row of RGB24 pixels, compressed as PWG raster requires: runs
+ * of up to 128 equal pixels as a count and the pixel, and up to 128
+ * others as a count and the pixels themselves.
+ */
+static void
+raster_append_pwg_row (GByteArray    *bytes,
+                       const guint32 *row,
+                       int            width)
+{
+  int i = 0, j, k;
+
+  while (i < width)
+    {
+      guint8 code;
+
+      for (j = i + 1; j < width && j - i < 128 && ((row[j] ^ row[i]) & 0xffffff) == 0; j++)
+        ;
+      if (j - i > 1)
+        {
+          code = j - i - 1;
+          g_byte_array_append (bytes, &code, 1);
+        }
+      else
+        {
+          /* Up to where the next run starts */
+          for (j = i + 1; j < width && j - i < 128
+                 && !(j + 1 < width && ((row[j] ^ row[j + 1]) & 0xffffff) == 0); j++)
+            ;
+          code = j - i == 1 ? 0 : 257 - (j - i);
+          g_byte_array_append (bytes, &code, 1);
+        }
+      for (k = i; k < (code < 128 ? i + 1 : j); k++)
+        {
+          guint8 rgb[3] = { row[k] >> 16, row[k] >> 8, row[k] };
+
+          g_byte_array_append (bytes, rgb, 3);
+        }
+      i = j;
+    }
+}
+
+/* Whether two rows of RGB24 pixels have the same colors. cairo leaves the
+ * top byte of each pixel undefined, so it is not compared.
+ */
+static gboolean
+raster_rows_equal (const guint32 *a,
+                   const guint32 *b,
+                   int            width)
+{
+  int i;
+
+  for (i = 0; i < width; i++)
+    if (((a[i] ^ b[i]) & 0xffffff) != 0)
+      return FALSE;
+
+  return TRUE;
+}
+
+/* Render a recorded page at opt_dpi and encode it in the output format:
+ * a PNG image, or a page of a PWG raster stream, of 8-bit sRGB with the
+ * 1796 byte page header of PWG 5102.4. Pages are independent of each
+ * other, so this may be done in several threads.
+ */
+static GByteArray *
+raster_encode_page (paps_t *paps, cairo_surface_t *recording)
+{
+  GByteArray *bytes = g_byte_array_new ();
+  cairo_rectangle_t extents;
+  cairo_surface_t *image;
+  cairo_t *cr;
+  int width, height;
+
+  cairo_recording_surface_get_extents (recording, &extents);
+  width = (int)(extents.width * paps->opt_dpi / 72.0 + 0.5);
+  height = (int)(extents.height * paps->opt_dpi / 72.0 + 0.5);
+
+  image = cairo_image_surface_create (CAIRO_FORMAT_RGB24, width, height);
+  cr = cairo_create (image);
+  cairo_set_source_rgb (cr, 1, 1, 1);
+  cairo_paint (cr);
+  cairo_scale (cr, paps->opt_dpi / 72.0, paps->opt_dpi / 72.0);
+  cairo_set_source_surface (cr, recording, 0, 0);
+  cairo_paint (cr);
+  cairo_destroy (cr);
+  cairo_surface_flush (image);
+
+  if (paps->output_format == FORMAT_PNG)
+    cairo_surface_write_to_png_stream (image, raster_append_func, bytes);
+  else
+    {
+      const guint8 *data = cairo_image_surface_get_data (image);
+      int stride = cairo_image_surface_get_stride (image);
+      guint8 header[1796];
+      int y = 0;
+
+      memset (header, 0, sizeof(header));
+      strcpy ((char *)header, "PwgRaster");
+      raster_put_uint32 (header + 276, paps->opt_dpi);              /* HWResolution */
+      raster_put_uint32 (header + 280, paps->opt_dpi);
+      raster_put_uint32 (header + 352, (guint32)(extents.width + 0.5));  /* PageSize */
+      raster_put_uint32 (header + 356, (guint32)(extents.height + 0.5));
+      raster_put_uint32 (header + 372, width);                /* Width */
+      raster_put_uint32 (header + 376, height);               /* Height */
+      raster_put_uint32 (header + 384, 8);                    /* BitsPerColor */
+      raster_put_uint32 (header + 388, 24);                   /* BitsPerPixel */
+      raster_put_uint32 (header + 392, width * 3);            /* BytesPerLine */
+      raster_put_uint32 (header + 400, 19);                   /* ColorSpace sRGB */
+      raster_put_uint32 (header + 420, 3);                    /* NumColors */
+      raster_put_uint32 (header + 456, 1);                    /* CrossFeedTransform */
+      raster_put_uint32 (header + 460, 1);                    /* FeedTransform */
+      raster_put_uint32 (header + 480, 0xffffff);             /* AlternatePrimary */
+      g_byte_array_append (bytes, header, sizeof(header));
+
+      /* Each row is preceded by the number of times it is repeated */
+      while (y < height)
+        {
+          const guint8 *row = data + (gsize)y * stride;
+          guint8 repeat = 0;
+
+          while (y + repeat + 1 < height && repeat < 255
+                 && raster_rows_equal ((const guint32 *)row,
+                                       (const guint32 *)(row + (gsize)(repeat + 1) * stride), width))
+            repeat++;
+          g_byte_array_append (bytes, &repeat, 1);
+          raster_append_pwg_row (bytes, (const guint32 *)row, width);
+          y += repeat + 1;
         }
     }
+  cairo_surface_destroy (image);
+
+  return bytes;
+}
+
+/* Write a page encoded by raster_encode_page(), unless there was an error */
+static void
+raster_write_page (paps_t *paps, GByteArray *bytes)
+{
+  if (paps->error == NULL && !output_write (paps, bytes->data, bytes->len))
+    paps_set_error (paps, G_FILE_ERROR, G_FILE_ERROR_IO, _("Error writing output."));
+  g_byte_array_free (bytes, TRUE);
+}
+
+/* Create the surface of a document in the output format, written to
+ * output_fh. With a raster format, it is a recording surface for a
+ * single page, see eject_page(). A surface that failed is still returned,
+ * drawing nothing.
+ */
+static cairo_surface_t *
+create_surface (paps_t *paps, page_layout_t *page_layout)
+{
+  double surface_page_width = page_layout->page_width;
+  double surface_page_height = page_layout->page_height;
+  cairo_surface_t *surface;
+
+  /* Postscript pages stay portrait and are rotated by start_page() */
+  if (paps->output_format == FORMAT_POSTSCRIPT && page_layout->do_landscape)
+    {
+      surface_page_width = page_layout->page_height;
+      surface_page_height = page_layout->page_width;
+    }
+
+  if (paps->output_format == FORMAT_POSTSCRIPT)
+    surface = cairo_ps_surface_create_for_stream(&paps_cairo_write_func,
+                                                 paps,
+                                                 surface_page_width,
+                                                 surface_page_height);
+  else if (output_is_raster(paps))
+    {
+      cairo_rectangle_t extents = { 0, 0, surface_page_width, surface_page_height };
+
+      surface = cairo_recording_surface_create(CAIRO_CONTENT_COLOR_ALPHA, &extents);
+    }
+  else if (paps->output_format == FORMAT_PDF)
+    surface = cairo_pdf_surface_create_for_stream(&paps_cairo_write_func,
+                                                  paps,
+                                                  surface_page_width,
+                                                  surface_page_height);
+  else
+    surface = cairo_svg_surface_create_for_stream(&paps_cairo_write_func,
+                                                  paps,
+                                                  surface_page_width,
+                                                  surface_page_height);
+
+  if (cairo_surface_status(surface) != CAIRO_STATUS_SUCCESS)
+    paps_set_error(paps, G_FILE_ERROR, G_FILE_ERROR_FAILED, _("Error creating the output: %s"),
+                   cairo_status_to_string(cairo_surface_status(surface)));
+
+  return surface;
+}
+
+/* Whether the output file name has a %d for the file number, with optional
+ * zero padding and width, and otherwise only %%. Returns the name if so.
+ */
+static const char *
+output_pattern (const char *filename)
+{
+  const char *p;
+  int conversions = 0;
+
+  if (filename == NULL)
+    return NULL;
+
+  for (p = strchr(filename, '%'); p != NULL; p = strchr(p + 1, '%'))
+    {
+      p++;
+      if (*p == '%')
+        continue;
+      while (*p == '0')
+        p++;
+      while (g_ascii_isdigit(*p))
+        p++;
+      if (*p != 'd')
+        return NULL;
+      conversions++;
+    }
+
+  return conversions == 1 ? filename : NULL;
+}
+
+static void
+output_doc_open_file (paps_t *paps, output_doc_t *doc)
+{
+  /* After an error, the surface writes to no file */
+  if (doc->pattern && paps->error == NULL)
+    {
+      gchar *filename = g_strdup_printf(doc->pattern, ++doc->file_idx);
+      FILE *fh = fopen(filename, "wb");
+
+      if (fh)
+        output_start(paps, fh);
+      else
+        paps_set_error(paps, G_FILE_ERROR, g_file_error_from_errno(errno),
+                       _("Failed to open %s for writing: %s"), filename, g_strerror(errno));
+      g_free(filename);
+    }
 
-  return g_list_reverse (result);
+  /* A PWG raster stream starts with its sync word */
+  if (paps->output_format == FORMAT_PWG)
+    output_write(paps, "RaS2", 4);
+
+  doc->surface = create_surface(paps, doc->page_layout);
+  doc->cr = cairo_create(doc->surface);
+  if (paps->output_format == FORMAT_POSTSCRIPT)
+    postscript_dsc_comments(doc->surface, doc->page_layout);
+  cairo_scale(doc->cr, doc->page_layout->scale_x, doc->page_layout->scale_y);
 }
 
+static void
+output_doc_close_file (paps_t *paps, output_doc_t *doc)
+{
+  cairo_destroy (doc->cr);
+  cairo_surface_finish (doc->surface);
+  cairo_surface_destroy(doc->surface);
 
+  if (doc->pattern && !output_finish(paps))
+    paps_set_error(paps, G_FILE_ERROR, G_FILE_ERROR_IO, _("Error writing %s."), doc->pattern);
+}
 
-/* Split a list of paragraphs into a list of lines.
+/* Create the surface of the document. With a pattern, the output goes to
+ * numbered files instead of output_fh. SVG has no real notion of pages,
+ * so it gets a file per page unless --pages-per-file says otherwise. PNG
+ * has none at all, so it always gets a file per page, and without a
+ * pattern only one page may be output, see output_doc_start_page().
  */
-GList *
-split_paragraphs_into_lines(page_layout_t *page_layout,
-                            GList         *paragraphs)
+static void
+output_doc_open (paps_t        *paps,
+                 output_doc_t  *doc,
+                 page_layout_t *page_layout,
+                 const char    *pattern)
 {
-  GList *line_list = NULL;
-  int max_height = 0;
-  /* Read the file */
+  doc->page_layout = page_layout;
+  doc->pattern = pattern;
+  doc->pages_per_file = 0;
+  if (pattern && paps->output_format == FORMAT_PNG)
+    doc->pages_per_file = 1;
+  else if (pattern && paps->opt_pages_per_file > 0)
+    doc->pages_per_file = paps->opt_pages_per_file;
+  else if (pattern && paps->output_format == FORMAT_SVG)
+    doc->pages_per_file = 1;
+  doc->file_idx = 0;
+  doc->num_pages = 0;
+
+  output_doc_open_file(paps, doc);
+}
 
-  /* Now split all the pagraphs into lines */
-  GList *par_list;
+/* Start a page, in a new file if the current one is full. The file is
+ * complete once it is closed, so consumers may pick it up while the next
+ * one is written. A second PNG image in the same file would not be a
+ * valid PNG file, so it is an error, and no more pages are written.
+ */
+static void
+output_doc_start_page (paps_t *paps, output_doc_t *doc)
+{
+  if (paps->output_format == FORMAT_PNG && doc->pages_per_file == 0 && doc->num_pages > 0)
+    paps_set_error(paps, G_OPTION_ERROR, G_OPTION_ERROR_BAD_VALUE,
+                   _("The png format has one page per file. Use an output file name with a %%d, or --pages to select a page."));
 
-  par_list = paragraphs;
-  while(par_list)
+  if (doc->pages_per_file > 0 && doc->num_pages > 0
+      && doc->num_pages % doc->pages_per_file == 0)
     {
-      int para_num_lines, i;
-      LineLink *line_link;
-      Paragraph *para = par_list->data;
+      output_doc_close_file(paps, doc);
+      output_doc_open_file(paps, doc);
+    }
+  else if (output_is_raster(paps) && doc->num_pages > 0)
+    {
+      /* The previous page was rendered from its recording by eject_page() */
+      cairo_destroy(doc->cr);
+      cairo_surface_destroy(doc->surface);
+      doc->surface = create_surface(paps, doc->page_layout);
+      doc->cr = cairo_create(doc->surface);
+      cairo_scale(doc->cr, doc->page_layout->scale_x, doc->page_layout->scale_y);
+    }
+  doc->num_pages++;
+  start_page(paps, doc->surface, doc->cr, doc->page_layout);
+}
 
-      para_num_lines = pango_layout_get_line_count(para->layout);
+/* Whether the page is to be drawn, see --pages */
+static gboolean
+page_selected (paps_t *paps, int page_idx)
+{
+  guint i;
 
-      for (i=0; i<para_num_lines; i++)
+  if (paps->opt_page_ranges == NULL)
+    return TRUE;
+
+  for (i = 0; i < paps->opt_page_ranges->len; i++)
+    {
+      page_range_t *range = &g_array_index(paps->opt_page_ranges, page_range_t, i);
+
+      if (page_idx >= range->first && page_idx <= range->last)
+        return TRUE;
+    }
+
+  return FALSE;
+}
+
+static void
+output_doc_close (paps_t *paps, output_doc_t *doc)
+{
+  output_doc_close_file(paps, doc);
+}
+
+/* Lay out the file and write it as a document in the output format, to
+ * output_fh or to the files named by pattern. The input file is closed.
+ * Returns the number of pages.
+ */
+static int
+render_document (paps_t          *paps,
+                 FILE            *file,
+                 gchar           *encoding,
+                 PangoContext    *pango_context,
+                 page_layout_t   *page_layout,
+                 gboolean         need_header,
+                 gboolean         do_stream,
+                 const char      *pattern)
+{
+  output_doc_t doc;
+  input_reader_t reader;
+  GList *paragraphs;
+  GArray *lines;
+  const char *text;
+  gsize length;
+  int num_pages;
+
+  output_doc_open(paps, &doc, page_layout, pattern);
+
+  /* Markup may span lines, so it can only be parsed as a whole */
+  if (do_stream && !page_layout->do_use_markup)
+    num_pages = output_stream(paps, &doc, file, encoding, pango_context, page_layout, need_header, -1);
+  /* Input that can not be read again is copied once for the header */
+  else if (paps->opt_max_memory > 0 && !page_layout->do_use_markup && need_header && !is_regular_file(file))
+    num_pages = output_bounded(paps, &doc, file, encoding, pango_context, page_layout, need_header);
+  else if (paps->opt_max_memory > 0 && !page_layout->do_use_markup)
+    num_pages = output_measured(paps, &doc, file, encoding, pango_context, page_layout, need_header);
+  else
+    {
+      input_reader_init(paps, &reader, file, encoding);
+      text = input_reader_read(paps, &reader, 0, &length);
+      if (text == NULL)
         {
-          PangoRectangle logical_rect, ink_rect;
-          
-          line_link = g_new(LineLink, 1);
-          line_link->formfeed = 0;
-          line_link->wrapped = (para->wrapped && i < para_num_lines - 1) || (para->clipped);
-          line_link->pango_line = pango_layout_get_line(para->layout, i);
-          pango_layout_line_get_extents(line_link->pango_line,
-                                        &ink_rect, &logical_rect);
-          line_link->logical_rect = logical_rect;
-          if (para->formfeed && i == (para_num_lines - 1))
-              line_link->formfeed = 1;
-          line_link->ink_rect = ink_rect;
-          line_list = g_list_prepend(line_list, line_link);
-          if (logical_rect.height > max_height)
-              max_height = logical_rect.height;
+          text = "";
+          length = 0;
         }
 
-      par_list = par_list->next;
+      paragraphs = split_text_into_paragraphs(paps, doc.cr,
+                                              pango_context,
+                                              page_layout,
+                                              page_layout->column_width, 
+                                              text,
+                                              length);
+      lines = split_paragraphs_into_lines(paps, page_layout, paragraphs);
+
+      num_pages = output_pages(paps, &doc, lines, page_layout, need_header, pango_context);
+
+      /* The paragraphs pointed into the text until they were drawn */
+      input_reader_close(&reader);
     }
-  
-  /*
-   * not fixed for cairo backend: disable
-   *
-  if (page_layout->do_stretch_chars && page_layout->lpi > 0.0L)
-      page_layout->scale_y = 1.0 / page_layout->lpi * 72.0 * PANGO_SCALE / max_height;
-   */
 
-  return g_list_reverse(line_list);
-  
+  output_doc_close(paps, &doc);
+
+  paps->stats.documents++;
+  paps->stats.pages += num_pages;
+  return num_pages;
+}
+
+/* Render the documents listed in batch_file, or stdin for "-", with the
+ * fonts and the layout set up once. Each line names an input and an output
+ * file, separated by a tab, or by a space if there is no tab. Empty lines
+ * and lines starting with '#' are skipped. A line "output<TAB>pages" is
+ * printed to stdout as soon as a document is written, so that the list may
+ * be fed through a pipe. Returns FALSE if any document failed.
+ */
+static gboolean
+run_batch (paps_t          *paps,
+           const char      *batch_file,
+           gchar           *encoding,
+           PangoContext    *pango_context,
+           page_layout_t   *page_layout,
+           const gchar     *htitle,
+           gboolean         need_header,
+           gboolean         do_stream)
+{
+  FILE *list;
+  char *line = NULL;
+  size_t line_size = 0;
+  gboolean ok = TRUE;
+
+  if (strcmp(batch_file, "-") == 0)
+    list = stdin;
+  else
+    {
+      list = fopen(batch_file, "r");
+      if (!list)
+        {
+          fprintf(stderr, _("Failed to open %s!\n"), batch_file);
+          return FALSE;
+        }
+    }
+
+  while (getline(&line, &line_size, list) != -1)
+    {
+      char *input, *output, *sep;
+      FILE *file;
+      int num_pages;
+
+      input = g_strstrip(line);
+      if (*input == '\0' || *input == '#')
+        continue;
+
+      sep = strchr(input, '\t');
+      if (sep == NULL)
+        sep = strchr(input, ' ');
+      if (sep == NULL)
+        {
+          fprintf(stderr, _("%s: Invalid batch line: %s\n"), g_get_prgname (), input);
+          ok = FALSE;
+          continue;
+        }
+      *sep = '\0';
+      output = g_strchug(sep + 1);
+
+      file = fopen(input, "r");
+      if (!file)
+        {
+          fprintf(stderr, _("Failed to open %s!\n"), input);
+          ok = FALSE;
+          continue;
+        }
+      if (!output_pattern(output))
+        {
+          FILE *fh = fopen(output, "wb");
+          if (!fh)
+            {
+              fprintf(stderr, _("Failed to open %s for writing!\n"), output);
+              fclose(file);
+              ok = FALSE;
+              continue;
+            }
+          output_start(paps, fh);
+        }
+
+      deduce_output_format(paps, output);
+      if (htitle)
+        page_layout->title = htitle;
+      else
+        page_layout->title = basename(input);
+
+      num_pages = render_document(paps, file, encoding, pango_context, page_layout, need_header, do_stream,
+                                  output_pattern(output));
+      /* The next document gets a header with its own title and date */
+      page_header_free(paps);
+      page_forms_free(paps);
+
+      if (!output_pattern(output) && !output_finish(paps))
+        paps_set_error(paps, G_FILE_ERROR, G_FILE_ERROR_IO, _("Error writing %s."), output);
+      if (paps->error != NULL)
+        {
+          fprintf(stderr, "%s: %s\n", g_get_prgname (), paps->error->message);
+          g_clear_error(&paps->error);
+          ok = FALSE;
+          continue;
+        }
+
+      printf("%s\t%d\n", output, num_pages);
+      fflush(stdout);
+    }
+
+  free(line);
+  if (list != stdin)
+    fclose(list);
+
+  return ok;
+}
+
+/* Whether the converter leaves the printable ASCII characters and the
+ * usual control characters alone, as with the ISO-8859 family, EUC-JP,
+ * Shift_JIS or GB18030. Text in such an encoding that is 7-bit clean does
+ * not need to be converted.
+ */
+static gboolean
+is_ascii_compatible (GIConv cvh)
+{
+  char in[4 + ASCII_LAST - ASCII_FIRST + 1], out[sizeof(in) * 4];
+  char *ib = in, *ob = out;
+  gsize iblen = sizeof(in), oblen = sizeof(out);
+  gboolean compatible;
+  int i;
+
+  in[0] = '\t';
+  in[1] = '\n';
+  in[2] = '\f';
+  in[3] = '\r';
+  for (i = ASCII_FIRST; i <= ASCII_LAST; i++)
+    in[4 + i - ASCII_FIRST] = i;
+
+  compatible = g_iconv (cvh, &ib, &iblen, &ob, &oblen) != (gsize)-1
+    && ob - out == sizeof(in)
+    && memcmp (in, out, sizeof(in)) == 0;
+
+  /* Back to the initial state */
+  g_iconv (cvh, NULL, NULL, NULL, NULL);
+
+  return compatible;
+}
+
+/* Regular files in UTF-8, or 7-bit clean ones in an ASCII compatible
+ * encoding, are read in place through a mapping, so that the paragraphs
+ * point straight into it. Other files are read and converted as usual, so
+ * that errors are reported the same way.
+ */
+static gboolean
+input_reader_map (paps_t *paps, input_reader_t *reader)
+{
+  int fd = fileno (reader->file);
+  struct stat st;
+  off_t offset;
+  const char *contents;
+  gsize length;
+  stats_clock_t timer;
+  gboolean valid;
+
+  if (reader->cvh != NULL && !reader->ascii_compatible)
+    return FALSE;
+
+  if (fstat (fd, &st) < 0 || !S_ISREG (st.st_mode))
+    return FALSE;
+
+  /* Part of stdin may have been read already by someone else */
+  offset = lseek (fd, 0, SEEK_CUR);
+  if (offset < 0 || offset >= st.st_size)
+    return FALSE;
+
+  stats_start (paps, &timer);
+  reader->mapping = g_mapped_file_new_from_fd (fd, FALSE, NULL);
+  if (reader->mapping == NULL)
+    {
+      stats_stop (paps, &timer, STAGE_READ);
+      return FALSE;
+    }
+
+  /* Validating the text also pages it in */
+  contents = g_mapped_file_get_contents (reader->mapping) + offset;
+  length = g_mapped_file_get_length (reader->mapping) - offset;
+  valid = reader->cvh != NULL ? is_7bit_text (contents, length)
+                              : utf8_validate (contents, length, NULL);
+  /* Text with NUL characters is read as usual, to drop what follows them */
+  if (valid && memchr (contents, '\0', length) != NULL)
+    valid = FALSE;
+  stats_stop (paps, &timer, STAGE_READ);
+  if (!valid)
+    {
+      g_mapped_file_unref (reader->mapping);
+      reader->mapping = NULL;
+      return FALSE;
+    }
+
+  reader->map_pos = contents;
+  reader->map_end = contents + length;
+  paps->stats.bytes_read += length;
+
+  return TRUE;
+}
+
+static void
+input_reader_init (paps_t         *paps,
+                   input_reader_t *reader,
+                   FILE           *file,
+                   const gchar    *encoding)
+{
+  reader->file = file;
+  reader->encoding = encoding;
+  reader->cvh = NULL;
+  reader->utf8 = FALSE;
+  reader->ascii_compatible = FALSE;
+  reader->mapping = NULL;
+  reader->block = NULL;
+  reader->inc_seq_bytes = 0;
+  reader->pending = NULL;
+  reader->pending_pos = 0;
+  reader->chunk = NULL;
+  reader->eof = FALSE;
+  reader->bytes_read = 0;
+  reader->block_offset = 0;
+  reader->report = NULL;
+  reader->max_chunk = 0;
+  reader->in_nul_line = FALSE;
+  if (paps->opt_max_memory > 0)
+    reader->max_chunk = MAX (STREAM_CHUNK_SIZE,
+                             (guint64)paps->opt_max_memory * 1024 * 1024 / LAYOUT_MEMORY_FACTOR);
+
+  if (encoding != NULL && is_utf8_encoding (encoding))
+    reader->utf8 = TRUE;
+  else if (encoding != NULL)
+    {
+      reader->cvh = g_iconv_open ("UTF-8", encoding);
+      if (reader->cvh == (GIConv)-1)
+        {
+          paps_set_error (paps, G_CONVERT_ERROR, G_CONVERT_ERROR_NO_CONVERSION,
+                          _("Invalid encoding: %s"), encoding);
+          reader->cvh = NULL;
+          reader->eof = TRUE;
+        }
+      else
+        reader->ascii_compatible = is_ascii_compatible (reader->cvh);
+    }
+
+  if (!reader->eof && input_reader_map (paps, reader))
+    return;
+
+  reader->block = g_malloc (READ_BLOCK_SIZE);
+  reader->pending = g_string_sized_new (READ_BLOCK_SIZE);
+}
+
+/* Replace the invalid byte at p in the block by U+FFFD, and note its
+ * offset in the input for the report.
+ */
+static void
+input_reader_replace_invalid (input_reader_t *reader,
+                              const char     *p)
+{
+  layout_report_t *report = reader->report;
+  guint64 offset = reader->block_offset + (p - reader->block);
+
+  if (report->invalid_bytes->len < REPORT_MAX_INVALID_BYTES)
+    g_array_append_val (report->invalid_bytes, offset);
+  report->num_invalid_bytes++;
+  g_string_append_len (reader->pending, "\xef\xbf\xbd", 3);
+}
+
+/* Stop reading at invalid input, which is an error unless it is reported */
+static void
+input_reader_set_invalid (paps_t         *paps,
+                          input_reader_t *reader)
+{
+  paps_set_error (paps, G_CONVERT_ERROR, G_CONVERT_ERROR_ILLEGAL_SEQUENCE,
+                  _("Error while converting input from '%s' to UTF-8."), reader->encoding);
+  reader->eof = TRUE;
+  reader->inc_seq_bytes = 0;
+}
+
+/* Append the UTF-8 text of the block to the pending text as it is, once it
+ * is validated. An incomplete character at the end of the block is carried
+ * over to the next one. Invalid bytes are an error, unless they are to be
+ * reported.
+ */
+static void
+input_reader_append_utf8 (paps_t         *paps,
+                          input_reader_t *reader,
+                          gsize           iblen)
+{
+  const char *ib = reader->block, *end = ib + iblen, *valid_end;
+
+  while (!utf8_validate (ib, end - ib, &valid_end))
+    {
+      gsize left = end - valid_end;
+
+      if (g_utf8_get_char_validated (valid_end, left) == (gunichar)-2)
+        {
+          /* The block is reused once the text before it is appended */
+          g_string_append_len (reader->pending, ib, valid_end - ib);
+          if (!reader->eof)
+            {
+              reader->inc_seq_bytes = left;
+              memmove (reader->block, valid_end, reader->inc_seq_bytes);
+            }
+          else if (reader->report)
+            input_reader_replace_invalid (reader, valid_end);
+          return;
+        }
+      if (reader->report == NULL)
+        {
+          input_reader_set_invalid (paps, reader);
+          return;
+        }
+      g_string_append_len (reader->pending, ib, valid_end - ib);
+      input_reader_replace_invalid (reader, valid_end);
+      ib = valid_end + 1;
+    }
+  g_string_append_len (reader->pending, ib, end - ib);
+}
+
+/* Read the next block of the file and append it to the pending text,
+ * converted to UTF-8.
+ */
+static void
+input_reader_fill (paps_t *paps, input_reader_t *reader)
+{
+  GString *pending = reader->pending;
+  gsize size, iblen;
+  char *ib;
+  stats_clock_t timer, iconv_timer;
+
+  stats_start (paps, &timer);
+  reader->block_offset = reader->bytes_read - reader->inc_seq_bytes;
+  size = fread (reader->block + reader->inc_seq_bytes, 1,
+                READ_BLOCK_SIZE - reader->inc_seq_bytes, reader->file);
+  if (ferror (reader->file))
+    {
+      paps_set_error (paps, G_FILE_ERROR, g_file_error_from_errno (errno),
+                      _("Error reading file: %s"), g_strerror (errno));
+      reader->eof = TRUE;
+      stats_stop (paps, &timer, STAGE_READ);
+      return;
+    }
+  if (size < READ_BLOCK_SIZE - reader->inc_seq_bytes)
+    reader->eof = TRUE;
+  reader->bytes_read += size;
+  paps->stats.bytes_read += size;
+
+  iblen = reader->inc_seq_bytes + size;
+  reader->inc_seq_bytes = 0;
+
+  if (reader->utf8)
+    {
+      input_reader_append_utf8 (paps, reader, iblen);
+      stats_stop (paps, &timer, STAGE_READ);
+      return;
+    }
+
+  if (reader->cvh == NULL
+      || (reader->ascii_compatible && is_7bit_text (reader->block, iblen)))
+    {
+      g_string_append_len (pending, reader->block, iblen);
+      stats_stop (paps, &timer, STAGE_READ);
+      return;
+    }
+
+  /* Once a stateful encoding has switched away from ASCII, 7-bit text may
+   * no longer be ASCII */
+  if (memchr (reader->block, 0x1b, iblen) || memchr (reader->block, 0x0e, iblen)
+      || memchr (reader->block, 0x0f, iblen))
+    reader->ascii_compatible = FALSE;
+
+  stats_start (paps, &iconv_timer);
+  ib = reader->block;
+  while (iblen > 0)
+    {
+      gsize old_len = pending->len, oblen;
+      char *ob;
+
+      /* Grow the text by about the size of the input; it is converted in
+       * as many steps as needed. */
+      g_string_set_size (pending, old_len + iblen + 16);
+      ob = pending->str + old_len;
+      oblen = pending->len - old_len;
+      if (g_iconv (reader->cvh, &ib, &iblen, &ob, &oblen) == (gsize)-1)
+        {
+          g_string_set_size (pending, ob - pending->str);
+          if (errno == E2BIG)
+            continue;
+          /*
+           * EINVAL - incomplete sequence at the end of the block. Move the
+           * incomplete sequence bytes to the beginning of the block for
+           * the next round of conversion.
+           */
+          if (errno == EINVAL)
+            {
+              if (!reader->eof)
+                {
+                  reader->inc_seq_bytes = iblen;
+                  memmove (reader->block, ib, reader->inc_seq_bytes);
+                }
+              break;
+            }
+          if (reader->report == NULL)
+            {
+              input_reader_set_invalid (paps, reader);
+              break;
+            }
+          input_reader_replace_invalid (reader, ib);
+          ib++;
+          iblen--;
+          continue;
+        }
+      g_string_set_size (pending, ob - pending->str);
+    }
+  stats_stop (paps, &iconv_timer, STAGE_ICONV);
+  stats_stop (paps, &timer, STAGE_READ);
+}
+
+/* Drop the text from each NUL up to the newline after it, in place, and
+ * return the length left. The line ends at the NUL, as it did when paps
+ * read the input a line at a time with fgets(), whether the text is read
+ * in chunks or at once. in_nul_line carries a line whose newline is still
+ * to come from one text to the next.
+ */
+static gsize
+drop_nul_lines (char     *text,
+                gsize     length,
+                gboolean *in_nul_line)
+{
+  char *end = text + length, *p = text, *q = text, *nul;
+
+  while (p < end)
+    {
+      if (*in_nul_line)
+        {
+          p = memchr (p, '\n', end - p);
+          if (p == NULL)
+            break;
+          *in_nul_line = FALSE;
+        }
+      nul = memchr (p, '\0', end - p);
+      if (nul == NULL)
+        nul = end;
+      else
+        *in_nul_line = TRUE;
+      memmove (q, p, nul - p);
+      q += nul - p;
+      p = nul;
+    }
+
+  return q - text;
+}
+
+/* Where to end a chunk of text that is at least max_chunk bytes long but
+ * has no newline where input_reader_read() looked for one: after its last
+ * newline, or else at a character boundary, so that an overlong line is
+ * laid out in pieces, each on a line of its own.
+ */
+static gsize
+chunk_cut (const char *text,
+           gsize       max_chunk)
+{
+  gsize cut = max_chunk;
+
+  while (cut > 0 && text[cut - 1] != '\n')
+    cut--;
+  if (cut > 0)
+    return cut;
+
+  cut = max_chunk;
+  while (cut > 1 && ((guchar)text[cut] & 0xc0) == 0x80)
+    cut--;
+  return cut;
+}
+
+static const char *
+input_reader_read_mapped (input_reader_t *reader,
+                          gsize           chunk_size,
+                          gsize          *length)
+{
+  const char *start = reader->map_pos, *end;
+
+  if (start == reader->map_end)
+    return NULL;
+
+  end = reader->map_end;
+  if (chunk_size > 0 && (gsize)(end - start) > chunk_size)
+    {
+      end = memchr (start + chunk_size - 1, '\n', reader->map_end - (start + chunk_size - 1));
+      end = end ? end + 1 : reader->map_end;
+      if (reader->max_chunk > 0 && (gsize)(end - start) > reader->max_chunk)
+        end = start + chunk_cut (start, reader->max_chunk);
+    }
+  reader->map_pos = end;
+  *length = end - start;
+
+  /* Add a trailing new line if it is missing */
+  if (end[-1] != '\n')
+    {
+      reader->chunk = g_malloc (*length + 2);
+      memcpy (reader->chunk, start, *length);
+      reader->chunk[(*length)++] = '\n';
+      reader->chunk[*length] = 0;
+      return reader->chunk;
+    }
+
+  return start;
+}
+
+/* Read the next chunk of the file converted to UTF-8. The chunk is at least
+ * chunk_size bytes long and ends at a newline, unless the end of the file
+ * is reached first. A chunk_size of 0 reads the rest of the file. Returns
+ * NULL at the end of the file. The text is not NUL terminated, and it
+ * belongs to the reader and is valid until the next read.
+ */
+static const char *
+input_reader_read (paps_t         *paps,
+                   input_reader_t *reader,
+                   gsize           chunk_size,
+                   gsize          *length)
+{
+  GString *pending = reader->pending;
+  const char *text, *nl = NULL;
+  gsize scanned, cut, old_len;
+  gboolean too_long = FALSE;
+
+  g_free (reader->chunk);
+  reader->chunk = NULL;
+
+  /* Nothing more is laid out after an error */
+  if (paps->error != NULL)
+    return NULL;
+  if (reader->mapping)
+    return input_reader_read_mapped (reader, chunk_size, length);
+
+  scanned = reader->pending_pos;
+  while (1)
+    {
+      if (chunk_size > 0 && pending->len - reader->pending_pos >= chunk_size)
+        {
+          gsize limit = pending->len;
+
+          /* A newline past max_chunk is not looked for */
+          if (reader->max_chunk > 0)
+            limit = MIN (limit, reader->pending_pos + reader->max_chunk);
+          scanned = MAX (scanned, reader->pending_pos + chunk_size - 1);
+          if (scanned < limit)
+            nl = memchr (pending->str + scanned, '\n', limit - scanned);
+          if (nl)
+            break;
+          scanned = MAX (scanned, limit);
+          if (reader->max_chunk > 0 && pending->len - reader->pending_pos >= reader->max_chunk)
+            {
+              too_long = TRUE;
+              break;
+            }
+        }
+      if (reader->eof)
+        break;
+
+      /* Drop the text returned already before reading more */
+      if (reader->pending_pos > 0)
+        {
+          g_string_erase (pending, 0, reader->pending_pos);
+          scanned -= reader->pending_pos;
+          reader->pending_pos = 0;
+        }
+      old_len = pending->len;
+      input_reader_fill (paps, reader);
+      g_string_truncate (pending, old_len + drop_nul_lines (pending->str + old_len, pending->len - old_len,
+                                                            &reader->in_nul_line));
+    }
+
+  if (reader->pending_pos == pending->len || paps->error != NULL)
+    return NULL;
+
+  if (too_long)
+    {
+      cut = reader->pending_pos + chunk_cut (pending->str + reader->pending_pos, reader->max_chunk);
+      if (pending->str[cut - 1] != '\n')
+        g_string_insert_c (pending, cut++, '\n');
+    }
+  else
+    cut = nl ? (gsize)(nl - pending->str) + 1 : pending->len;
+
+  /* Add a trailing new line if it is missing */
+  if (cut == pending->len && pending->str[cut-1] != '\n')
+    {
+      g_string_append_c (pending, '\n');
+      cut++;
+    }
+
+  text = pending->str + reader->pending_pos;
+  *length = cut - reader->pending_pos;
+  reader->pending_pos = cut;
+
+  return text;
+}
+
+static void
+input_reader_close (input_reader_t *reader)
+{
+  fclose (reader->file);
+
+  if (reader->cvh != NULL)
+    g_iconv_close(reader->cvh);
+  if (reader->mapping != NULL)
+    g_mapped_file_unref (reader->mapping);
+  if (reader->pending != NULL)
+    g_string_free (reader->pending, TRUE);
+  g_free (reader->block);
+  g_free (reader->chunk);
+}
+
+
+/* Take a UTF8 string of length bytes and break it into paragraphs on \n
+ * characters
+ */
+static GList *
+split_text_into_paragraphs (paps_t        *paps,
+                            cairo_t *cr,
+                            PangoContext *pango_context,
+                            page_layout_t *page_layout,
+                            int paint_width,  /* In pixels */
+                            const char *text,
+                            gsize length)
+{
+  const char *p = text, *end = text + length;
+  char *next;
+  gunichar wc;
+  GList *result = NULL;
+  const char *last_para = text;
+  stats_clock_t timer;
+
+  stats_start (paps, &timer);
+
+  /* If we are using markup we treat the entire text as a single paragraph.
+   * I tested it and found that this is much slower than the split and
+   * assign method used below. Otherwise we might as well use this single
+   * chunk method always.
+   */
+  if (page_layout->do_use_markup)
+    {
+      PangoAttrList *attrs = new_paragraph_attrs (page_layout);
+      Paragraph *para = arena_alloc (&paps->paragraph_arena, sizeof (Paragraph));
+      para->wrapped = FALSE; /* No wrapped chars for markups */
+      para->clipped = FALSE;
+      para->ascii = FALSE;
+      para->formfeed = 0;
+      para->text = text;
+      para->length = length;
+      para->layout = pango_layout_new (pango_context);
+      pango_layout_set_attributes (para->layout, attrs);
+      pango_layout_set_markup (para->layout, para->text, para->length);
+      pango_layout_set_justify (para->layout, page_layout->do_justify);
+      pango_layout_set_alignment (para->layout,
+                                  page_layout->pango_dir == PANGO_DIRECTION_LTR
+                                      ? PANGO_ALIGN_LEFT : PANGO_ALIGN_RIGHT);
+      pango_layout_set_width (para->layout, paint_width * PANGO_SCALE);
+      pango_layout_set_wrap (para->layout, paps->opt_wrap);
+
+      para->height = 0;
+      
+      pango_attr_list_unref (attrs);
+
+      result = g_list_prepend (result, para);
+    }
+  else
+    {
+      /* The reader has validated the text, so only the characters that
+       * end paragraphs need to be looked at. It has also left out the NUL
+       * characters, see drop_nul_lines(). */
+      while ((p = find_paragraph_break (p, end)) < end)
+        {
+          Paragraph *para = arena_alloc (&paps->paragraph_arena, sizeof (Paragraph));
+
+          wc = (unsigned char)*p;
+          next = (char *)p + 1;
+          para->wrapped = FALSE;
+          para->clipped = FALSE;
+          para->text = last_para;
+          para->length = p - last_para;
+          para->layout = NULL;
+          /* handle dos line breaks */
+          if (wc == '\r' && next < end && *next == '\n')
+              next = g_utf8_next_char(next);
+
+          if (page_layout->cpi > 0.0L)
+            {
+              /* figuring out the correct width from the pango_font_metrics_get_approximate_width()
+               * is really hard and pango_layout_set_wrap() doesn't work properly then.
+               * Those are not reliable to render the characters exactly according to the given CPI.
+               * So re-calculate the width to wrap up to be comfortable with CPI.
+               */
+              gsize col, clip_length;
+              gboolean clipped;
+
+              /* the amount of characters that can be put on the line against CPI */
+              col = (int)(page_layout->column_width / 72.0 * page_layout->cpi);
+              clip_length = cpi_clip_length (para->text, para->length, col, &clipped);
+              if (clipped)
+                {
+                  /* The clipped text is the head of the paragraph text */
+                  para->clipped = TRUE;
+                  para->length = clip_length;
+
+                  next = (char *)para->text + clip_length;
+                  wc = g_utf8_get_char (g_utf8_prev_char (next));
+                }
+            }
+          else if (paps->opt_wrap == PANGO_WRAP_CHAR)
+            para->wrapped = TRUE;
+
+          para->ascii = paps->ascii_engine.enabled
+                        && is_ascii_text (para->text, para->length);
+          para->height = 0;
+
+          last_para = next;
+        
+          if (wc == '\f')
+            para->formfeed = 1;
+          else
+            para->formfeed = 0;
+
+          result = g_list_prepend (result, para);
+          p = next;
+        }
+
+      result = g_list_reverse (result);
+      shape_paragraphs (paps, cr, pango_context, page_layout, paint_width, result);
+    }
+
+  if (paps->stats.enabled)
+    paps->stats.paragraphs += g_list_length (result);
+  stats_stop (paps, &timer, STAGE_SPLIT_PARAGRAPHS);
+  return result;
+}
+
+static PangoAttrList *
+new_paragraph_attrs (page_layout_t *page_layout)
+{
+  PangoAttrList *attrs = pango_attr_list_new ();
+
+  pango_attr_list_insert(attrs, pango_attr_insert_hyphens_new(page_layout->do_show_hyphens));
+
+  return attrs;
+}
+
+/* Create the layout of a paragraph split out of plain text
+ */
+static void
+shape_paragraph (paps_t        *paps,
+                 Paragraph     *para,
+                 PangoContext  *pango_context,
+                 PangoAttrList *attrs,
+                 page_layout_t *page_layout,
+                 int            paint_width)
+{
+  if (para->ascii)
+    return;
+
+  para->layout = pango_layout_new (pango_context);
+
+  pango_layout_set_attributes (para->layout, attrs);
+  pango_layout_set_text (para->layout, para->text, para->length);
+
+  if (page_layout->cpi > 0.0L)
+    pango_layout_set_width (para->layout, -1);
+  else
+    {
+      pango_layout_set_width (para->layout, paint_width * PANGO_SCALE);
+
+      pango_layout_set_wrap (para->layout, paps->opt_wrap);
+
+      /* Should we support truncation as well? */
+    }
+
+  pango_layout_set_justify (para->layout, page_layout->do_justify);
+  pango_layout_set_alignment (para->layout,
+                              page_layout->pango_dir == PANGO_DIRECTION_LTR
+                              ? PANGO_ALIGN_LEFT : PANGO_ALIGN_RIGHT);
+}
+
+/* Create a context for laying out text in another thread, with the same
+ * settings as the given one. It gets its own font map, since a font map
+ * must not be used by several threads at once. Without a surface, the font
+ * options of the vector surfaces are assumed.
+ */
+static PangoContext *
+clone_pango_context (PangoContext    *pango_context,
+                     cairo_surface_t *surface)
+{
+  PangoFontMap *fontmap = pango_cairo_font_map_new ();
+  PangoContext *ctx = pango_font_map_create_context (fontmap);
+  cairo_font_options_t *font_options = cairo_font_options_create ();
+
+  if (surface)
+    cairo_surface_get_font_options (surface, font_options);
+  else
+    {
+      /* What the vector surfaces use */
+      cairo_font_options_set_antialias (font_options, CAIRO_ANTIALIAS_GRAY);
+      cairo_font_options_set_hint_style (font_options, CAIRO_HINT_STYLE_NONE);
+      cairo_font_options_set_hint_metrics (font_options, CAIRO_HINT_METRICS_OFF);
+    }
+  pango_cairo_context_set_font_options (ctx, font_options);
+  cairo_font_options_destroy (font_options);
+  pango_cairo_context_set_resolution (ctx, 72.0); /* Native postscript resolution */
+  g_object_unref (fontmap);
+
+  /* Without a context to copy this is a fresh one, set up by the caller */
+  if (pango_context == NULL)
+    return ctx;
+
+  pango_context_set_base_dir (ctx, pango_context_get_base_dir (pango_context));
+  pango_context_set_language (ctx, pango_context_get_language (pango_context));
+  pango_context_set_base_gravity (ctx, pango_context_get_base_gravity (pango_context));
+  pango_context_set_gravity_hint (ctx, pango_context_get_gravity_hint (pango_context));
+  pango_context_set_font_description (ctx, pango_context_get_font_description (pango_context));
+
+  return ctx;
+}
+
+static gpointer
+shape_paragraphs_thread (gpointer data)
+{
+  shape_job_t *job = data;
+  guint i;
+
+  /* Layouts are lazy, so make sure the shaping happens in this thread */
+  for (i = 0; i < job->layouts->len; i++)
+    pango_layout_get_line_count (g_ptr_array_index (job->layouts, i));
+
+  return NULL;
+}
+
+/* Create the layouts of the paragraphs, spreading the work over opt_jobs
+ * threads. The layouts are created here and each thread then shapes those
+ * of a consecutive run of paragraphs with a context of its own, so the
+ * paragraph order is kept. Paragraphs found in the layout cache share the
+ * cached layout.
+ */
+static void
+shape_paragraphs (paps_t        *paps,
+                  cairo_t       *cr,
+                  PangoContext  *pango_context,
+                  page_layout_t *page_layout,
+                  int            paint_width,
+                  GList         *paragraphs)
+{
+  shape_job_t *jobs;
+  GThread **threads;
+  GList *par_list;
+  int num_paragraphs = g_list_length (paragraphs);
+  int num_jobs = MAX (1, MIN (paps->opt_jobs, num_paragraphs));
+  int i;
+
+  jobs = g_new (shape_job_t, num_jobs);
+  for (i = 0; i < num_jobs; i++)
+    {
+      jobs[i].pango_context = num_jobs == 1 ? pango_context : paps->job_contexts[i];
+      jobs[i].attrs = new_paragraph_attrs (page_layout);
+      jobs[i].layouts = g_ptr_array_new ();
+    }
+
+  for (par_list = paragraphs, i = 0; par_list; par_list = par_list->next, i++)
+    {
+      Paragraph *para = par_list->data;
+      shape_job_t *job = &jobs[(gint64)i * num_jobs / num_paragraphs];
+
+      if (para->ascii)
+        continue;
+
+      para->layout = layout_cache_lookup (paps, para, paint_width);
+      if (para->layout)
+        continue;
+
+      shape_paragraph (paps, para, job->pango_context, job->attrs, page_layout, paint_width);
+      g_ptr_array_add (job->layouts, para->layout);
+      layout_cache_insert (paps, para, paint_width);
+    }
+
+  if (num_jobs > 1)
+    {
+      threads = g_new (GThread *, num_jobs);
+      for (i = 0; i < num_jobs; i++)
+        threads[i] = g_thread_new ("shape", shape_paragraphs_thread, &jobs[i]);
+      for (i = 0; i < num_jobs; i++)
+        g_thread_join (threads[i]);
+      g_free (threads);
+    }
+
+  for (i = 0; i < num_jobs; i++)
+    {
+      pango_attr_list_unref (jobs[i].attrs);
+      g_ptr_array_free (jobs[i].layouts, TRUE);
+    }
+  g_free (jobs);
+}
+
+static guint
+layout_cache_hash (gconstpointer key)
+{
+  const cached_layout_t *entry = key;
+  guint hash = 5381;
+  int i;
+
+  for (i = 0; i < entry->length; i++)
+    hash = hash * 33 + (unsigned char)entry->text[i];
+
+  return hash ^ entry->width ^ (entry->wrap << 24) ^ (guint)(entry->cpi * 1000);
+}
+
+static gboolean
+layout_cache_equal (gconstpointer a,
+                    gconstpointer b)
+{
+  const cached_layout_t *entry_a = a, *entry_b = b;
+
+  return entry_a->length == entry_b->length
+         && entry_a->width == entry_b->width
+         && entry_a->wrap == entry_b->wrap
+         && entry_a->cpi == entry_b->cpi
+         && memcmp (entry_a->text, entry_b->text, entry_a->length) == 0;
+}
+
+static void
+layout_cache_free_entry (gpointer data)
+{
+  cached_layout_t *entry = data;
+
+  g_object_unref (entry->layout);
+  g_free (entry->text);
+  g_free (entry);
+}
+
+/* Return a new reference to the cached layout of an identical paragraph,
+ * or NULL.
+ */
+static PangoLayout *
+layout_cache_lookup (paps_t    *paps,
+                     Paragraph *para,
+                     int        paint_width)
+{
+  cached_layout_t key, *entry;
+
+  if (paps->layout_cache.max_size <= 0)
+    return NULL;
+
+  if (paps->layout_cache.table == NULL)
+    {
+      paps->layout_cache.table = g_hash_table_new_full (layout_cache_hash, layout_cache_equal,
+                                                  NULL, layout_cache_free_entry);
+      g_queue_init (&paps->layout_cache.lru);
+    }
+
+  key.text = (char *)para->text;
+  key.length = para->length;
+  key.width = paint_width;
+  key.wrap = paps->opt_wrap;
+  key.cpi = paps->layout_cache.cpi;
+
+  paps->layout_cache.lookups++;
+  entry = g_hash_table_lookup (paps->layout_cache.table, &key);
+  if (entry == NULL)
+    return NULL;
+
+  paps->layout_cache.hits++;
+  g_queue_unlink (&paps->layout_cache.lru, entry->lru_link);
+  g_queue_push_head_link (&paps->layout_cache.lru, entry->lru_link);
+
+  return g_object_ref (entry->layout);
+}
+
+/* Add the layout of a paragraph just shaped, dropping the least recently
+ * used one if the cache is full.
+ */
+static void
+layout_cache_insert (paps_t    *paps,
+                     Paragraph *para,
+                     int        paint_width)
+{
+  cached_layout_t *entry;
+
+  if (paps->layout_cache.max_size <= 0)
+    return;
+
+  if (g_hash_table_size (paps->layout_cache.table) >= (guint)paps->layout_cache.max_size)
+    {
+      cached_layout_t *oldest = g_queue_peek_tail (&paps->layout_cache.lru);
+
+      g_queue_delete_link (&paps->layout_cache.lru, oldest->lru_link);
+      g_hash_table_remove (paps->layout_cache.table, oldest);
+    }
+
+  entry = g_new (cached_layout_t, 1);
+  entry->text = g_strndup (para->text, para->length);
+  entry->length = para->length;
+  entry->width = paint_width;
+  entry->wrap = paps->opt_wrap;
+  entry->cpi = paps->layout_cache.cpi;
+  entry->layout = g_object_ref (para->layout);
+  g_queue_push_head (&paps->layout_cache.lru, entry);
+  entry->lru_link = g_queue_peek_head_link (&paps->layout_cache.lru);
+  g_hash_table_insert (paps->layout_cache.table, entry, entry);
+}
+
+static void
+layout_cache_print_stats (paps_t *paps)
+{
+  if (paps->layout_cache.max_size <= 0)
+    return;
+
+  fprintf (stderr, _("%1$s: layout cache: %2$lu lookups, %3$lu hits (%4$.1f%%)\n"),
+           g_get_prgname (), paps->layout_cache.lookups, paps->layout_cache.hits,
+           paps->layout_cache.lookups ? 100.0 * paps->layout_cache.hits / paps->layout_cache.lookups : 0.0);
+}
+
+/* Note the start of a stage timed by --stats */
+static void
+stats_start (paps_t *paps, stats_clock_t *timer)
+{
+  if (!paps->stats.enabled)
+    return;
+
+  timer->wall = g_get_monotonic_time ();
+  timer->cpu = clock ();
+}
+
+/* Add the time since stats_start() to the stage */
+static void
+stats_stop (paps_t        *paps,
+            stats_clock_t *timer,
+            stage_t        stage)
+{
+  if (!paps->stats.enabled)
+    return;
+
+  paps->stats.wall[stage] += g_get_monotonic_time () - timer->wall;
+  paps->stats.cpu[stage] += (gint64)(clock () - timer->cpu) * G_USEC_PER_SEC / CLOCKS_PER_SEC;
+}
+
+/* Print the --stats as key=value lines, meant to be read by scripts */
+static void
+stats_print (paps_t *paps)
+{
+  static const char *stage_names[NUM_STAGES] = {
+    "read", "iconv", "split_paragraphs", "split_lines", "output"
+  };
+  stats_clock_t end;
+  int i;
+
+  if (!paps->stats.enabled)
+    return;
+
+  stats_start (paps, &end);
+  fprintf (stderr, "stats.total.wall_seconds=%.6f\n",
+           (end.wall - paps->stats.start.wall) / (double)G_USEC_PER_SEC);
+  fprintf (stderr, "stats.total.cpu_seconds=%.6f\n",
+           (double)(end.cpu - paps->stats.start.cpu) / CLOCKS_PER_SEC);
+  for (i = 0; i < NUM_STAGES; i++)
+    {
+      fprintf (stderr, "stats.%s.wall_seconds=%.6f\n",
+               stage_names[i], paps->stats.wall[i] / (double)G_USEC_PER_SEC);
+      fprintf (stderr, "stats.%s.cpu_seconds=%.6f\n",
+               stage_names[i], paps->stats.cpu[i] / (double)G_USEC_PER_SEC);
+    }
+  fprintf (stderr, "stats.bytes_read=%" G_GUINT64_FORMAT "\n", paps->stats.bytes_read);
+  fprintf (stderr, "stats.bytes_written=%" G_GUINT64_FORMAT "\n", paps->stats.bytes_written);
+  fprintf (stderr, "stats.documents=%lu\n", paps->stats.documents);
+  fprintf (stderr, "stats.paragraphs=%lu\n", paps->stats.paragraphs);
+  fprintf (stderr, "stats.lines=%lu\n", paps->stats.lines);
+  fprintf (stderr, "stats.pages=%lu\n", paps->stats.pages);
+  fprintf (stderr, "stats.layout_cache.lookups=%lu\n", paps->layout_cache.lookups);
+  fprintf (stderr, "stats.layout_cache.hits=%lu\n", paps->layout_cache.hits);
+  fprintf (stderr, "stats.layout_cache.hit_rate=%.4f\n",
+           paps->layout_cache.lookups ? (double)paps->layout_cache.hits / paps->layout_cache.lookups : 0.0);
+}
+
+
+/* Split a list of paragraphs into an array of lines. The paragraphs are
+ * owned by the returned lines from then on, and are released by
+ * output_pages_add_lines() as soon as their last line has been drawn, or
+ * by free_lines().
+ */
+GArray *
+split_paragraphs_into_lines(paps_t        *paps,
+                            page_layout_t *page_layout,
+                            GList         *paragraphs)
+{
+  GArray *lines = g_array_new(FALSE, FALSE, sizeof(LineLink));
+  int max_height = 0;
+  /* Read the file */
+
+  /* Now split all the pagraphs into lines */
+  GList *par_list;
+  stats_clock_t timer;
+
+  stats_start (paps, &timer);
+  par_list = paragraphs;
+  while(par_list)
+    {
+      int para_num_lines, i;
+      LineLink line_link;
+      PangoRectangle *line_extents;
+      Paragraph *para = par_list->data;
+      GSList *layout_lines;
+
+      if (para->ascii)
+        {
+          split_ascii_paragraph(paps, page_layout, para, lines);
+          par_list = par_list->next;
+          continue;
+        }
+
+      para_num_lines = pango_layout_get_line_count(para->layout);
+      line_extents = get_line_extents(paps, para->layout);
+      /* pango_layout_get_line() would walk the list for each line */
+      layout_lines = pango_layout_get_lines_readonly(para->layout);
+
+      for (i=0; i<para_num_lines; i++, layout_lines = layout_lines->next)
+        {
+          PangoRectangle logical_rect;
+          
+          line_link.formfeed = 0;
+          line_link.wrapped = (para->wrapped && i < para_num_lines - 1) || (para->clipped);
+          line_link.para = para;
+          line_link.last_line = (i == para_num_lines - 1);
+          line_link.pango_line = layout_lines->data;
+          line_link.offset = 0;
+          line_link.length = 0;
+          if (line_extents)
+            logical_rect = line_extents[i];
+          else
+            pango_layout_line_get_extents(line_link.pango_line,
+                                          NULL, &logical_rect);
+          line_link.height = logical_rect.height;
+          line_link.width = logical_rect.width;
+          if (para->formfeed && i == (para_num_lines - 1))
+              line_link.formfeed = 1;
+          g_array_append_val(lines, line_link);
+          if (logical_rect.height > max_height)
+              max_height = logical_rect.height;
+        }
+
+      if (para_num_lines == 0)
+        free_paragraph(para);
+
+      par_list = par_list->next;
+    }
+  g_list_free(paragraphs);
+  
+  /*
+   * not fixed for cairo backend: disable
+   *
+  if (page_layout->do_stretch_chars && page_layout->lpi > 0.0L)
+      page_layout->scale_y = 1.0 / page_layout->lpi * 72.0 * PANGO_SCALE / max_height;
+   */
+
+  paps->stats.lines += lines->len;
+  stats_stop (paps, &timer, STAGE_SPLIT_LINES);
+  return lines;
+  
+}
+
+/* The key of the line extents kept with a layout. Set up once, as the
+ * shaping threads and the contexts of several threads come here at once.
+ */
+static GQuark
+line_extents_quark(void)
+{
+  static gsize quark = 0;
+
+  if (g_once_init_enter(&quark))
+    g_once_init_leave(&quark, g_quark_from_static_string("paps-line-extents"));
+
+  return quark;
+}
+
+/* Return the logical extents of all lines of a cached layout, which are
+ * computed once and kept with the layout. NULL if the cache is off.
+ */
+static PangoRectangle *
+get_line_extents(paps_t *paps, PangoLayout *layout)
+{
+  PangoRectangle *line_extents;
+  GSList *lines;
+  int num_lines, i;
+
+  if (paps->layout_cache.max_size <= 0)
+    return NULL;
+
+  line_extents = g_object_get_qdata(G_OBJECT(layout), line_extents_quark());
+  if (line_extents)
+    return line_extents;
+
+  num_lines = pango_layout_get_line_count(layout);
+  line_extents = g_new(PangoRectangle, num_lines);
+  for (i = 0, lines = pango_layout_get_lines_readonly(layout); i < num_lines; i++, lines = lines->next)
+    pango_layout_line_get_extents(lines->data, NULL, &line_extents[i]);
+  g_object_set_qdata_full(G_OBJECT(layout), line_extents_quark(), line_extents, g_free);
+
+  return line_extents;
+}
+
+/* Split a paragraph of the ASCII engine into lines, appended to lines.
+ */
+static void
+split_ascii_paragraph(paps_t        *paps,
+                      page_layout_t *page_layout,
+                      Paragraph     *para,
+                      GArray        *lines)
+{
+  int columns = MAX (1, page_layout->column_width * PANGO_SCALE / paps->ascii_engine.pango_advance);
+  int offset = 0;
+  int length = para->length;
+  PangoLogAttr *log_attrs = NULL;
+
+  /* The break opportunities are those of pango, only the columns are
+   * counted here. Every ASCII character is a character of its own. */
+  if (length > columns && paps->opt_wrap != PANGO_WRAP_CHAR)
+    {
+      log_attrs = g_new(PangoLogAttr, length + 1);
+      pango_get_log_attrs(para->text, length, -1, paps->ascii_engine.language, log_attrs, length + 1);
+    }
+
+  do
+    {
+      LineLink line_link;
+      int line_length = ascii_engine_break_line(paps, para->text + offset,
+                                                log_attrs ? log_attrs + offset : NULL,
+                                                length, columns);
+
+      line_link.pango_line = NULL;
+      line_link.offset = offset;
+      line_link.length = line_length;
+      line_link.para = para;
+      line_link.last_line = (line_length == length);
+      line_link.wrapped = para->wrapped && !line_link.last_line;
+      line_link.formfeed = para->formfeed && line_link.last_line;
+      line_link.height = paps->ascii_engine.logical_rect.height;
+      line_link.width = line_length * paps->ascii_engine.pango_advance;
+      g_array_append_val(lines, line_link);
+
+      offset += line_length;
+      length -= line_length;
+    }
+  while (length > 0);
+  g_free(log_attrs);
+}
+
+/* Release the lines that are not drawn yet, with the paragraphs they own,
+ * and the array.
+ */
+static void
+free_lines(paps_t *paps, GArray *lines)
+{
+  guint i;
+
+  for (i = 0; i < lines->len; i++)
+    {
+      LineLink *line_link = &g_array_index(lines, LineLink, i);
+
+      if (line_link->last_line)
+        free_paragraph(line_link->para);
+    }
+  g_array_free(lines, TRUE);
+  arena_reset(&paps->paragraph_arena);
+}
+
+/* Release a paragraph together with its layout and thereby its lines.
+ */
+static void
+free_paragraph(Paragraph *para)
+{
+  /* The paragraph itself is released with paragraph_arena */
+  if (para->layout)
+    g_object_unref (para->layout);
+}
+
+/* Allocate size bytes, which stay valid until the next arena_reset() */
+static gpointer
+arena_alloc (arena_t *arena,
+             gsize    size)
+{
+  gpointer mem;
+
+  /* Keep everything aligned for any type */
+  size = (size + 2 * sizeof (gpointer) - 1) & ~(2 * sizeof (gpointer) - 1);
+  if (arena->blocks == NULL || arena->used + size > arena->size)
+    {
+      arena->size = MAX (ARENA_BLOCK_SIZE, size);
+      arena->blocks = g_slist_prepend (arena->blocks, g_malloc (arena->size));
+      arena->used = 0;
+      arena->allocated += arena->size;
+    }
+
+  mem = (char *)arena->blocks->data + arena->used;
+  arena->used += size;
+
+  return mem;
+}
+
+/* Release all the memory allocated from the arena, keeping the most
+ * recent block for the next allocations.
+ */
+static void
+arena_reset (arena_t *arena)
+{
+  if (arena->blocks == NULL)
+    return;
+
+  g_slist_free_full (arena->blocks->next, g_free);
+  arena->blocks->next = NULL;
+  arena->used = 0;
+  arena->allocated = arena->size;
+}
+
+/* Whether the font metrics are kept on disk, unless PAPS_FONT_CACHE=0 */
+static gboolean
+font_cache_enabled (void)
+{
+  const gchar *value = g_getenv("PAPS_FONT_CACHE");
+
+  return value == NULL || strcmp(value, "0") != 0;
+}
+
+/* Add the modification time of the file or directory at path to checksum,
+ * or that it is missing.
+ */
+static void
+font_stamp_add_path (GChecksum   *checksum,
+                     const gchar *path)
+{
+  struct stat st;
+  gchar *entry;
+
+  if (stat (path, &st) == 0)
+    entry = g_strdup_printf ("%s %" G_GINT64_FORMAT "\n", path, (gint64)st.st_mtime);
+  else
+    entry = g_strdup_printf ("%s -\n", path);
+  g_checksum_update (checksum, (const guchar *)entry, -1);
+  g_free (entry);
+}
+
+/* Identify the installed fonts and the configuration that picks them by
+ * the modification times of the configuration and of the cache directories
+ * of fontconfig, which it writes to whenever the fonts change. That takes
+ * a few stat() calls, where asking fontconfig would set it up, reading its
+ * configuration and checking every font directory.
+ */
+static gchar *
+font_stamp (void)
+{
+  static const char *const system_paths[] = {
+    "/etc/fonts/fonts.conf", "/etc/fonts/conf.d", "/var/cache/fontconfig",
+    "/usr/lib/fontconfig/cache", "/usr/local/var/cache/fontconfig",
+  };
+  GChecksum *checksum = g_checksum_new (G_CHECKSUM_SHA1);
+  const gchar *env;
+  gchar *path, *stamp;
+  guint i;
+
+  for (i = 0; i < G_N_ELEMENTS (system_paths); i++)
+    font_stamp_add_path (checksum, system_paths[i]);
+  if ((env = g_getenv ("FONTCONFIG_FILE")) != NULL)
+    font_stamp_add_path (checksum, env);
+  if ((env = g_getenv ("FONTCONFIG_PATH")) != NULL)
+    {
+      gchar **dirs = g_strsplit (env, G_SEARCHPATH_SEPARATOR_S, -1);
+
+      for (i = 0; dirs[i]; i++)
+        font_stamp_add_path (checksum, dirs[i]);
+      g_strfreev (dirs);
+    }
+  path = g_build_filename (g_get_user_config_dir (), "fontconfig", NULL);
+  font_stamp_add_path (checksum, path);
+  g_free (path);
+  path = g_build_filename (g_get_user_config_dir (), "fontconfig", "fonts.conf", NULL);
+  font_stamp_add_path (checksum, path);
+  g_free (path);
+  path = g_build_filename (g_get_user_cache_dir (), "fontconfig", NULL);
+  font_stamp_add_path (checksum, path);
+  g_free (path);
+
+  stamp = g_strdup (g_checksum_get_string (checksum));
+  g_checksum_free (checksum);
+
+  return stamp;
+}
+
+/* Load the font cache from the user's cache directory, or return NULL if it
+ * is not used. Its groups are only used if font_cache_is_current().
+ */
+static GKeyFile *
+font_cache_load (gchar **cache_file,
+                 gchar **stamp)
+{
+  GKeyFile *key_file;
+
+  if (!font_cache_enabled ())
+    return NULL;
+
+  *cache_file = g_build_filename (g_get_user_cache_dir (), "paps", "font-metrics", NULL);
+  *stamp = font_stamp ();
+  key_file = g_key_file_new ();
+  g_key_file_load_from_file (key_file, *cache_file, G_KEY_FILE_NONE, NULL);
+
+  return key_file;
+}
+
+/* Whether the group was saved with this pango and the fonts of stamp */
+static gboolean
+font_cache_is_current (GKeyFile    *key_file,
+                       const gchar *group,
+                       const gchar *stamp)
+{
+  gchar *version = g_key_file_get_string (key_file, group, "pango", NULL);
+  gchar *fonts = g_key_file_get_string (key_file, group, "fonts", NULL);
+  gboolean current = version && strcmp (version, pango_version_string ()) == 0
+                     && fonts && strcmp (fonts, stamp) == 0;
+
+  g_free (version);
+  g_free (fonts);
+
+  return current;
+}
+
+/* Save the font cache with the group just set, and free it. The cache only
+ * saves time, so failing to write it is not an error.
+ */
+static void
+font_cache_save (GKeyFile    *key_file,
+                 gchar       *cache_file,
+                 const gchar *group,
+                 gchar       *stamp)
+{
+  gchar *cache_dir = g_path_get_dirname (cache_file);
+  gchar *data;
+  gsize length;
+
+  g_key_file_set_string (key_file, group, "pango", pango_version_string ());
+  g_key_file_set_string (key_file, group, "fonts", stamp);
+  data = g_key_file_to_data (key_file, &length, NULL);
+  if (g_mkdir_with_parents (cache_dir, 0755) == 0)
+    g_file_set_contents (cache_file, data, length, NULL);
+  g_free (data);
+  g_free (cache_dir);
+  font_cache_free (key_file, cache_file, stamp);
+}
+
+static void
+font_cache_free (GKeyFile *key_file,
+                 gchar    *cache_file,
+                 gchar    *stamp)
+{
+  g_key_file_free (key_file);
+  g_free (cache_file);
+  g_free (stamp);
+}
+
+/* Whether a group name can be used for the font description in it */
+static gboolean
+font_cache_group_valid (const gchar *group)
+{
+  return strpbrk (group, "[]\n") == NULL;
+}
+
+/* Return the widest of the approximate character and digit widths of the
+ * font, which is what --cpi scales to, from the font map of the rendering
+ * context. The widths are kept in the font cache by font description and
+ * language, so that later runs with the same fonts skip matching and
+ * loading them, and scale to the same widths.
+ */
+static int
+get_cpi_char_width (PangoContext               *pango_context,
+                    const PangoFontDescription *font_description)
+{
+  PangoLanguage *language = pango_language_get_default();
+  PangoFontMetrics *metrics;
+  GKeyFile *key_file = NULL;
+  gchar *cache_file = NULL, *stamp = NULL, *group, *desc;
+  int char_width, digit_width;
+
+  desc = pango_font_description_to_string(font_description);
+  group = g_strdup_printf("%s %s", desc, pango_language_to_string(language));
+  g_free(desc);
+
+  if (font_cache_group_valid(group)
+      && (key_file = font_cache_load(&cache_file, &stamp)) != NULL)
+    {
+      char_width = g_key_file_get_integer(key_file, group, "char_width", NULL);
+      digit_width = g_key_file_get_integer(key_file, group, "digit_width", NULL);
+      if (font_cache_is_current(key_file, group, stamp) && char_width > 0 && digit_width > 0)
+        {
+          font_cache_free(key_file, cache_file, stamp);
+          g_free(group);
+          return MAX(char_width, digit_width);
+        }
+    }
+
+  metrics = pango_context_get_metrics(pango_context, font_description, language);
+  char_width = pango_font_metrics_get_approximate_char_width(metrics);
+  digit_width = pango_font_metrics_get_approximate_digit_width(metrics);
+  pango_font_metrics_unref(metrics);
+
+  if (key_file)
+    {
+      g_key_file_set_integer(key_file, group, "char_width", char_width);
+      g_key_file_set_integer(key_file, group, "digit_width", digit_width);
+      font_cache_save(key_file, cache_file, group, stamp);
+    }
+  g_free(group);
+
+  return MAX(char_width, digit_width);
+}
+
+/* Take the glyphs and advances of the ASCII engine for the font from the
+ * font cache, if they were saved with the same fonts. Returns whether they
+ * were found; if so, usable says whether the font suits the engine.
+ */
+static gboolean
+ascii_engine_load (paps_t      *paps,
+                   GKeyFile    *key_file,
+                   const gchar *group,
+                   const gchar *stamp,
+                   gboolean    *usable)
+{
+  ascii_engine_t *engine = &paps->ascii_engine;
+  gint *glyphs, *rect;
+  gsize num_glyphs = 0, num_rect = 0, i;
+  gboolean found = FALSE;
+
+  if (!font_cache_is_current(key_file, group, stamp))
+    return FALSE;
+
+  *usable = g_key_file_get_boolean(key_file, group, "usable", NULL);
+  if (!*usable)
+    return g_key_file_has_key(key_file, group, "usable", NULL);
+
+  glyphs = g_key_file_get_integer_list(key_file, group, "glyphs", &num_glyphs, NULL);
+  rect = g_key_file_get_integer_list(key_file, group, "logical_rect", &num_rect, NULL);
+  engine->advance = g_key_file_get_double(key_file, group, "advance", NULL);
+  engine->pango_advance = g_key_file_get_integer(key_file, group, "pango_advance", NULL);
+  if (glyphs && num_glyphs == G_N_ELEMENTS(engine->glyphs) && rect && num_rect == 4
+      && engine->advance > 0 && engine->pango_advance > 0)
+    {
+      for (i = 0; i < num_glyphs; i++)
+        engine->glyphs[i] = glyphs[i];
+      engine->logical_rect.x = rect[0];
+      engine->logical_rect.y = rect[1];
+      engine->logical_rect.width = rect[2];
+      engine->logical_rect.height = rect[3];
+      found = TRUE;
+    }
+  g_free(glyphs);
+  g_free(rect);
+
+  return found;
+}
+
+/* Keep the glyphs and advances of the ASCII engine, or that the font does
+ * not suit it, in the font cache.
+ */
+static void
+ascii_engine_save (paps_t      *paps,
+                   GKeyFile    *key_file,
+                   const gchar *group,
+                   gboolean     usable)
+{
+  ascii_engine_t *engine = &paps->ascii_engine;
+  gint glyphs[G_N_ELEMENTS(engine->glyphs)];
+  gint rect[4];
+  guint i;
+
+  g_key_file_remove_group(key_file, group, NULL);
+  g_key_file_set_boolean(key_file, group, "usable", usable);
+  if (!usable)
+    return;
+
+  for (i = 0; i < G_N_ELEMENTS(glyphs); i++)
+    glyphs[i] = engine->glyphs[i];
+  rect[0] = engine->logical_rect.x;
+  rect[1] = engine->logical_rect.y;
+  rect[2] = engine->logical_rect.width;
+  rect[3] = engine->logical_rect.height;
+  g_key_file_set_integer_list(key_file, group, "glyphs", glyphs, G_N_ELEMENTS(glyphs));
+  g_key_file_set_integer_list(key_file, group, "logical_rect", rect, 4);
+  g_key_file_set_double(key_file, group, "advance", engine->advance);
+  g_key_file_set_integer(key_file, group, "pango_advance", engine->pango_advance);
+}
+
+/* Measure the glyphs and the advances of the ASCII engine for its font,
+ * and return whether the font suits the engine.
+ */
+static gboolean
+ascii_engine_measure(paps_t       *paps,
+                     PangoContext *pango_context)
+{
+  char chars[ASCII_LAST - ASCII_FIRST + 1];
+  int num_chars = sizeof(chars);
+  cairo_glyph_t *glyphs = NULL;
+  int num_glyphs = 0;
+  PangoLayout *layout;
+  PangoRectangle logical_rect;
+  int i;
+
+  for (i = 0; i < num_chars; i++)
+    chars[i] = ASCII_FIRST + i;
+
+  /* Every character must have a glyph of its own, all of the same width */
+  if (cairo_scaled_font_text_to_glyphs(paps->ascii_engine.scaled_font, 0, 0, chars, num_chars,
+                                       &glyphs, &num_glyphs, NULL, NULL, NULL) != CAIRO_STATUS_SUCCESS
+      || num_glyphs != num_chars)
+    goto fail;
+  for (i = 0; i < num_glyphs; i++)
+    {
+      cairo_text_extents_t extents;
+
+      if (glyphs[i].index == 0)
+        goto fail;
+      cairo_scaled_font_glyph_extents(paps->ascii_engine.scaled_font, &glyphs[i], 1, &extents);
+      if (i == 0)
+        paps->ascii_engine.advance = extents.x_advance;
+      else if (extents.x_advance != paps->ascii_engine.advance)
+        goto fail;
+      paps->ascii_engine.glyphs[i] = glyphs[i].index;
+    }
+
+  /* Take the line extents from pango, and make sure it agrees on the width,
+   * which it would not with kerning or ligatures. */
+  layout = pango_layout_new(pango_context);
+  pango_layout_set_text(layout, chars, num_chars);
+  pango_layout_line_get_extents(pango_layout_get_line(layout, 0), NULL, &logical_rect);
+  paps->ascii_engine.pango_advance = logical_rect.width / num_chars;
+  if (pango_layout_get_line_count(layout) != 1
+      || pango_layout_get_unknown_glyphs_count(layout) != 0
+      || logical_rect.width != paps->ascii_engine.pango_advance * num_chars
+      || paps->ascii_engine.pango_advance <= 0)
+    {
+      g_object_unref(layout);
+      goto fail;
+    }
+  g_object_unref(layout);
+
+  logical_rect.width = 0;
+  paps->ascii_engine.logical_rect = logical_rect;
+  cairo_glyph_free(glyphs);
+  return TRUE;
+
+ fail:
+  cairo_glyph_free(glyphs);
+  return FALSE;
+}
+
+/* Set up the ASCII engine if the current font has a fixed pitch and the
+ * layout needs nothing that only pango provides. Lines of printable ASCII
+ * characters are then broken by counting columns and drawn directly from
+ * the glyphs of the font, which saves itemizing and shaping them. The
+ * glyph table and the advances are kept in the font cache by font,
+ * language and resolution; only the font itself is loaded every time.
+ */
+static void
+ascii_engine_init(paps_t        *paps,
+                  PangoContext  *pango_context,
+                  page_layout_t *page_layout)
+{
+  PangoLanguage *language = pango_context_get_language(pango_context);
+  GKeyFile *key_file = NULL;
+  gchar *cache_file = NULL, *stamp = NULL, *group, *desc;
+  gboolean usable = FALSE, found = FALSE;
+
+  if (page_layout->do_use_markup || page_layout->do_justify
+      || page_layout->do_show_hyphens || page_layout->cpi > 0.0L
+      || page_layout->pango_dir != PANGO_DIRECTION_LTR
+      || (paps->gravity != PANGO_GRAVITY_AUTO && paps->gravity != PANGO_GRAVITY_SOUTH))
+    return;
+
+  paps->ascii_engine.font = pango_context_load_font(pango_context,
+                                              pango_context_get_font_description(pango_context));
+  if (paps->ascii_engine.font == NULL)
+    return;
+  paps->ascii_engine.scaled_font = pango_cairo_font_get_scaled_font(PANGO_CAIRO_FONT(paps->ascii_engine.font));
+  if (paps->ascii_engine.scaled_font == NULL)
+    goto fail;
+
+  desc = pango_font_description_to_string(pango_context_get_font_description(pango_context));
+  group = g_strdup_printf("ascii %s %s %g", desc,
+                          language ? pango_language_to_string(language) : "",
+                          pango_cairo_context_get_resolution(pango_context));
+  g_free(desc);
+  if (font_cache_group_valid(group)
+      && (key_file = font_cache_load(&cache_file, &stamp)) != NULL)
+    found = ascii_engine_load(paps, key_file, group, stamp, &usable);
+  if (!found)
+    {
+      usable = ascii_engine_measure(paps, pango_context);
+      if (key_file)
+        {
+          ascii_engine_save(paps, key_file, group, usable);
+          font_cache_save(key_file, cache_file, group, stamp);
+          key_file = NULL;
+        }
+    }
+  if (key_file)
+    font_cache_free(key_file, cache_file, stamp);
+  g_free(group);
+  if (!usable)
+    goto fail;
+
+  paps->ascii_engine.language = language;
+  paps->ascii_engine.enabled = TRUE;
+  return;
+
+ fail:
+  g_object_unref(paps->ascii_engine.font);
+  paps->ascii_engine.font = NULL;
+  paps->ascii_engine.scaled_font = NULL;
+}
+
+/* Whether the text only has characters drawn by the ASCII engine
+ */
+static gboolean
+is_ascii_text(const char *text,
+              int         length)
+{
+  int i;
+
+  for (i = 0; i < length; i++)
+    if ((unsigned char)text[i] < ASCII_FIRST || (unsigned char)text[i] > ASCII_LAST)
+      return FALSE;
+
+  return TRUE;
+}
+
+/* Return the length of the first line of text that fits into the given
+ * number of columns, following opt_wrap, at the line breaks of pango in
+ * log_attrs, which is only needed if the text does not fit and opt_wrap is
+ * not PANGO_WRAP_CHAR. Spaces at the end of a line may go beyond the last
+ * column, like they do with pango.
+ */
+static int
+ascii_engine_break_line(paps_t             *paps,
+                        const char         *text,
+                        const PangoLogAttr *log_attrs,
+                        int                 length,
+                        int                 columns)
+{
+  int pos, last_break = 0;
+
+  if (length <= columns)
+    return length;
+
+  for (pos = 1; pos < length; pos++)
+    {
+      if (pos > columns && text[pos-1] != ' ')
+        break;
+      if (paps->opt_wrap == PANGO_WRAP_CHAR
+          ? (pos <= columns || text[pos] != ' ')
+          : log_attrs[pos].is_line_break)
+        last_break = pos;
+    }
+
+  if (last_break > 0)
+    return last_break;
+  if (paps->opt_wrap == PANGO_WRAP_WORD_CHAR)
+    return columns;
+
+  /* A word longer than the line overflows it */
+  for (pos = columns + 1; pos < length; pos++)
+    if (log_attrs[pos].is_line_break)
+      return pos;
+
+  return length;
+}
+
+static void
+ascii_engine_show_line(paps_t     *paps,
+                       cairo_t    *cr,
+                       double      x_pos,
+                       double      y_pos,
+                       const char *text,
+                       int         length)
+{
+  cairo_glyph_t glyph_buffer[256], *glyphs = glyph_buffer;
+  cairo_text_cluster_t cluster;
+  int i;
+
+  if (length == 0)
+    return;
+
+  if (length > (int)G_N_ELEMENTS(glyph_buffer))
+    glyphs = g_new(cairo_glyph_t, length);
+
+  for (i = 0; i < length; i++)
+    {
+      glyphs[i].index = paps->ascii_engine.glyphs[(unsigned char)text[i] - ASCII_FIRST];
+      glyphs[i].x = x_pos + i * paps->ascii_engine.advance;
+      glyphs[i].y = y_pos;
+    }
+
+  /* The text of a single cluster keeps the output searchable */
+  cluster.num_bytes = length;
+  cluster.num_glyphs = length;
+  cairo_set_scaled_font(cr, paps->ascii_engine.scaled_font);
+  cairo_show_text_glyphs(cr, text, length, glyphs, length, &cluster, 1, 0);
+
+  if (glyphs != glyph_buffer)
+    g_free(glyphs);
+}
+
+
+/*
+ * Define PostScript document header information.
+ */
+void
+postscript_dsc_comments(cairo_surface_t *surface, page_layout_t *pl)
+{
+  char buf[CAIRO_COMMENT_MAX];
+  int x, y;
+
+  /*
+   * Title
+   */
+  snprintf(buf, CAIRO_COMMENT_MAX, "%%%%Title: %s", pl->title);
+  cairo_ps_surface_dsc_comment (surface, buf);
+
+  /*
+   * Orientation
+   */
+  if (pl->do_landscape)
+    {
+      cairo_ps_surface_dsc_comment (surface, "%%Orientation: Landscape");
+      x = (int)pl->page_height;
+      y = (int)pl->page_width;
+    }
+  else
+    {
+      cairo_ps_surface_dsc_comment (surface, "%%Orientation: Portrait");
+      x = (int)pl->page_width;
+      y = (int)pl->page_height;
+    }
+
+  /*
+   * Redefine BoundingBox to cover the whole paper. Cairo creates the entry
+   * based on the text only. This may affect further processing, such as with
+   * convert(1).
+   */
+  snprintf(buf, CAIRO_COMMENT_MAX, "%%%%BoundingBox: 0 0 %d %d", x, y);
+  cairo_ps_surface_dsc_comment (surface, buf);
+
+  /*
+   * Duplex
+   */
+  if (pl->do_duplex)
+    {
+      cairo_ps_surface_dsc_comment(surface, "%%Requirements: duplex");
+      cairo_ps_surface_dsc_begin_setup(surface);
+
+      if (pl->do_tumble)
+        cairo_ps_surface_dsc_comment(surface, "%%IncludeFeature: *Duplex DuplexTumble");
+      else
+        cairo_ps_surface_dsc_comment(surface, "%%IncludeFeature: *Duplex DuplexNoTumble");
+    }
+}
+
+
+int
+output_pages(paps_t        *paps,
+             output_doc_t  *doc,
+             GArray        *lines,
+             page_layout_t *page_layout,
+             gboolean       need_header,
+             PangoContext  *pango_context)
+{
+  output_state_t state;
+  GArray *column_breaks;
+  int title_height = 0, num_pages;
+  stats_clock_t timer;
+
+  stats_start(paps, &timer);
+
+  /* Paginate first, so the headers can show the number of pages */
+  if (need_header)
+    title_height = measure_page_header(paps, page_layout, pango_context);
+  column_breaks = paginate_lines(page_layout, title_height, lines);
+  num_pages = g_array_index(column_breaks, column_break_t, column_breaks->len - 1).page_idx;
+
+  /* Raster pages are rendered and encoded by the threads. The lines share
+   * the fonts they were shaped with, which only one thread may draw with at
+   * a time, so PDF and SVG pages, which are nothing but drawing, are drawn
+   * in order like the others */
+  if (paps->opt_jobs > 1 && num_pages > 1 && output_is_raster(paps))
+    {
+      output_pages_parallel(paps, doc, lines, column_breaks, page_layout,
+                            need_header ? page_header_init(paps, page_layout, pango_context) : NULL,
+                            pango_context, title_height, num_pages);
+    }
+  else
+    {
+      output_pages_start(paps, &state, doc, page_layout, need_header, pango_context, num_pages, 1);
+      output_pages_add_lines(paps, &state, lines);
+      num_pages = output_pages_finish(paps, &state);
+    }
+  g_array_free(column_breaks, TRUE);
+
+  stats_stop(paps, &timer, STAGE_OUTPUT);
+  return num_pages;
+}
+
+/* Vertical space taken by the line, in pango units */
+static int
+line_height(page_layout_t *page_layout,
+            LineLink      *line_link)
+{
+  if (page_layout->lpi > 0.0L)
+    return (int)(1.0 / page_layout->lpi * 72.0 * PANGO_SCALE);
+
+  return line_link->height;
+}
+
+static void
+pagination_init(pagination_t *pagination,
+                int           title_height)
+{
+  pagination->column_idx = 0;
+  pagination->column_y_pos = title_height;
+  pagination->page_idx = 1;
+  pagination->title_height = title_height;
+  pagination->prev_formfeed = FALSE;
+}
+
+/* Place the next line. Returns whether it starts a new column or a new
+ * page, and sets line_pos to the position of its baseline in the column.
+ */
+static break_type_t
+paginate_line(pagination_t  *pagination,
+              page_layout_t *page_layout,
+              LineLink      *line_link,
+              int           *line_pos)
+{
+  int pango_column_height = page_layout->column_height * PANGO_SCALE;
+  break_type_t break_type = BREAK_NONE;
+  int height;
+
+  /* Check if we need to move to next column */
+  if ((pagination->column_y_pos + line_link->height
+       >= pango_column_height) ||
+      pagination->prev_formfeed)
+    {
+      pagination->column_idx++;
+      pagination->column_y_pos = pagination->title_height;
+      break_type = BREAK_COLUMN;
+      if (pagination->column_idx == page_layout->num_columns)
+        {
+          pagination->column_idx = 0;
+          pagination->page_idx++;
+          break_type = BREAK_PAGE;
+        }
+    }
+  height = line_height(page_layout, line_link);
+
+  *line_pos = pagination->column_y_pos + height;
+  pagination->column_y_pos += height;
+  pagination->prev_formfeed = line_link->formfeed;
+
+  return break_type;
+}
+
+/* Compute where the columns of all pages start, without drawing anything.
+ * title_height is the height of the page header, if any. The returned
+ * table has an entry for each column, and at least one.
+ */
+static GArray *
+paginate_lines(page_layout_t *page_layout,
+               int            title_height,
+               GArray        *lines)
+{
+  GArray *column_breaks = g_array_new(FALSE, FALSE, sizeof(column_break_t));
+  pagination_t pagination;
+  column_break_t column_break = { 1, 0, 0, 0 };
+  guint line_idx;
+  int line_pos;
+
+  pagination_init(&pagination, title_height);
+  for (line_idx = 0; line_idx < lines->len; line_idx++)
+    {
+      if (paginate_line(&pagination, page_layout, &g_array_index(lines, LineLink, line_idx), &line_pos) != BREAK_NONE)
+        {
+          g_array_append_val(column_breaks, column_break);
+          column_break.page_idx = pagination.page_idx;
+          column_break.column_idx = pagination.column_idx;
+          column_break.first_line = line_idx;
+          column_break.num_lines = 0;
+        }
+      column_break.num_lines++;
+    }
+  g_array_append_val(column_breaks, column_break);
+
+  return column_breaks;
+}
+
+/* Draw a page into a recording surface, the same way output_pages_add_lines()
+ * would draw it on the output surface. The lines were shaped with the
+ * contexts of the rendering, whose fonts are not to be used by several
+ * threads at once, so only one thread draws lines at a time. Raster pages
+ * do not use the page forms, so the threads leave them alone.
+ */
+static cairo_surface_t *
+record_page(paps_t          *paps,
+            page_renderer_t *renderer,
+            page_layout_t   *page_layout,
+            page_header_t   *header,
+            int              page_idx)
+{
+  cairo_surface_t *recording = cairo_recording_surface_create(CAIRO_CONTENT_COLOR_ALPHA, NULL);
+  cairo_t *cr = cairo_create(recording);
+  guint i;
+  int k;
+
+  if (header)
+    draw_page_header_line_to_page(cr, FALSE, page_layout, header, page_idx + 1, renderer->num_pages);
+
+  for (i = renderer->page_columns[page_idx]; i < renderer->page_columns[page_idx + 1]; i++)
+    {
+      column_break_t *column = &g_array_index(renderer->column_breaks, column_break_t, i);
+      int column_y_pos = renderer->title_height;
+
+      if (column->column_idx > 0)
+        eject_column(paps, cr,
+                     renderer->title_height/PANGO_SCALE,
+                     page_layout,
+                     column->column_idx
+                     );
+
+      g_mutex_lock(&renderer->draw_mutex);
+      for (k = column->first_line; k < column->first_line + column->num_lines; k++)
+        {
+          LineLink *line_link = &g_array_index(renderer->lines, LineLink, k);
+
+          column_y_pos += line_height(page_layout, line_link);
+          draw_line_to_page(paps, cr,
+                            column->column_idx,
+                            column_y_pos,
+                            page_layout,
+                            line_link,
+                            page_layout->do_show_wrap && line_link->wrapped);
+        }
+      g_mutex_unlock(&renderer->draw_mutex);
+    }
+
+  cairo_destroy(cr);
+
+  return recording;
+}
+
+static gpointer
+record_pages_thread(gpointer data)
+{
+  page_renderer_t *renderer = data;
+  paps_t *paps = renderer->paps;
+  /* The header drawing sets the header height, so keep a copy */
+  page_layout_t page_layout = *renderer->page_layout;
+  page_header_t header;
+  PangoContext *ctx = NULL;
+
+  /* The header is laid out again with a context of the thread, as pango
+   * objects are not to be used by several threads at once */
+  if (renderer->header)
+    {
+      memset(&header, 0, sizeof(header));
+      ctx = clone_pango_context(renderer->pango_context, NULL);
+      header.date_layout = relayout_header_line(renderer->header->date_layout, ctx, &header.date_rect);
+      header.title_layout = relayout_header_line(renderer->header->title_layout, ctx, &header.title_rect);
+      header.pagenum_layout = new_page_number_layout(&page_layout, ctx);
+      /* A recording surface is not to be painted from several threads */
+      header.share_decoration = FALSE;
+    }
+
+  while (1)
+    {
+      cairo_surface_t *recording;
+      GByteArray *raster;
+      int page_idx;
+
+      g_mutex_lock(&renderer->mutex);
+      while (renderer->next_page < renderer->num_selected
+             && renderer->next_page >= renderer->replayed + renderer->window)
+        g_cond_wait(&renderer->cond, &renderer->mutex);
+      page_idx = renderer->next_page;
+      if (page_idx < renderer->num_selected)
+        renderer->next_page++;
+      g_mutex_unlock(&renderer->mutex);
+
+      if (page_idx == renderer->num_selected)
+        break;
+
+      recording = record_page(paps, renderer, &page_layout, renderer->header ? &header : NULL,
+                              renderer->selected[page_idx]);
+      raster = raster_encode_page(paps, recording);
+      cairo_surface_destroy(recording);
+
+      g_mutex_lock(&renderer->mutex);
+      renderer->rasters[page_idx] = raster;
+      g_cond_broadcast(&renderer->cond);
+      g_mutex_unlock(&renderer->mutex);
+    }
+
+  if (ctx)
+    {
+      g_object_unref(header.date_layout);
+      g_object_unref(header.title_layout);
+      g_object_unref(header.pagenum_layout);
+      g_object_unref(ctx);
+    }
+
+  return NULL;
+}
+
+/* Draw the raster pages selected by --pages in opt_jobs threads, each into
+ * a recording surface of its own, render and encode them, and write them
+ * in page order. The threads draw the lines one at a time, while the
+ * headers and the rendering and encoding of the pages, which take most of
+ * the time, are done in parallel. They keep at most a window of pages
+ * ahead of the output, so the memory use does not grow with the document.
+ */
+static void
+output_pages_parallel(paps_t          *paps,
+                      output_doc_t    *doc,
+                      GArray          *lines,
+                      GArray          *column_breaks,
+                      page_layout_t   *page_layout,
+                      page_header_t   *header,
+                      PangoContext    *pango_context,
+                      int              title_height,
+                      int              num_pages)
+{
+  page_renderer_t renderer;
+  GThread **threads;
+  int num_threads;
+  guint i;
+  int page_idx;
+
+  renderer.paps = paps;
+  renderer.page_layout = page_layout;
+  renderer.header = header;
+  renderer.pango_context = pango_context;
+  renderer.title_height = title_height;
+  renderer.num_pages = num_pages;
+  renderer.column_breaks = column_breaks;
+  renderer.lines = lines;
+
+  /* Index of the first column of each page */
+  renderer.page_columns = g_new(guint, num_pages + 1);
+  for (i = column_breaks->len; i > 0; i--)
+    renderer.page_columns[g_array_index(column_breaks, column_break_t, i - 1).page_idx - 1] = i - 1;
+  renderer.page_columns[num_pages] = column_breaks->len;
+
+  renderer.selected = g_new(int, num_pages);
+  renderer.num_selected = 0;
+  for (page_idx = 0; page_idx < num_pages; page_idx++)
+    if (page_selected(paps, page_idx + 1))
+      renderer.selected[renderer.num_selected++] = page_idx;
+  num_threads = MIN(paps->opt_jobs, renderer.num_selected);
+
+  renderer.rasters = g_new0(GByteArray *, renderer.num_selected);
+  renderer.next_page = 0;
+  renderer.replayed = 0;
+  renderer.window = 4 * num_threads;
+  g_mutex_init(&renderer.mutex);
+  g_cond_init(&renderer.cond);
+  g_mutex_init(&renderer.draw_mutex);
+
+  threads = g_new(GThread *, num_threads);
+  for (page_idx = 0; page_idx < num_threads; page_idx++)
+    threads[page_idx] = g_thread_new("paps-render", record_pages_thread, &renderer);
+
+  for (page_idx = 0; page_idx < renderer.num_selected; page_idx++)
+    {
+      GByteArray *raster;
+
+      g_mutex_lock(&renderer.mutex);
+      while (renderer.rasters[page_idx] == NULL)
+        g_cond_wait(&renderer.cond, &renderer.mutex);
+      raster = renderer.rasters[page_idx];
+      renderer.rasters[page_idx] = NULL;
+      g_mutex_unlock(&renderer.mutex);
+
+      output_doc_start_page(paps, doc);
+      raster_write_page(paps, raster);
+
+      g_mutex_lock(&renderer.mutex);
+      renderer.replayed = page_idx + 1;
+      g_cond_broadcast(&renderer.cond);
+      g_mutex_unlock(&renderer.mutex);
+    }
+
+  for (page_idx = 0; page_idx < num_threads; page_idx++)
+    g_thread_join(threads[page_idx]);
+  g_free(threads);
+
+  g_mutex_clear(&renderer.mutex);
+  g_cond_clear(&renderer.cond);
+  g_mutex_clear(&renderer.draw_mutex);
+  g_free(renderer.rasters);
+  g_free(renderer.page_columns);
+  g_free(renderer.selected);
+
+  free_lines(paps, lines);
+}
+
+/* Start the first page, numbered first_page. Lines are then drawn in as
+ * many batches as needed with output_pages_add_lines(), and
+ * output_pages_finish() ejects the last page. num_pages is -1 if the
+ * number of pages is unknown.
+ */
+void
+output_pages_start(paps_t         *paps,
+                   output_state_t *state,
+                   output_doc_t  *doc,
+                   page_layout_t *page_layout,
+                   gboolean       need_header,
+                   PangoContext  *pango_context,
+                   int            num_pages,
+                   int            first_page)
+{
+  int title_height = 0;
+
+  state->doc = doc;
+  state->page_layout = page_layout;
+  state->header = need_header ? page_header_init(paps, page_layout, pango_context) : NULL;
+  page_forms_init(paps);
+  state->flush_pages = FALSE;
+  state->num_pages = num_pages;
+  state->drawing = page_selected(paps, first_page);
+
+  if (state->drawing)
+    {
+      output_doc_start_page(paps, doc);
+      if (state->header)
+        title_height = draw_page_header_line_to_page(doc->cr, FALSE, page_layout, state->header, first_page, num_pages);
+    }
+  else if (state->header)
+    title_height = measure_page_header(paps, page_layout, pango_context);
+  pagination_init(&state->pagination, title_height);
+  state->pagination.page_idx = first_page;
+}
+
+/* Draw the lines and release them, and with each paragraph's last line
+ * the paragraph itself. Lines on pages not selected by --pages are only
+ * paginated.
+ */
+void
+output_pages_add_lines(paps_t         *paps,
+                       output_state_t *state,
+                       GArray         *lines)
+{
+  page_layout_t *page_layout = state->page_layout;
+  pagination_t *pagination = &state->pagination;
+  cairo_t *cr = state->doc->cr;
+  int line_pos;
+  guint i;
+
+  for (i = 0; i < lines->len; i++)
+    {
+      LineLink *line_link = &g_array_index(lines, LineLink, i);
+      gboolean draw_wrap_character = page_layout->do_show_wrap && line_link->wrapped;
+      
+      switch (paginate_line(pagination, page_layout, line_link, &line_pos))
+        {
+        case BREAK_PAGE:
+          if (state->drawing)
+            {
+              eject_page(paps, cr);
+              if (state->flush_pages)
+                output_flush(paps);
+            }
+          state->drawing = page_selected(paps, pagination->page_idx);
+          if (!state->drawing)
+            break;
+
+          /* This may move on to a new file, and so to a new cairo context */
+          output_doc_start_page(paps, state->doc);
+          cr = state->doc->cr;
+
+          if (state->header)
+            draw_page_header_line_to_page(cr, FALSE, page_layout, state->header, pagination->page_idx, state->num_pages);
+          break;
+        case BREAK_COLUMN:
+          if (state->drawing)
+            eject_column(paps, cr,
+                         pagination->title_height/PANGO_SCALE,
+                         page_layout,
+                         pagination->column_idx
+                         );
+          break;
+        case BREAK_NONE:
+          break;
+        }
+      if (state->drawing)
+        draw_line_to_page(paps, cr,
+                          pagination->column_idx,
+                          line_pos,
+                          page_layout,
+                          line_link,
+                          draw_wrap_character);
+
+      if (line_link->last_line)
+        free_paragraph(line_link->para);
+    }
+  g_array_free(lines, TRUE);
+  arena_reset(&paps->paragraph_arena);
+}
+
+int
+output_pages_finish(paps_t *paps, output_state_t *state)
+{
+  if (state->drawing)
+    eject_page(paps, state->doc->cr);
+  return state->pagination.page_idx;
+}
+
+/* Read, lay out and draw the file one chunk at a time, so only the
+ * paragraphs of the current chunk are kept in memory. The number of pages
+ * is -1 if it is not known in advance, as is usually the case.
+ */
+int
+output_stream(paps_t          *paps,
+              output_doc_t    *doc,
+              FILE            *file,
+              gchar           *encoding,
+              PangoContext    *pango_context,
+              page_layout_t   *page_layout,
+              gboolean         need_header,
+              int              num_pages)
+{
+  input_reader_t reader;
+  output_state_t state;
+  stats_clock_t timer;
+
+  input_reader_init(paps, &reader, file, encoding);
+  stats_start(paps, &timer);
+  output_pages_start(paps, &state, doc, page_layout, need_header, pango_context, num_pages, 1);
+  state.flush_pages = TRUE;
+  stats_stop(paps, &timer, STAGE_OUTPUT);
+
+  output_stream_chunks(paps, &state, &reader, pango_context, page_layout);
+
+  input_reader_close(&reader);
+  stats_start(paps, &timer);
+  num_pages = output_pages_finish(paps, &state);
+  stats_stop(paps, &timer, STAGE_OUTPUT);
+  return num_pages;
+}
+
+/* Lay out and draw the rest of the input of reader one chunk at a time */
+static void
+output_stream_chunks(paps_t          *paps,
+                     output_state_t  *state,
+                     input_reader_t  *reader,
+                     PangoContext    *pango_context,
+                     page_layout_t   *page_layout)
+{
+  const char *text;
+  gsize length;
+  stats_clock_t timer;
+
+  while ((text = input_reader_read(paps, reader, STREAM_CHUNK_SIZE, &length)) != NULL)
+    {
+      GList *paragraphs;
+      GArray *lines;
+
+      paragraphs = split_text_into_paragraphs(paps, state->doc->cr,
+                                              pango_context,
+                                              page_layout,
+                                              page_layout->column_width,
+                                              text,
+                                              length);
+      lines = split_paragraphs_into_lines(paps, page_layout, paragraphs);
+
+      stats_start(paps, &timer);
+      output_pages_add_lines(paps, state, lines);
+      stats_stop(paps, &timer, STAGE_OUTPUT);
+    }
+}
+
+/* Bytes taken by the layout of lines, apart from the paragraph arena: the
+ * lines themselves, and the glyphs, log attributes and text that the pango
+ * layouts keep for them.
+ */
+static guint64
+lines_memory(GArray *lines)
+{
+  guint64 bytes = lines->len * sizeof(LineLink);
+  guint i;
+
+  for (i = 0; i < lines->len; i++)
+    {
+      LineLink *line_link = &g_array_index(lines, LineLink, i);
+      GSList *run;
+
+      if (line_link->pango_line == NULL)
+        continue;
+
+      bytes += sizeof(PangoLayoutLine);
+      for (run = line_link->pango_line->runs; run; run = run->next)
+        {
+          PangoGlyphItem *glyph_item = run->data;
+
+          bytes += sizeof(GSList) + sizeof(PangoGlyphItem) + sizeof(PangoItem)
+                   + glyph_item->glyphs->num_glyphs * (sizeof(PangoGlyphInfo) + sizeof(gint));
+        }
+      if (line_link->last_line && line_link->para->layout)
+        bytes += LAYOUT_FIXED_BYTES + (line_link->para->length + 1) * (1 + sizeof(PangoLogAttr));
+    }
+
+  return bytes;
+}
+
+/* Lay out the file one chunk at a time for --max-memory, keeping the lines
+ * for output_pages() as long as the paragraph arena and the lines take no
+ * more than the limit. Past it, the pages laid out so far are drawn and
+ * the rest of the file is streamed; with a header, the document is rather
+ * output again from its start by output_bounded(), so that the header has
+ * the number of pages.
+ */
+static int
+output_measured(paps_t          *paps,
+                output_doc_t    *doc,
+                FILE            *file,
+                gchar           *encoding,
+                PangoContext    *pango_context,
+                page_layout_t   *page_layout,
+                gboolean         need_header)
+{
+  guint64 max_bytes = (guint64)paps->opt_max_memory * 1024 * 1024;
+  guint64 bytes = 0;
+  input_reader_t reader;
+  output_state_t state;
+  GArray *lines = g_array_new(FALSE, FALSE, sizeof(LineLink));
+  const char *text;
+  gsize length;
+  long start = -1;
+  int fd = -1, num_pages;
+  stats_clock_t timer;
+
+  /* The reader closes the file, so keep a copy of the descriptor to start over */
+  if (need_header && (start = ftell(file)) >= 0)
+    fd = dup(fileno(file));
+
+  input_reader_init(paps, &reader, file, encoding);
+  while ((text = input_reader_read(paps, &reader, STREAM_CHUNK_SIZE, &length)) != NULL)
+    {
+      GList *paragraphs;
+      GArray *chunk_lines;
+
+      /* The text of the paragraphs must stay until they are drawn */
+      if (reader.mapping == NULL || reader.chunk != NULL)
+        text = memcpy(arena_alloc(&paps->paragraph_arena, length), text, length);
+
+      paragraphs = split_text_into_paragraphs(paps, doc->cr,
+                                              pango_context,
+                                              page_layout,
+                                              page_layout->column_width,
+                                              text,
+                                              length);
+      chunk_lines = split_paragraphs_into_lines(paps, page_layout, paragraphs);
+      bytes += lines_memory(chunk_lines);
+      g_array_append_vals(lines, chunk_lines->data, chunk_lines->len);
+      g_array_free(chunk_lines, TRUE);
+
+      if (paps->paragraph_arena.allocated + bytes > max_bytes)
+        break;
+    }
+
+  /* Within the limit, the document is output as without it */
+  if (text == NULL)
+    {
+      num_pages = output_pages(paps, doc, lines, page_layout, need_header, pango_context);
+      input_reader_close(&reader);
+      if (fd >= 0)
+        close(fd);
+      return num_pages;
+    }
+
+  if (fd >= 0)
+    {
+      free_lines(paps, lines);
+      input_reader_close(&reader);
+      if (lseek(fd, start, SEEK_SET) < 0 || (file = fdopen(fd, "rb")) == NULL)
+        {
+          paps_set_error(paps, G_FILE_ERROR, g_file_error_from_errno(errno),
+                         _("Error reading file: %s"), g_strerror(errno));
+          close(fd);
+          return 0;
+        }
+      return output_bounded(paps, doc, file, encoding, pango_context, page_layout, need_header);
+    }
+
+  stats_start(paps, &timer);
+  output_pages_start(paps, &state, doc, page_layout, need_header, pango_context, -1, 1);
+  state.flush_pages = TRUE;
+  output_pages_add_lines(paps, &state, lines);
+  stats_stop(paps, &timer, STAGE_OUTPUT);
+
+  output_stream_chunks(paps, &state, &reader, pango_context, page_layout);
+
+  input_reader_close(&reader);
+  stats_start(paps, &timer);
+  num_pages = output_pages_finish(paps, &state);
+  stats_stop(paps, &timer, STAGE_OUTPUT);
+  return num_pages;
+}
+
+/* Read the checkpoint saved by a previous run. Without a checkpoint file, or
+ * if it was saved for another file or for one that has since been
+ * truncated, the input is laid out from its start.
+ */
+static void
+checkpoint_load (paps_t        *paps,
+                 checkpoint_t  *checkpoint,
+                 const char    *checkpoint_file,
+                 struct stat   *st)
+{
+  GKeyFile *key_file = g_key_file_new ();
+  GError *error = NULL;
+
+  checkpoint->inode = st->st_ino;
+  checkpoint->offset = 0;
+  checkpoint->page_idx = 1;
+  checkpoint->column_idx = 0;
+  checkpoint->column_y_pos = 0;
+  checkpoint->prev_formfeed = FALSE;
+
+  if (!g_key_file_load_from_file (key_file, checkpoint_file, G_KEY_FILE_NONE, &error))
+    {
+      if (!g_error_matches (error, G_FILE_ERROR, G_FILE_ERROR_NOENT))
+        paps_set_error (paps, G_FILE_ERROR, G_FILE_ERROR_FAILED, _("Error reading checkpoint %s: %s"),
+                        checkpoint_file, error->message);
+      g_error_free (error);
+      g_key_file_free (key_file);
+      return;
+    }
+
+  if (g_key_file_get_uint64 (key_file, "checkpoint", "inode", NULL) == (guint64)st->st_ino)
+    {
+      gint64 offset = g_key_file_get_int64 (key_file, "checkpoint", "offset", NULL);
+
+      if (offset > 0 && offset <= st->st_size)
+        {
+          checkpoint->offset = offset;
+          checkpoint->page_idx = MAX(1, g_key_file_get_integer (key_file, "checkpoint", "page", NULL));
+          checkpoint->column_idx = g_key_file_get_integer (key_file, "checkpoint", "column", NULL);
+          checkpoint->column_y_pos = g_key_file_get_integer (key_file, "checkpoint", "column_y_pos", NULL);
+          checkpoint->prev_formfeed = g_key_file_get_boolean (key_file, "checkpoint", "formfeed", NULL);
+        }
+    }
+  g_key_file_free (key_file);
+}
+
+/* Save the checkpoint, replacing the file at once so that an interrupted
+ * run leaves the previous checkpoint intact.
+ */
+static void
+checkpoint_save (paps_t             *paps,
+                 const checkpoint_t *checkpoint,
+                 const char         *checkpoint_file)
+{
+  GKeyFile *key_file = g_key_file_new ();
+  GError *error = NULL;
+  gchar *data;
+  gsize length;
+
+  g_key_file_set_uint64 (key_file, "checkpoint", "inode", checkpoint->inode);
+  g_key_file_set_int64 (key_file, "checkpoint", "offset", checkpoint->offset);
+  g_key_file_set_integer (key_file, "checkpoint", "page", checkpoint->page_idx);
+  g_key_file_set_integer (key_file, "checkpoint", "column", checkpoint->column_idx);
+  g_key_file_set_integer (key_file, "checkpoint", "column_y_pos", checkpoint->column_y_pos);
+  g_key_file_set_boolean (key_file, "checkpoint", "formfeed", checkpoint->prev_formfeed);
+  data = g_key_file_to_data (key_file, &length, NULL);
+
+  if (!g_file_set_contents (checkpoint_file, data, length, &error))
+    {
+      paps_set_error (paps, G_FILE_ERROR, G_FILE_ERROR_FAILED, _("Error writing checkpoint %s: %s"),
+                      checkpoint_file, error->message);
+      g_error_free (error);
+    }
+  g_free (data);
+  g_key_file_free (key_file);
+}
+
+/* Go on with the lines of a run from the column and position on its first
+ * page where the lines of the previous run stopped, so that they follow
+ * those lines on the page instead of starting a new one. A checkpoint saved
+ * with other columns or margins is kept within the page.
+ */
+static void
+resume_pagination (pagination_t       *pagination,
+                   page_layout_t      *page_layout,
+                   const checkpoint_t *checkpoint)
+{
+  pagination->column_idx = CLAMP (checkpoint->column_idx, 0, page_layout->num_columns - 1);
+  pagination->column_y_pos = CLAMP (checkpoint->column_y_pos, pagination->title_height,
+                                    page_layout->column_height * PANGO_SCALE);
+  pagination->prev_formfeed = checkpoint->prev_formfeed;
+}
+
+static void
+follow_stop_cb (int signum)
+{
+  follow_stopped = 1;
+}
+
+/* Lay out and draw the complete lines read from the file as they come,
+ * starting at the offset of the checkpoint, if any. Only UTF-8 input is
+ * read this way, so that offsets in the file are offsets in the text.
+ * With do_follow, the end of the file is waited on until SIGINT or
+ * SIGTERM, with each page output as soon as it is full. The last page is
+ * then ejected, and the checkpoint saved with where the next run is to go
+ * on: the same page, from the column and position its lines reached, see
+ * resume_pagination(). A last line without a newline is only laid out
+ * without a checkpoint, as it may still be written to. A line with a NUL
+ * ends at it, as for input_reader_read(). Returns the number of pages.
+ */
+static int
+follow_document (paps_t          *paps,
+                 FILE            *file,
+                 gchar           *encoding,
+                 PangoContext    *pango_context,
+                 page_layout_t   *page_layout,
+                 gboolean         need_header,
+                 const char      *pattern,
+                 const char      *checkpoint_file,
+                 gboolean         do_follow)
+{
+  output_doc_t doc;
+  output_state_t state;
+  checkpoint_t checkpoint;
+  struct stat st;
+  GString *pending;
+  gboolean started = FALSE, eof = FALSE, done;
+  int fd = fileno(file);
+  int num_pages = 0;
+  stats_clock_t timer;
+
+  if (!is_utf8_encoding (encoding)
+      && g_ascii_strcasecmp (encoding, "ANSI_X3.4-1968") != 0
+      && g_ascii_strcasecmp (encoding, "ASCII") != 0
+      && g_ascii_strcasecmp (encoding, "US-ASCII") != 0)
+    paps_set_error (paps, G_CONVERT_ERROR, G_CONVERT_ERROR_NO_CONVERSION,
+                    _("--checkpoint and --follow need UTF-8 input."));
+
+  memset (&checkpoint, 0, sizeof(checkpoint));
+  checkpoint.page_idx = 1;
+  if (checkpoint_file && paps->error == NULL)
+    {
+      if (fstat (fd, &st) != 0 || !S_ISREG(st.st_mode))
+        paps_set_error (paps, G_FILE_ERROR, G_FILE_ERROR_INVAL,
+                        _("--checkpoint needs a regular file as input."));
+      else
+        checkpoint_load (paps, &checkpoint, checkpoint_file, &st);
+      if (paps->error == NULL && lseek (fd, checkpoint.offset, SEEK_SET) < 0)
+        paps_set_error (paps, G_FILE_ERROR, g_file_error_from_errno (errno),
+                        _("Error reading input: %s"), g_strerror (errno));
+    }
+  if (paps->error != NULL)
+    {
+      fclose (file);
+      return 0;
+    }
+
+  if (do_follow)
+    {
+      struct sigaction action;
+
+      /* Without SA_RESTART, so that a read waiting on a pipe is interrupted */
+      memset (&action, 0, sizeof(action));
+      action.sa_handler = follow_stop_cb;
+      sigemptyset (&action.sa_mask);
+      sigaction (SIGINT, &action, NULL);
+      sigaction (SIGTERM, &action, NULL);
+    }
+
+  output_doc_open (paps, &doc, page_layout, pattern);
+  pending = g_string_sized_new (READ_BLOCK_SIZE);
+
+  while (paps->error == NULL)
+    {
+      char *text;
+      gsize length, text_length;
+      gssize size;
+      GList *paragraphs;
+      GArray *lines;
+      gboolean in_nul_line = FALSE;
+
+      /* Once stopped, only the text read so far is laid out */
+      if (!follow_stopped)
+        {
+          stats_start (paps, &timer);
+          g_string_set_size (pending, pending->len + READ_BLOCK_SIZE);
+          size = read (fd, pending->str + pending->len - READ_BLOCK_SIZE, READ_BLOCK_SIZE);
+          g_string_set_size (pending, pending->len - READ_BLOCK_SIZE + MAX(size, 0));
+          stats_stop (paps, &timer, STAGE_READ);
+          if (size < 0 && errno != EINTR)
+            {
+              paps_set_error (paps, G_FILE_ERROR, g_file_error_from_errno (errno),
+                              _("Error reading input: %s"), g_strerror (errno));
+              break;
+            }
+          if (size > 0)
+            paps->stats.bytes_read += size;
+          else if (size == 0 && !do_follow)
+            eof = TRUE;
+          else if (size == 0)
+            g_usleep (FOLLOW_INTERVAL);
+        }
+      done = eof || follow_stopped;
+
+      /* Lay out complete lines only, unless no more are to come. The last
+       * line is then completed, unless the next run of the checkpoint is
+       * to go on with it. */
+      text = pending->str;
+      length = pending->len;
+      if (done && !checkpoint_file)
+        {
+          if (length > 0 && text[length - 1] != '\n')
+            {
+              g_string_append_c (pending, '\n');
+              text = pending->str;
+              length = pending->len;
+            }
+        }
+      else
+        while (length > 0 && text[length - 1] != '\n')
+          length--;
+
+      if (length > 0)
+        {
+          if (!utf8_validate (text, length, NULL))
+            {
+              paps_set_error (paps, G_CONVERT_ERROR, G_CONVERT_ERROR_ILLEGAL_SEQUENCE,
+                              _("Error while converting input from '%s' to UTF-8."), encoding);
+              break;
+            }
+
+          /* The lines are complete, so a NUL line ends within them, and the
+           * checkpoint goes on past it */
+          text_length = drop_nul_lines (text, length, &in_nul_line);
+
+          if (!started)
+            {
+              stats_start (paps, &timer);
+              output_pages_start (paps, &state, &doc, page_layout, need_header, pango_context, -1,
+                                  checkpoint.page_idx);
+              if (checkpoint.offset > 0)
+                resume_pagination (&state.pagination, page_layout, &checkpoint);
+              state.flush_pages = TRUE;
+              stats_stop (paps, &timer, STAGE_OUTPUT);
+              started = TRUE;
+            }
+
+          paragraphs = split_text_into_paragraphs (paps, doc.cr,
+                                                   pango_context,
+                                                   page_layout,
+                                                   page_layout->column_width,
+                                                   text,
+                                                   text_length);
+          lines = split_paragraphs_into_lines (paps, page_layout, paragraphs);
+
+          stats_start (paps, &timer);
+          output_pages_add_lines (paps, &state, lines);
+          stats_stop (paps, &timer, STAGE_OUTPUT);
+
+          /* The paragraphs pointed into the text until they were drawn */
+          g_string_erase (pending, 0, length);
+          checkpoint.offset += length;
+        }
+
+      if (done)
+        break;
+    }
+
+  if (started)
+    {
+      stats_start (paps, &timer);
+      num_pages = output_pages_finish (paps, &state) - checkpoint.page_idx + 1;
+      stats_stop (paps, &timer, STAGE_OUTPUT);
+      checkpoint.column_idx = state.pagination.column_idx;
+      checkpoint.column_y_pos = state.pagination.column_y_pos;
+      checkpoint.prev_formfeed = state.pagination.prev_formfeed;
+      checkpoint.page_idx = state.pagination.page_idx;
+    }
+  output_doc_close (paps, &doc);
+  g_string_free (pending, TRUE);
+  fclose (file);
+
+  /* After an error, the next run starts over from the last checkpoint */
+  if (checkpoint_file && paps->error == NULL)
+    checkpoint_save (paps, &checkpoint, checkpoint_file);
+
+  paps->stats.documents++;
+  paps->stats.pages += num_pages;
+  return num_pages;
 }
 
+/* Whether the file can be read again from where it is, see output_measured() */
+static gboolean
+is_regular_file(FILE *file)
+{
+  struct stat st;
 
-/*
- * Define PostScript document header information.
+  return fstat(fileno(file), &st) == 0 && S_ISREG(st.st_mode);
+}
+
+/* Copy the rest of the file to an unlinked temporary file, so that it can
+ * be read twice. The file is closed, and the copy returned at its start.
  */
-void
-postscript_dsc_comments(cairo_surface_t *surface, page_layout_t *pl)
+static FILE *
+spill_to_temporary_file(paps_t *paps, FILE *file)
 {
-  char buf[CAIRO_COMMENT_MAX];
-  int x, y;
-
-  /*
-   * Title
-   */
-  snprintf(buf, CAIRO_COMMENT_MAX, "%%%%Title: %s", pl->title);
-  cairo_ps_surface_dsc_comment (surface, buf);
+  GError *error = NULL;
+  gchar *name, *block;
+  FILE *spill;
+  gsize size;
+  int fd;
 
-  /*
-   * Orientation
-   */
-  if (pl->do_landscape)
+  fd = g_file_open_tmp("paps-XXXXXX", &name, &error);
+  if (fd < 0)
     {
-      cairo_ps_surface_dsc_comment (surface, "%%Orientation: Landscape");
-      x = (int)pl->page_height;
-      y = (int)pl->page_width;
+      paps_set_error(paps, G_FILE_ERROR, error->code, _("Error creating a temporary file: %s"), error->message);
+      g_error_free(error);
+      fclose(file);
+      return NULL;
     }
-  else
+  unlink(name);
+  g_free(name);
+  spill = fdopen(fd, "w+b");
+
+  block = g_malloc(READ_BLOCK_SIZE);
+  while ((size = fread(block, 1, READ_BLOCK_SIZE, file)) > 0)
+    if (fwrite(block, 1, size, spill) != size)
+      {
+        paps_set_error(paps, G_FILE_ERROR, g_file_error_from_errno(errno),
+                       _("Error writing a temporary file: %s"), g_strerror(errno));
+        break;
+      }
+  if (ferror(file))
+    paps_set_error(paps, G_FILE_ERROR, g_file_error_from_errno(errno),
+                   _("Error reading file: %s"), g_strerror(errno));
+  g_free(block);
+  fclose(file);
+  if (paps->error != NULL)
     {
-      cairo_ps_surface_dsc_comment (surface, "%%Orientation: Portrait");
-      x = (int)pl->page_width;
-      y = (int)pl->page_height;
+      fclose(spill);
+      return NULL;
     }
+  rewind(spill);
 
-  /*
-   * Redefine BoundingBox to cover the whole paper. Cairo creates the entry
-   * based on the text only. This may affect further processing, such as with
-   * convert(1).
-   */
-  snprintf(buf, CAIRO_COMMENT_MAX, "%%%%BoundingBox: 0 0 %d %d", x, y);
-  cairo_ps_surface_dsc_comment (surface, buf);
+  return spill;
+}
 
-  /*
-   * Duplex
-   */
-  if (pl->do_duplex)
+/* Output a document that is too large to be laid out at once for
+ * --max-memory, one chunk at a time as with --stream. For the number of
+ * pages in the header, the file is paginated in a first pass, for which
+ * input that can not be read twice is first copied to a temporary file.
+ * Neither pass keeps more than a chunk of layout state.
+ */
+static int
+output_bounded(paps_t          *paps,
+               output_doc_t    *doc,
+               FILE            *file,
+               gchar           *encoding,
+               PangoContext    *pango_context,
+               page_layout_t   *page_layout,
+               gboolean         need_header)
+{
+  struct stat st;
+  long start;
+  int fd, num_pages;
+
+  if (!need_header)
+    return output_stream(paps, doc, file, encoding, pango_context, page_layout, need_header, -1);
+
+  if (fstat(fileno(file), &st) != 0 || !S_ISREG(st.st_mode) || (start = ftell(file)) < 0)
     {
-      cairo_ps_surface_dsc_comment(surface, "%%Requirements: duplex");
-      cairo_ps_surface_dsc_begin_setup(surface);
+      file = spill_to_temporary_file(paps, file);
+      if (file == NULL)
+        return 0;
+      start = 0;
+    }
 
-      if (pl->do_tumble)
-        cairo_ps_surface_dsc_comment(surface, "%%IncludeFeature: *Duplex DuplexTumble");
-      else
-        cairo_ps_surface_dsc_comment(surface, "%%IncludeFeature: *Duplex DuplexNoTumble");
+  /* The first pass closes the file, so go on with a copy of the descriptor */
+  fd = dup(fileno(file));
+  num_pages = count_pages(paps, file, encoding, pango_context, page_layout, need_header, NULL, FALSE);
+  if (fd < 0 || lseek(fd, start, SEEK_SET) < 0 || (file = fdopen(fd, "rb")) == NULL)
+    {
+      paps_set_error(paps, G_FILE_ERROR, g_file_error_from_errno(errno),
+                     _("Error reading file: %s"), g_strerror(errno));
+      if (fd >= 0)
+        close(fd);
+      return 0;
     }
-}
 
+  return output_stream(paps, doc, file, encoding, pango_context, page_layout, need_header, num_pages);
+}
 
+/* Lay out the file and return its number of pages, without drawing. Unless
+ * markup is used the file is processed one chunk at a time. With a report,
+ * invalid input is replaced and noted in it instead of being an error, and
+ * the lines are counted. The document is only counted in the --stats if
+ * count_document is set, i.e. unless it is a first pass of output_bounded().
+ */
 int
-output_pages(cairo_surface_t *surface,
-             cairo_t       *cr,
-             GList         *pango_lines,
-             page_layout_t *page_layout,
-             gboolean       need_header,
-             PangoContext  *pango_context)
+count_pages(paps_t          *paps,
+            FILE            *file,
+            gchar           *encoding,
+            PangoContext    *pango_context,
+            page_layout_t   *page_layout,
+            gboolean         need_header,
+            layout_report_t *report,
+            gboolean         count_document)
 {
-  int column_idx = 0;
-  int column_y_pos = 0;
-  int page_idx = 1;
-  int pango_column_height = page_layout->column_height * PANGO_SCALE;
-  int height = 0;
-  LineLink *prev_line_link = NULL;
-  int num_pages = -1; // TBD Calculate this in advance!
-  int title_height = 0;
+  input_reader_t reader;
+  pagination_t pagination;
+  const char *text;
+  gsize length;
+  int line_pos, page_lines = 0;
 
-  start_page(surface, cr, page_layout);
+  input_reader_init(paps, &reader, file, encoding);
+  reader.report = report;
+  pagination_init(&pagination, need_header ? measure_page_header(paps, page_layout, pango_context) : 0);
 
-  if (need_header) {
-      title_height = draw_page_header_line_to_page(cr, FALSE, page_layout, pango_context, page_idx, num_pages);
-      column_y_pos = title_height;
-  }
-  while(pango_lines)
+  while ((text = input_reader_read(paps, &reader, page_layout->do_use_markup ? 0 : STREAM_CHUNK_SIZE, &length)) != NULL)
     {
-      LineLink *line_link = pango_lines->data;
-      PangoLayoutLine *line = line_link->pango_line;
-      gboolean draw_wrap_character = page_layout->do_show_wrap && line_link->wrapped;
-      
-      /* Check if we need to move to next column */
-      if ((column_y_pos + line_link->logical_rect.height
-           >= pango_column_height) ||
-          (prev_line_link && prev_line_link->formfeed))
+      GList *paragraphs;
+      GArray *lines;
+      guint i;
+
+      paragraphs = split_text_into_paragraphs(paps, NULL,
+                                              pango_context,
+                                              page_layout,
+                                              page_layout->column_width,
+                                              text,
+                                              length);
+      lines = split_paragraphs_into_lines(paps, page_layout, paragraphs);
+
+      for (i = 0; i < lines->len; i++)
         {
-          column_idx++;
-          column_y_pos = title_height;
-          if (column_idx == page_layout->num_columns)
-            {
-              column_idx = 0;
-              eject_page(cr);
-              page_idx++;
-              start_page(surface, cr, page_layout);
-
-              if (need_header) {
-                title_height = draw_page_header_line_to_page(cr, FALSE, page_layout, pango_context, page_idx, num_pages);
-                column_y_pos = title_height;
-              }
-            }
-          else
+          LineLink *line_link = &g_array_index(lines, LineLink, i);
+
+          if (paginate_line(&pagination, page_layout, line_link, &line_pos) == BREAK_PAGE
+              && report)
             {
-              eject_column(cr,
-                           title_height/PANGO_SCALE,
-                           page_layout,
-                           column_idx
-                           );
+              g_array_append_val(report->lines_per_page, page_lines);
+              page_lines = 0;
             }
+          if (!report)
+            continue;
+
+          page_lines++;
+          report->num_lines++;
+          if (!line_link->last_line)
+            report->wrapped_lines++;
+          if (line_link->para->clipped && line_link->last_line)
+            report->clipped_lines++;
+          if (line_link->width > page_layout->column_width * PANGO_SCALE)
+            report->overflowing_lines++;
         }
-      if (page_layout->lpi > 0.0L)
-        height = (int)(1.0 / page_layout->lpi * 72.0 * PANGO_SCALE);
-      else
-        height = line_link->logical_rect.height;
-      draw_line_to_page(cr,
-                        column_idx,
-                        column_y_pos+height,
-                        page_layout,
-                        line,
-                        draw_wrap_character);
-      column_y_pos += height;
-      pango_lines = pango_lines->next;
-      prev_line_link = line_link;
-    }
-  eject_page(cr);
-  return page_idx;
-}
-
-void eject_column(cairo_t *cr,
+      free_lines(paps, lines);
+    }
+
+  if (report)
+    g_array_append_val(report->lines_per_page, page_lines);
+  input_reader_close(&reader);
+  if (count_document)
+    {
+      paps->stats.documents++;
+      paps->stats.pages += pagination.page_idx;
+    }
+  return pagination.page_idx;
+}
+
+/* Write the report of --format=null as JSON */
+static void
+write_layout_report(paps_t          *paps,
+                    layout_report_t *report,
+                    int              num_pages)
+{
+  GString *json = g_string_new(NULL);
+  guint i;
+
+  g_string_append_printf(json, "{\n  \"pages\": %d,\n", num_pages);
+  g_string_append_printf(json, "  \"lines\": %" G_GUINT64_FORMAT ",\n", report->num_lines);
+  g_string_append(json, "  \"lines_per_page\": [");
+  for (i = 0; i < report->lines_per_page->len; i++)
+    g_string_append_printf(json, "%s%d", i ? ", " : "",
+                           g_array_index(report->lines_per_page, int, i));
+  g_string_append(json, "],\n");
+  g_string_append_printf(json, "  \"wrapped_lines\": %" G_GUINT64_FORMAT ",\n", report->wrapped_lines);
+  g_string_append_printf(json, "  \"clipped_lines\": %" G_GUINT64_FORMAT ",\n", report->clipped_lines);
+  g_string_append_printf(json, "  \"overflowing_lines\": %" G_GUINT64_FORMAT ",\n", report->overflowing_lines);
+  g_string_append_printf(json, "  \"invalid_bytes\": %" G_GUINT64_FORMAT ",\n", report->num_invalid_bytes);
+  g_string_append(json, "  \"invalid_byte_offsets\": [");
+  for (i = 0; i < report->invalid_bytes->len; i++)
+    g_string_append_printf(json, "%s%" G_GUINT64_FORMAT, i ? ", " : "",
+                           g_array_index(report->invalid_bytes, guint64, i));
+  g_string_append(json, "]\n}\n");
+
+  output_write(paps, json->str, json->len);
+  g_string_free(json, TRUE);
+}
+
+void eject_column(paps_t *paps,
+                  cairo_t *cr,
                   double title_height,
                   page_layout_t *page_layout,
                   int column_idx)
@@ -1363,29 +5548,42 @@ void eject_column(cairo_t *cr,
   y_top = page_layout->top_margin + page_layout->header_height + page_layout->header_sep / 2 + title_height;
   y_bot = page_layout->page_height - page_layout->bottom_margin - page_layout->footer_height;
 
+  if (paps->page_forms.lines)
+    {
+      column_separator_t separator = { x_pos, y_top, y_bot };
+
+      g_array_append_val(paps->page_forms.separators, separator);
+      return;
+    }
+
   cairo_move_to(cr,x_pos, y_top);
   cairo_line_to(cr,x_pos, y_bot);
   cairo_set_line_width(cr, 0.1);
   cairo_stroke(cr);
 }
 
-void eject_page(cairo_t *cr)
+void eject_page(paps_t *paps, cairo_t *cr)
 {
-  cairo_show_page(cr);
+  page_forms_flush(paps, cr);
+  if (output_is_raster(paps))
+    raster_write_page(paps, raster_encode_page(paps, cairo_get_target(cr)));
+  else
+    cairo_show_page(cr);
 }
 
-void start_page(cairo_surface_t *surface,
+void start_page(paps_t          *paps,
+                cairo_surface_t *surface,
                 cairo_t *cr,
                 page_layout_t *page_layout)
 {
   cairo_identity_matrix(cr);
 
-  if (output_format == FORMAT_POSTSCRIPT)
+  if (paps->output_format == FORMAT_POSTSCRIPT)
     cairo_ps_surface_dsc_begin_page_setup (surface);
 
   if (page_layout->do_landscape)
     {
-      if (output_format == FORMAT_POSTSCRIPT)
+      if (paps->output_format == FORMAT_POSTSCRIPT)
         {
           cairo_ps_surface_dsc_comment (surface, "%%PageOrientation: Landscape");
           cairo_translate(cr, 0, page_layout->page_width);
@@ -1394,19 +5592,175 @@ void start_page(cairo_surface_t *surface,
     }
   else
     {
-      if (output_format == FORMAT_POSTSCRIPT)
+      if (paps->output_format == FORMAT_POSTSCRIPT)
         cairo_ps_surface_dsc_comment (surface, "%%PageOrientation: Portrait");
     }
 }
 
+static void
+line_form_free(gpointer data)
+{
+  line_form_t *line_form = data;
+
+  if (line_form->form)
+    cairo_surface_destroy(line_form->form);
+  g_free(line_form);
+}
+
+/* Start reusing the lines of the document, for the vector formats, on the
+ * first page */
+static void
+page_forms_init(paps_t *paps)
+{
+  page_forms_t *forms = &paps->page_forms;
+
+  if (forms->lines
+      || (paps->output_format != FORMAT_POSTSCRIPT && paps->output_format != FORMAT_PDF
+          && paps->output_format != FORMAT_SVG))
+    return;
+
+  forms->lines = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, line_form_free);
+  forms->paints = g_array_new(FALSE, FALSE, sizeof(form_paint_t));
+  forms->separators = g_array_new(FALSE, FALSE, sizeof(column_separator_t));
+}
+
+static void
+page_forms_free(paps_t *paps)
+{
+  page_forms_t *forms = &paps->page_forms;
+
+  if (forms->lines == NULL)
+    return;
+
+  g_hash_table_destroy(forms->lines);
+  g_array_free(forms->paints, TRUE);
+  g_array_free(forms->separators, TRUE);
+  forms->lines = NULL;
+}
+
+/* Paint the column separators and the forms of the lines of the page, after
+ * its text. The separators are drawn as one path.
+ */
+static void
+page_forms_flush(paps_t  *paps,
+                 cairo_t *cr)
+{
+  page_forms_t *forms = &paps->page_forms;
+  guint i;
+
+  if (forms->lines == NULL)
+    return;
+
+  for (i = 0; i < forms->separators->len; i++)
+    {
+      column_separator_t *separator = &g_array_index(forms->separators, column_separator_t, i);
+
+      cairo_move_to(cr, separator->x_pos, separator->y_top);
+      cairo_line_to(cr, separator->x_pos, separator->y_bot);
+    }
+  if (forms->separators->len > 0)
+    {
+      cairo_set_line_width(cr, 0.1);
+      cairo_stroke(cr);
+    }
+
+  for (i = 0; i < forms->paints->len; i++)
+    {
+      form_paint_t *paint = &g_array_index(forms->paints, form_paint_t, i);
+
+      cairo_save(cr);
+      cairo_set_source_surface(cr, paint->form, paint->x_pos, paint->y_pos);
+      cairo_paint(cr);
+      cairo_restore(cr);
+    }
+
+  g_array_set_size(forms->separators, 0);
+  g_array_set_size(forms->paints, 0);
+}
+
+/* Count a use of the line, and return the recording of it to paint, with
+ * its origin at the start of its baseline, if it is to be reused. Lines are
+ * told apart by their text and direction, so the layouts in which the same
+ * text may look different, with markup, justification or hyphens, are
+ * left out.
+ */
+static cairo_surface_t *
+line_form_get(paps_t        *paps,
+              page_layout_t *page_layout,
+              LineLink      *line_link)
+{
+  page_forms_t *forms = &paps->page_forms;
+  PangoLayoutLine *line = line_link->pango_line;
+  char key[LINE_FORM_MAX_LENGTH + 2];
+  const char *text;
+  int length;
+  line_form_t *line_form;
+
+  if (forms->lines == NULL || page_layout->do_use_markup || page_layout->do_justify
+      || page_layout->do_show_hyphens)
+    return NULL;
+
+  if (line)
+    {
+      text = pango_layout_get_text(line->layout) + line->start_index;
+      length = line->length;
+    }
+  else
+    {
+      text = line_link->para->text + line_link->offset;
+      length = line_link->length;
+    }
+  if (length < LINE_FORM_MIN_LENGTH || length > LINE_FORM_MAX_LENGTH)
+    return NULL;
+
+  key[0] = line ? '0' + line->resolved_dir : 'a';
+  memcpy(key + 1, text, length);
+  key[length + 1] = '\0';
+  line_form = g_hash_table_lookup(forms->lines, key);
+  if (line_form == NULL)
+    {
+      if (g_hash_table_size(forms->lines) >= LINE_FORMS_MAX)
+        return NULL;
+      line_form = g_new0(line_form_t, 1);
+      g_hash_table_insert(forms->lines, g_strdup(key), line_form);
+    }
+  if (++line_form->uses < LINE_FORM_MIN_USES)
+    return NULL;
+
+  if (line_form->form == NULL)
+    {
+      /* The ink may go beyond the logical extents, give it a line of room */
+      double height = line_link->height / (double)PANGO_SCALE;
+      double width = line ? line_link->width / (double)PANGO_SCALE : length * paps->ascii_engine.advance;
+      cairo_rectangle_t extents = { -height, -2 * height, width + 2 * height, 4 * height };
+      cairo_t *form_cr;
+
+      line_form->form = cairo_recording_surface_create(CAIRO_CONTENT_COLOR_ALPHA, &extents);
+      form_cr = cairo_create(line_form->form);
+      if (line == NULL)
+        ascii_engine_show_line(paps, form_cr, 0, 0, text, length);
+      else
+        {
+          cairo_move_to(form_cr, 0, 0);
+          pango_cairo_show_layout_line(form_cr, line);
+        }
+      cairo_destroy(form_cr);
+    }
+
+  return line_form->form;
+}
+
 void
-draw_line_to_page(cairo_t *cr,
+draw_line_to_page(paps_t        *paps,
+                  cairo_t *cr,
                   int column_idx,
                   int column_pos,
                   page_layout_t *page_layout,
-                  PangoLayoutLine *line,
+                  LineLink *line_link,
                   gboolean draw_wrap_character)
 {
+  PangoLayoutLine *line = line_link->pango_line;
+  cairo_surface_t *form;
   /* Assume square aspect ratio for now */
   double y_pos = page_layout->top_margin
                + page_layout->header_sep
@@ -1414,7 +5768,6 @@ draw_line_to_page(cairo_t *cr,
   double x_pos = page_layout->left_margin
                + column_idx * (page_layout->column_width
                                + page_layout->gutter_width);
-  PangoRectangle ink_rect, logical_rect;
 
   /* Do RTL column layout for RTL direction */
   if (page_layout->pango_dir == PANGO_DIRECTION_RTL)
@@ -1424,133 +5777,214 @@ draw_line_to_page(cairo_t *cr,
         * (page_layout->column_width + page_layout->gutter_width);
     }
   
-  pango_layout_line_get_extents(line,
-                                &ink_rect,
-                                &logical_rect);
+  /* The ASCII engine is only used for LTR text */
+  if (line != NULL && page_layout->pango_dir == PANGO_DIRECTION_RTL)
+    x_pos += page_layout->column_width - line_link->width / PANGO_SCALE;
 
-  if (page_layout->pango_dir == PANGO_DIRECTION_RTL) {
-      x_pos += page_layout->column_width  - logical_rect.width / PANGO_SCALE;
-  }
+  form = line_form_get(paps, page_layout, line_link);
+  if (form)
+    {
+      form_paint_t paint = { form, x_pos, y_pos };
 
-  cairo_move_to(cr, x_pos, y_pos);
-  pango_cairo_show_layout_line(cr, line);
+      g_array_append_val(paps->page_forms.paints, paint);
+    }
+  else if (line == NULL)
+    ascii_engine_show_line(paps, cr, x_pos, y_pos, line_link->para->text + line_link->offset, line_link->length);
+  else
+    {
+      cairo_move_to(cr, x_pos, y_pos);
+      pango_cairo_show_layout_line(cr, line);
+    }
 
   if (draw_wrap_character)
     {
-      cairo_set_font_face(cr, paps_glyph_face);
-      cairo_set_font_size(cr, glyph_font_size);
-
       if (page_layout->pango_dir == PANGO_DIRECTION_LTR)
-        {
-          cairo_move_to(cr, x_pos + page_layout->column_width, y_pos);
-          cairo_show_text(cr, "R");
-        }
+        draw_wrap_marker(paps, cr, x_pos + page_layout->column_width, y_pos, FALSE);
       else
         {
           double left_margin = page_layout->left_margin
             + (page_layout->num_columns-1-column_idx)
             * (page_layout->column_width + page_layout->gutter_width);
 
-          cairo_move_to(cr, left_margin, y_pos); 
-          cairo_show_text(cr, "L");
+          draw_wrap_marker(paps, cr, left_margin, y_pos, TRUE);
         }
     }
 }
 
 /*
- * Provide date string from current locale converted to UTF-8.
+ * Provide the current date string from the locale, converted to UTF-8,
+ * for the header of each document. Free it with g_free().
  */
-char *
-get_date(char *date, int maxlen)
+static gchar *
+get_date(void)
 {
   time_t t;
-  GIConv cvh = NULL;
-  GString *inbuf;
-  char *ib, *ob, obuffer[BUFSIZE * 6], *bp;
-  gsize iblen, oblen;
-  static char *date_utf8 = NULL;
+  struct tm tm;
+  char date[256];
+  gchar *date_utf8;
 
+  /* Renderings may format dates in several threads */
+  t = time(NULL);
+  strftime(date, sizeof(date), "%c", localtime_r(&t, &tm));
+
+  date_utf8 = g_convert(date, -1, "UTF-8", get_encoding(), NULL, NULL, NULL);
   if (date_utf8 == NULL) {
-    t = time(NULL);
-    strftime(date, maxlen, "%c", localtime(&t));
+    fprintf(stderr, _("%1$s: Error while converting date string from '%2$s' to UTF-8.\n"),
+            g_get_prgname(), get_encoding());
+    /* Return the unconverted string. */
+    date_utf8 = g_strdup(date);
+  }
 
-    cvh = g_iconv_open("UTF-8", get_encoding());
-    if (cvh == (GIConv)-1) {
-      fprintf(stderr, _("%s: Invalid encoding: %s\n"), g_get_prgname(), get_encoding());
-      exit(1);
-    }
+  return date_utf8;
+}
 
-    inbuf = g_string_new(NULL);
-    ib = bp = date;
-    iblen = strlen(ib);
-    ob = bp = obuffer;
-    oblen = BUFSIZE * 6 - 1;
+/* Lay out the date and the title of the header, and make the layout of the
+ * page number, on first use. The date is the one the document is laid out
+ * on, as the header is freed after each document by page_header_free().
+ */
+static page_header_t *
+page_header_init(paps_t          *paps,
+                 page_layout_t   *page_layout,
+                 PangoContext    *ctx)
+{
+  gchar *markup, *date;
 
-    if (g_iconv(cvh, &ib, &iblen, &ob, &oblen) == (gsize)-1) {
-      fprintf(stderr, _("%1$s: Error while converting date string from '%2$s' to UTF-8.\n"),
-        g_get_prgname(), get_encoding());
-      /* Return the unconverted string. */
-      g_string_free(inbuf, FALSE);
-      g_iconv_close(cvh);
-      return date;
-    }
+  if (paps->page_header.date_layout)
+    return &paps->page_header;
 
-    obuffer[BUFSIZE * 6 - 1 - oblen] = 0;
-    g_string_append(inbuf, bp);
+  // Three lines:
+  //    1. Date
+  //    2. Filename (title)
+  //    3. Page
+  paps->page_header.date_layout = pango_layout_new(ctx);
+  date = get_date();
+  markup = g_strdup_printf("<span font_desc=\"%s\">%s</span>",
+                           page_layout->header_font_desc,
+                           date);
+  pango_layout_set_markup(paps->page_header.date_layout, markup, -1);
+  g_free(markup);
+  g_free(date);
+  pango_layout_line_get_extents(pango_layout_get_line(paps->page_header.date_layout, 0),
+                                NULL,
+                                &paps->page_header.date_rect);
+
+  paps->page_header.title_layout = pango_layout_new(ctx);
+  markup = g_strdup_printf("<span font_desc=\"%s\">%s</span>",
+                           page_layout->header_font_desc,
+                           page_layout->title);
+  pango_layout_set_markup(paps->page_header.title_layout, markup, -1);
+  g_free(markup);
+  pango_layout_line_get_extents(pango_layout_get_line(paps->page_header.title_layout, 0),
+                                NULL,
+                                &paps->page_header.title_rect);
+
+  paps->page_header.pagenum_layout = new_page_number_layout(page_layout, ctx);
+  paps->page_header.share_decoration = TRUE;
+  paps->page_header.decoration = NULL;
+
+  return &paps->page_header;
+}
 
-    date_utf8 = inbuf->str;
-    g_string_free(inbuf, FALSE);
-    g_iconv_close(cvh);
-  }
+/* The page number is laid out for each page, possibly by several threads,
+ * which need a layout and a context of their own then.
+ */
+static PangoLayout *
+new_page_number_layout(page_layout_t   *page_layout,
+                       PangoContext    *ctx)
+{
+  PangoLayout *layout = pango_layout_new(ctx);
+  PangoFontDescription *font_desc;
 
-  return date_utf8;
+  font_desc = pango_font_description_from_string(page_layout->header_font_desc);
+  pango_layout_set_font_description(layout, font_desc);
+  pango_font_description_free(font_desc);
+
+  return layout;
+}
+
+/* Lay out the line of the date or the title of a header again with ctx,
+ * for a thread of its own, and store its logical extents in rect.
+ */
+static PangoLayout *
+relayout_header_line(PangoLayout     *layout,
+                     PangoContext    *ctx,
+                     PangoRectangle  *rect)
+{
+  PangoLayout *copy = pango_layout_new(ctx);
+
+  pango_layout_set_attributes(copy, pango_layout_get_attributes(layout));
+  pango_layout_set_text(copy, pango_layout_get_text(layout), -1);
+  pango_layout_line_get_extents(pango_layout_get_line(copy, 0), NULL, rect);
+
+  return copy;
+}
+
+static void
+page_header_free(paps_t *paps)
+{
+  if (paps->page_header.date_layout == NULL)
+    return;
+
+  g_object_unref(paps->page_header.date_layout);
+  g_object_unref(paps->page_header.title_layout);
+  g_object_unref(paps->page_header.pagenum_layout);
+  if (paps->page_header.decoration)
+    cairo_surface_destroy(paps->page_header.decoration);
+  paps->page_header.date_layout = NULL;
+}
+
+/* Set the page number of the header and return its line. It is shown as
+ * "page/total" when the number of pages is known, i.e. num_pages > 0.
+ */
+static PangoLayoutLine *
+page_header_set_page(page_header_t   *header,
+                     int              page,
+                     int              num_pages)
+{
+  gchar pagenum[32];
+
+  if (num_pages > 0)
+    g_snprintf(pagenum, sizeof(pagenum), "%d/%d", page, num_pages);
+  else
+    g_snprintf(pagenum, sizeof(pagenum), "%d", page);
+  pango_layout_set_text(header->pagenum_layout, pagenum, -1);
+
+  return pango_layout_get_line(header->pagenum_layout, 0);
+}
+
+/* Height of the header as returned by draw_page_header_line_to_page(),
+ * without drawing it.
+ */
+int
+measure_page_header(paps_t          *paps,
+                    page_layout_t   *page_layout,
+                    PangoContext    *ctx)
+{
+  PangoRectangle logical_rect;
+
+  pango_layout_line_get_extents(page_header_set_page(page_header_init(paps, page_layout, ctx), 1, -1),
+                                NULL,
+                                &logical_rect);
+
+  return logical_rect.height;
 }
 
 int
 draw_page_header_line_to_page(cairo_t         *cr,
                               gboolean         is_footer,
                               page_layout_t   *page_layout,
-                              PangoContext    *ctx,
+                              page_header_t   *header,
                               int              page,
                               int              num_pages)
 {
-  PangoLayout *layout = pango_layout_new(ctx);
   PangoLayoutLine *line;
-  PangoRectangle ink_rect, logical_rect, pagenum_rect;
+  PangoRectangle logical_rect;
   /* Assume square aspect ratio for now */
   double x_pos, y_pos;
-  gchar *header, date[256];
   int height;
   gdouble line_pos;
 
-  /* Reset gravity?? */
-
-  // Three lines:
-  //    1. Date
-  //    2. Filename (title)
-  //    3. Page
-  header = g_strdup_printf("<span font_desc=\"%s\">%s</span>\n"
-                           "<span font_desc=\"%s\">%s</span>\n"
-                           "<span font_desc=\"%s\">%d</span>",
-                           page_layout->header_font_desc,
-                           get_date(date, 255),
-                           page_layout->header_font_desc,
-                           page_layout->title,
-                           page_layout->header_font_desc,
-                           page
-                           );
-
-  pango_layout_set_markup(layout, header, -1);
-  g_free(header);
-
-  /* The title is in the center */
-  line = pango_layout_get_line(layout, 0);
-  pango_layout_line_get_extents(line,
-                                &ink_rect,
-                                &logical_rect);
-  x_pos = page_layout->left_margin;
-
-  height = logical_rect.height / PANGO_SCALE /3.0;
+  height = header->date_rect.height / PANGO_SCALE /3.0;
 
   /* The header is placed right after the margin */
   if (is_footer)
@@ -1564,40 +5998,76 @@ draw_page_header_line_to_page(cairo_t         *cr,
       page_layout->header_height = height;
     }
 
-  cairo_move_to(cr, x_pos,y_pos);
-  pango_cairo_show_layout_line(cr,line);
-
-  /* output a right edge of header/footer */
-  line = pango_layout_get_line(layout, 1);
+  /* The page number is on the right edge */
+  line = page_header_set_page(header, page, num_pages);
   pango_layout_line_get_extents(line,
-                                &ink_rect,
+                                NULL,
                                 &logical_rect);
-  pagenum_rect = logical_rect;
-  x_pos = page_layout->left_margin + (page_layout->page_width-page_layout->left_margin-page_layout->right_margin)*0.5 - 0.5*logical_rect.width/PANGO_SCALE;
+  x_pos = page_layout->page_width - page_layout->right_margin - (logical_rect.width / PANGO_SCALE );
+
   cairo_move_to(cr, x_pos,y_pos);
   pango_cairo_show_layout_line(cr,line);
 
-  /* output a "center" of header/footer */
-  line = pango_layout_get_line(layout, 2);
-  pango_layout_line_get_extents(line,
-                                &ink_rect,
-                                &logical_rect);
-  x_pos = page_layout->page_width - page_layout->right_margin - (logical_rect.width / PANGO_SCALE );
+  line_pos = page_layout->top_margin + page_layout->header_height + page_layout->header_sep;
+  line_pos += logical_rect.height/2.0/PANGO_SCALE;
+
+  /* The rest is the same on every page. Painted from one recording, it is
+   * kept once in the document, as a form XObject in PDF, a form in
+   * PostScript or a <use> of it in SVG. */
+  if (is_footer || !header->share_decoration)
+    draw_page_header_decoration(cr, page_layout, header, y_pos, line_pos);
+  else
+    {
+      if (header->decoration && header->decoration_sep_pos != line_pos)
+        {
+          cairo_surface_destroy(header->decoration);
+          header->decoration = NULL;
+        }
+      if (header->decoration == NULL)
+        {
+          cairo_rectangle_t extents = { 0, 0, page_layout->page_width, page_layout->page_height };
+          cairo_t *decoration_cr;
+
+          header->decoration = cairo_recording_surface_create(CAIRO_CONTENT_COLOR_ALPHA, &extents);
+          header->decoration_sep_pos = line_pos;
+          decoration_cr = cairo_create(header->decoration);
+          draw_page_header_decoration(decoration_cr, page_layout, header, y_pos, line_pos);
+          cairo_destroy(decoration_cr);
+        }
+      cairo_save(cr);
+      cairo_set_source_surface(cr, header->decoration, 0, 0);
+      cairo_paint(cr);
+      cairo_restore(cr);
+    }
+
+  return logical_rect.height;
+}
 
-  //  x_pos = page_layout->page_width - page_layout->right_margin -
-  //      ((logical_rect.width + pagenum_rect.width) / PANGO_SCALE + page_layout->gutter_width);
+/* Draw the date and the title of the header at y_pos, and the separator
+ * below them at sep_pos.
+ */
+static void
+draw_page_header_decoration(cairo_t         *cr,
+                            page_layout_t   *page_layout,
+                            page_header_t   *header,
+                            double           y_pos,
+                            double           sep_pos)
+{
+  double x_pos;
+
+  /* The date is on the left */
+  x_pos = page_layout->left_margin;
   cairo_move_to(cr, x_pos,y_pos);
-  pango_cairo_show_layout_line(cr,line);
+  pango_cairo_show_layout_line(cr, pango_layout_get_line(header->date_layout, 0));
 
-  g_object_unref(layout);
+  /* The title is in the center */
+  x_pos = page_layout->left_margin + (page_layout->page_width-page_layout->left_margin-page_layout->right_margin)*0.5 - 0.5*header->title_rect.width/PANGO_SCALE;
+  cairo_move_to(cr, x_pos,y_pos);
+  pango_cairo_show_layout_line(cr, pango_layout_get_line(header->title_layout, 0));
 
   /* header separator */
-  line_pos = page_layout->top_margin + page_layout->header_height + page_layout->header_sep;
-  line_pos += logical_rect.height/2.0/PANGO_SCALE;
-  cairo_move_to(cr, page_layout->left_margin, line_pos);
-  cairo_line_to(cr,page_layout->page_width - page_layout->right_margin, line_pos);
+  cairo_move_to(cr, page_layout->left_margin, sep_pos);
+  cairo_line_to(cr,page_layout->page_width - page_layout->right_margin, sep_pos);
   cairo_set_line_width(cr,0.1); // TBD
   cairo_stroke(cr);
-
-  return logical_rect.height;
 }
@@ -0,0 +1,71 @@
+/* Pango
+ * paps.h: Rendering text with paps from another program.
+ *
+ * Copyright (C) 2002, 2005 Dov Grobgeld <dov.grobgeld@gmail.com>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ *
+ */
+
+#ifndef PAPS_H
+#define PAPS_H
+
+#include <glib.h>
+
+G_BEGIN_DECLS
+
+/* A context is set up once with the options of the paps command line, and
+ * then renders any number of documents from memory, e.g.
+ *
+ *   char *args[] = { "paps", "--format=pdf", "--header", NULL }, **argv = args;
+ *   int argc = 3;
+ *   paps_t *paps = paps_new (&argc, &argv, &error);
+ *
+ *   paps_render (paps, text, -1, "title", write_func, closure, &error);
+ *   paps_free (paps);
+ *
+ * The options are those of paps(1), apart from --output, --batch,
+ * --checkpoint and --follow, and --g-fatal-warnings, which leaves the
+ * logging of the program alone. The output of --count-pages and
+ * --format=null is written like any other. Errors in the text or in
+ * writing the output make paps_render() return FALSE with an error of the
+ * G_CONVERT_ERROR or G_FILE_ERROR domain, after which the context may be
+ * used again.
+ */
+typedef struct _paps_t paps_t;
+
+/* Called with the output as it is produced. Returns FALSE if it could not
+ * be written, which makes the rendering fail.
+ */
+typedef gboolean (*paps_write_func_t) (gpointer      closure,
+                                       const guchar *data,
+                                       gsize         length);
+
+paps_t       *paps_new              (int                *argc,
+                                     char             ***argv,
+                                     GError            **error);
+gboolean      paps_render           (paps_t             *paps,
+                                     const gchar        *text,
+                                     gssize              length,
+                                     const gchar        *title,
+                                     paps_write_func_t   write_func,
+                                     gpointer            closure,
+                                     GError            **error);
+void          paps_free             (paps_t             *paps);
+
+G_END_DECLS
+
+#endif /* PAPS_H */